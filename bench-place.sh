@@ -0,0 +1,34 @@
+#!/bin/sh
+# Pipeline bandwidth under each CPU placement policy of dsh (see place.c):
+# pushes MB megabytes of zeros through STAGES cat stages, run by a dsh in
+# batch mode, ROUNDS times per policy, and prints the best MB/s of each.
+#
+#     sh bench-place.sh [MB [STAGES [ROUNDS]]]      (make bench)
+
+MB=${1:-1024}
+STAGES=${2:-3}
+ROUNDS=${3:-3}
+DSH=${DSH:-./dsh}
+
+pipeline="head -c $((MB * 1048576)) /dev/zero"
+i=0
+while [ $i -lt "$STAGES" ]; do
+    pipeline="$pipeline | cat"
+    i=$((i + 1))
+done
+pipeline="$pipeline > /dev/null"
+
+echo "$pipeline"
+for policy in off pack spread; do
+    best=0
+    round=0
+    while [ $round -lt "$ROUNDS" ]; do
+        start=$(date +%s%N)
+        printf 'place %s\n%s\n' "$policy" "$pipeline" | "$DSH" > /dev/null 2>&1
+        end=$(date +%s%N)
+        rate=$((MB * 1000000000 / (end - start)))
+        [ $rate -gt $best ] && best=$rate
+        round=$((round + 1))
+    done
+    printf '%-8s %6d MB/s\n' "$policy" "$best"
+done
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Stage-to-stage bandwidth over pipes and over the shared-memory rings of
+# dsh (see shmpipe.c): pushes MB megabytes through STAGES dsh-ringcat
+# stages, run by a dsh in batch mode, ROUNDS times each way, and prints the
+# best MB/s of each.
+#
+#     sh bench-ring.sh [MB [STAGES [ROUNDS]]]       (make bench)
+
+MB=${1:-4096}
+STAGES=${2:-2}
+ROUNDS=${3:-3}
+DSH=${DSH:-./dsh}
+RINGCAT=${RINGCAT:-./dsh-ringcat}
+
+pipeline="$RINGCAT ${MB}m"
+i=0
+while [ $i -lt "$STAGES" ]; do
+    pipeline="$pipeline | $RINGCAT"
+    i=$((i + 1))
+done
+pipeline="$pipeline > /dev/null"
+
+echo "$pipeline"
+for transport in off on; do
+    best=0
+    round=0
+    while [ $round -lt "$ROUNDS" ]; do
+        start=$(date +%s%N)
+        printf 'shmpipe %s\n%s\n' "$transport" "$pipeline" | "$DSH" > /dev/null 2>&1
+        end=$(date +%s%N)
+        rate=$((MB * 1000000000 / (end - start)))
+        [ $rate -gt $best ] && best=$rate
+        round=$((round + 1))
+    done
+    [ $transport = off ] && name=pipes || name=rings
+    printf '%-8s %6d MB/s\n' "$name" "$best"
+done
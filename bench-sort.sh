@@ -0,0 +1,52 @@
+#!/bin/sh
+# The sort builtin of dsh (sort.c) next to coreutils sort: the best time
+# of ROUNDS runs over random text of each of SIZES megabytes, with each of
+# THREADS threads, in memory and spilled to disk (-S SPILL), in the locale
+# BENCH_LOCALE (C by default) for both. dsh -c runs the builtin in place of
+# dsh, so the times compare the two sorts and not the start of a shell.
+#
+#     sh bench-sort.sh [SIZES [THREADS [ROUNDS]]]       (make bench)
+#     BENCH_LOCALE=C.utf8 sh bench-sort.sh "16 128" "1 4" 3
+
+SIZES=${1:-"8 64"}
+THREADS=${2:-"1 $(nproc)"}
+ROUNDS=${3:-3}
+SPILL=${SPILL:-4M}
+DSH=${DSH:-./dsh}
+SORT=${SORT:-/usr/bin/sort}
+INPUT=${TMPDIR:-/tmp}/bench-sort.$$
+LC_ALL=${BENCH_LOCALE:-C}
+export LC_ALL
+
+# best of ROUNDS, in ms
+best() {
+    min=0
+    round=0
+    while [ $round -lt "$ROUNDS" ]; do
+        start=$(date +%s%N)
+        "$@" > /dev/null 2>&1
+        end=$(date +%s%N)
+        ms=$(((end - start) / 1000000))
+        [ $min -eq 0 ] || [ $ms -lt $min ] && min=$ms
+        round=$((round + 1))
+    done
+    echo $min
+}
+
+printf '%6s %7s %-6s %10s %10s %7s\n' MB threads memory "dsh ms" "sort ms" ratio
+for mb in $SIZES; do
+    # lines of 8 to 72 random characters
+    head -c $((mb * 1024 * 1024 * 3 / 4)) /dev/urandom | base64 -w 0 |
+        fold -w 80 | awk '{ print substr($0, 1, 8 + length($0) * (NR % 9) / 9) }' |
+        head -c $((mb * 1024 * 1024)) > "$INPUT"
+    for threads in $THREADS; do
+        for memory in 256M "$SPILL"; do
+            flags="--parallel=$threads -S $memory"
+            dsh=$(best "$DSH" -c "sort $flags $INPUT")
+            sort=$(best "$SORT" $flags "$INPUT")
+            printf '%6d %7d %-6s %10d %10d %7s\n' "$mb" "$threads" "$memory" "$dsh" "$sort" \
+                "$(awk -v a="$dsh" -v b="$sort" 'BEGIN { printf "%.2f", b ? a / b : 0 }')"
+        done
+    done
+done
+rm -f "$INPUT"
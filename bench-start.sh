@@ -0,0 +1,34 @@
+#!/bin/sh
+# Cold start of dsh as a sh -c replacement: the mean time from exec'ing it
+# to its command having run, over N runs, next to running the program
+# directly and through sh -c. The -c line is exec'ed in place of dsh; the
+# script runs it in a forked child, as for any line but the last of -c.
+#
+#     sh bench-start.sh [N]      (make bench)
+
+N=${1:-1000}
+DSH=${DSH:-./dsh}
+SCRIPT=${TMPDIR:-/tmp}/bench-start.$$.dsh
+
+TRUE=/bin/true
+printf '#!%s\n%s\n' "$DSH" "$TRUE" > "$SCRIPT"
+
+run() {
+    label=$1
+    shift
+    i=0
+    start=$(date +%s%N)
+    while [ $i -lt "$N" ]; do
+        "$@" > /dev/null 2>&1
+        i=$((i + 1))
+    done
+    end=$(date +%s%N)
+    printf '%-22s %8d us\n' "$label" $(((end - start) / N / 1000))
+}
+
+run "true" $TRUE
+run "sh -c true" sh -c $TRUE
+run "dsh -c true" "$DSH" -c $TRUE
+run "dsh -c 'true; true'" "$DSH" -c "$TRUE; $TRUE"
+run "dsh script" "$DSH" "$SCRIPT"
+rm -f "$SCRIPT"
@@ -0,0 +1,379 @@
+#include "dsh.h"
+#include <limits.h>
+#include <dirent.h>
+
+/* Per-job cgroups. With cgroups on (DSH_CGROUP or "cgroup on") and a
+ * writable cgroup v2 hierarchy, dsh makes a cgroup dsh-<pid> inside the
+ * one it was started in and moves itself into dsh-<pid>/shell: a cgroup
+ * that has processes cannot hand controllers down to its children. Once
+ * dsh is out of it, the cgroup it started in hands its controllers down to
+ * dsh-<pid> too (its cgroup.subtree_control), if nothing else runs in it,
+ * and dsh turns them off there again when it exits. Every job then gets
+ * dsh-<pid>/job-<n>, which each of its processes enters between fork and
+ * exec, so a job's limits hold for all of its pipeline and for whatever it
+ * forks in turn.
+ *
+ * The cgroup builtin sets cpu.max, memory.max and the io weight of a job.
+ * Once the last process of a job is reaped its CPU time and memory peak
+ * are read from cpu.stat and memory.peak, and its cgroup is removed. The
+ * cgroups of jobs that still run when dsh exits are left behind.
+ */
+
+#define CGROUP_PERIOD 100000        /* cpu.max period, us */
+#define CGROUP_LINE   256
+
+static bool cgroup_enabled = false;
+static int cgroup_root = -1;        /* dsh-<pid>, kept until dsh exits */
+static char cgroup_base[PATH_MAX];  /* the cgroup dsh was started in */
+static char cgroup_path[PATH_MAX];  /* dsh-<pid> */
+static pid_t cgroup_pid;            /* process that removes them at exit */
+static unsigned cgroup_count;       /* numbers the job cgroups */
+
+static const char *controllers[] = { "cpu", "memory", "io", "pids" };
+static unsigned base_delegated;     /* controllers dsh enabled in cgroup_base */
+
+/* Writes value to file under the directory dir */
+static bool cgroup_write(int dir, const char *file, const char *value) {
+    int fd = openat(dir, file, O_WRONLY | O_CLOEXEC);
+    ssize_t n;
+    if (fd < 0)
+        return false;
+    n = write(fd, value, strlen(value));
+    close(fd);
+    return n == (ssize_t) strlen(value);
+}
+
+static bool cgroup_read(int dir, const char *file, char *buf, size_t size) {
+    int fd = openat(dir, file, O_RDONLY | O_CLOEXEC);
+    ssize_t n;
+    if (fd < 0)
+        return false;
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0)
+        return false;
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return true;
+}
+
+/* Value of key in a flat keyed file such as cpu.stat, or 0 */
+static uint64_t cgroup_key(int dir, const char *file, const char *key) {
+    char buf[1024], *line;
+    size_t len = strlen(key);
+    int fd = openat(dir, file, O_RDONLY | O_CLOEXEC);
+    ssize_t n;
+    if (fd < 0)
+        return 0;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    for (line = buf; line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL)
+        if (!strncmp(line, key, len) && line[len] == ' ')
+            return strtoull(line + len + 1, NULL, 10);
+    return 0;
+}
+
+/* Finds where the cgroup v2 hierarchy is mounted and the cgroup dsh runs
+ * in, from /proc/self/mountinfo and /proc/self/cgroup */
+static bool cgroup_find_base() {
+    char line[PATH_MAX + 256], mount[PATH_MAX] = "", path[PATH_MAX] = "";
+    FILE *f;
+
+    if ((f = fopen("/proc/self/mountinfo", "re")) == NULL)
+        return false;
+    while (fgets(line, sizeof(line), f)) {
+        if (strstr(line, " - cgroup2 ") && sscanf(line, "%*s %*s %*s %*s %4095s", mount) == 1)
+            break;
+        mount[0] = '\0';
+    }
+    fclose(f);
+    if ((f = fopen("/proc/self/cgroup", "re")) == NULL)
+        return false;
+    while (fgets(line, sizeof(line), f))
+        if (!strncmp(line, "0::", 3)) {
+            line[strcspn(line, "\n")] = '\0';
+            if (snprintf(path, sizeof(path), "%s", line + 3) >= (int) sizeof(path))
+                path[0] = '\0';
+            break;
+        }
+    fclose(f);
+    if (!mount[0] || !path[0])
+        return false;
+    return snprintf(cgroup_base, sizeof(cgroup_base), "%s%s", mount,
+                    strcmp(path, "/") ? path : "") < (int) sizeof(cgroup_base);
+}
+
+/* true if the space separated list has word */
+static bool cgroup_has(const char *list, const char *word) {
+    size_t len = strlen(word);
+    const char *at;
+    for (at = strstr(list, word); at; at = strstr(at + 1, word))
+        if ((at == list || at[-1] == ' ') && (at[len] == ' ' || at[len] == '\0'))
+            return true;
+    return false;
+}
+
+/* Hands the controllers the cgroup dir has down to its children; returns
+ * those that were not handed down already, as a mask of controllers[] */
+static unsigned cgroup_delegate(int dir) {
+    char available[CGROUP_LINE], enabled[CGROUP_LINE], enable[16];
+    unsigned i, mask = 0;
+    if (!cgroup_read(dir, "cgroup.controllers", available, sizeof(available)) ||
+        !cgroup_read(dir, "cgroup.subtree_control", enabled, sizeof(enabled)))
+        return 0;
+    for (i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++) {
+        if (!cgroup_has(available, controllers[i]) || cgroup_has(enabled, controllers[i]))
+            continue;
+        snprintf(enable, sizeof(enable), "+%s", controllers[i]);
+        if (cgroup_write(dir, "cgroup.subtree_control", enable))
+            mask |= 1 << i;
+    }
+    return mask;
+}
+
+/* Moves dsh back where it was started and removes the cgroups it made */
+static void cgroup_cleanup() {
+    DIR *dir;
+    struct dirent *entry;
+    int base, fd;
+
+    if (cgroup_root < 0 || getpid() != cgroup_pid)
+        return;
+    /* a cgroup that hands controllers down cannot take processes back */
+    if ((base = fd_open(cgroup_base, O_RDONLY | O_DIRECTORY, 0)) >= 0) {
+        char disable[16];
+        unsigned i;
+        for (i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++)
+            if (base_delegated & 1 << i) {
+                snprintf(disable, sizeof(disable), "-%s", controllers[i]);
+                cgroup_write(base, "cgroup.subtree_control", disable);
+            }
+        cgroup_write(base, "cgroup.procs", "0");
+        close(base);
+    }
+    if ((fd = fd_dup(cgroup_root)) >= 0 && (dir = fdopendir(fd)) != NULL) {
+        while ((entry = readdir(dir)) != NULL)
+            if (entry->d_type == DT_DIR && entry->d_name[0] != '.')
+                unlinkat(cgroup_root, entry->d_name, AT_REMOVEDIR);
+        closedir(dir);
+    }
+    close(cgroup_root);
+    cgroup_root = -1;
+    rmdir(cgroup_path);
+}
+
+/* Turns the per-job cgroups on, setting up dsh-<pid> the first time */
+bool cgroup_on() {
+    char shell[PATH_MAX + 8];
+    int base, fd;
+
+    if (cgroup_root >= 0) {
+        cgroup_enabled = true;
+        return true;
+    }
+    if (!cgroup_find_base())
+        return false;
+    if (snprintf(cgroup_path, sizeof(cgroup_path), "%s/dsh-%d", cgroup_base, (int) getpid()) >=
+        (int) sizeof(cgroup_path))
+        return false;
+    snprintf(shell, sizeof(shell), "%s/shell", cgroup_path);
+    if (mkdir(cgroup_path, 0755) < 0 && errno != EEXIST)
+        return false;
+    if ((cgroup_root = fd_open(cgroup_path, O_RDONLY | O_DIRECTORY, 0)) < 0 ||
+        (mkdirat(cgroup_root, "shell", 0755) < 0 && errno != EEXIST) ||
+        (fd = fd_open(shell, O_RDONLY | O_DIRECTORY, 0)) < 0) {
+        if (cgroup_root >= 0)
+            close(cgroup_root);
+        cgroup_root = -1;
+        rmdir(cgroup_path);
+        return false;
+    }
+    cgroup_pid = getpid();
+    if (!cgroup_write(fd, "cgroup.procs", "0")) {
+        close(fd);
+        cgroup_cleanup();
+        return false;
+    }
+    close(fd);
+    /* with dsh out of it, the cgroup it started in may now be able to
+     * enable controllers for dsh-<pid>, if nothing else runs in it */
+    if ((base = fd_open(cgroup_base, O_RDONLY | O_DIRECTORY, 0)) >= 0) {
+        base_delegated = cgroup_delegate(base);
+        close(base);
+    }
+    cgroup_delegate(cgroup_root);
+    atexit(cgroup_cleanup);
+    cgroup_enabled = true;
+    return true;
+}
+
+/* Gives a job that is about to be launched a cgroup of its own */
+void cgroup_job(job_t *j) {
+    char name[32];
+    if (!cgroup_enabled || j->cgroup >= 0)
+        return;
+    j->cgroup_id = __atomic_add_fetch(&cgroup_count, 1, __ATOMIC_RELAXED);
+    snprintf(name, sizeof(name), "job-%u", j->cgroup_id);
+    if (mkdirat(cgroup_root, name, 0755) < 0 ||
+        (j->cgroup = openat(cgroup_root, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        logger(STDERR_FILENO, "Could not create the cgroup of %s: %s", j->commandinfo, strerror(errno));
+        j->cgroup = -1;
+    }
+}
+
+/* Moves process pid of job j into the job's cgroup. Both dsh and the child
+ * do it, as with the process group, so that the child is in it before it
+ * execs and before dsh goes on. */
+bool cgroup_enter(job_t *j, pid_t pid) {
+    char value[16];
+    if (j->cgroup < 0)
+        return true;
+    snprintf(value, sizeof(value), "%d", (int) pid);
+    return cgroup_write(j->cgroup, "cgroup.procs", value);
+}
+
+/* Removes the cgroup of a job; it stays while processes the job left
+ * behind still run in it */
+static void cgroup_remove(job_t *j) {
+    char name[32];
+    snprintf(name, sizeof(name), "job-%u", j->cgroup_id);
+    close(j->cgroup);
+    j->cgroup = -1;
+    if (cgroup_root >= 0)
+        unlinkat(cgroup_root, name, AT_REMOVEDIR);
+}
+
+/* Called for every process dsh reaps: once the job is done, keeps what it
+ * used and removes its cgroup */
+void cgroup_reaped(job_t *j, process_t *p) {
+    char peak[CGROUP_LINE];
+    if (j->cgroup < 0 || !job_is_completed(j))
+        return;
+    j->cpu_usec = cgroup_key(j->cgroup, "cpu.stat", "usage_usec");
+    j->memory_peak = 0;
+    if (cgroup_read(j->cgroup, "memory.peak", peak, sizeof(peak)))
+        j->memory_peak = strtoull(peak, NULL, 10);
+    stats_record(STATS_JOB_CPU, j->cpu_usec * 1000);
+    cgroup_remove(j);
+}
+
+/* Called by free_job() for a job that was not reaped, queued jobs */
+void cgroup_release(job_t *j) {
+    if (j->cgroup >= 0)
+        cgroup_remove(j);
+}
+
+/* Sets a limit of job j; value is what the user typed */
+static void cgroup_limit(job_t *j, const char *what, const char *value) {
+    char buf[64], *end;
+    const char *file;
+    double amount = strtod(value, &end);
+
+    if (!strcmp(what, "cpu")) {     /* percent of one CPU */
+        file = "cpu.max";
+        if (!strcmp(value, "max"))
+            snprintf(buf, sizeof(buf), "max %d", CGROUP_PERIOD);
+        else if (amount > 0 && (!*end || !strcmp(end, "%")))
+            snprintf(buf, sizeof(buf), "%lld %d", (long long) (amount * CGROUP_PERIOD / 100), CGROUP_PERIOD);
+        else
+            goto usage;
+    }
+    else if (!strcmp(what, "mem")) {
+        file = "memory.max";
+        if (!strcmp(value, "max"))
+            snprintf(buf, sizeof(buf), "max");
+        else if (amount > 0 && strlen(end) <= 1 && strchr("kKmMgG", *end)) {
+            switch (*end) {
+                case 'k': case 'K': amount *= 1024; break;
+                case 'm': case 'M': amount *= 1024 * 1024; break;
+                case 'g': case 'G': amount *= 1024 * 1024 * 1024; break;
+            }
+            snprintf(buf, sizeof(buf), "%llu", (unsigned long long) amount);
+        }
+        else
+            goto usage;
+    }
+    else if (!strcmp(what, "io")) {
+        file = "io.weight";
+        if (*end || amount < 1 || amount > 10000)
+            goto usage;
+        snprintf(buf, sizeof(buf), "default %d", (int) amount);
+    }
+    else
+        goto usage;
+
+    if (!cgroup_write(j->cgroup, file, buf) &&
+        /* the weight of the BFQ scheduler where io.weight is missing */
+        !(file[0] == 'i' && cgroup_write(j->cgroup, "io.bfq.weight", buf + strlen("default "))))
+        logger(STDERR_FILENO, "Error: could not write %s to %s: %s", buf, file, strerror(errno));
+    return;
+usage:
+    logger(STDERR_FILENO, "Error: usage: cgroup cpu N PERCENT|max, cgroup mem N BYTES[kmg]|max, cgroup io N 1-10000");
+}
+
+static void cgroup_show(FILE *out) {
+    char cpu_max[CGROUP_LINE], memory_max[CGROUP_LINE], peak[CGROUP_LINE];
+    job_t *j;
+    int pos = 1;
+
+    if (cgroup_root < 0) {
+        fprintf(out, "cgroups: off\n");
+        return;
+    }
+    cgroup_read(cgroup_root, "cgroup.subtree_control", peak, sizeof(peak));
+    fprintf(out, "cgroups: %s, %s (controllers: %s)\n", cgroup_enabled ? "on" : "off",
+            cgroup_path, peak[0] ? peak : "none");
+    for (j = job_head; j; j = j->next, pos++) {
+        uint64_t cpu = j->cpu_usec, memory = j->memory_peak;
+        if (j->cgroup >= 0) {
+            cpu = cgroup_key(j->cgroup, "cpu.stat", "usage_usec");
+            memory = cgroup_read(j->cgroup, "memory.peak", peak, sizeof(peak)) ? strtoull(peak, NULL, 10) : 0;
+            if (!cgroup_read(j->cgroup, "cpu.max", cpu_max, sizeof(cpu_max)))
+                strcpy(cpu_max, "-");
+            if (!cgroup_read(j->cgroup, "memory.max", memory_max, sizeof(memory_max)))
+                strcpy(memory_max, "-");
+        }
+        else if (j->cgroup_id == 0)
+            continue;
+        else {
+            strcpy(cpu_max, "-");
+            strcpy(memory_max, "-");
+        }
+        fprintf(out, "[%d] job-%-4u cpu %8.3fs  memory peak %8lluKB  cpu.max %-14s memory.max %-10s %s\n",
+                pos, j->cgroup_id, cpu / 1e6, (unsigned long long) memory / 1024,
+                cpu_max, memory_max, j->commandinfo);
+    }
+}
+
+/* The cgroup builtin:
+ *     cgroup                      shows the cgroups of the session's jobs
+ *     cgroup on | off             per-job cgroups for the jobs started from now on
+ *     cgroup cpu N PERCENT|max    cpu.max of job N, in percent of one CPU
+ *     cgroup mem N BYTES|max      memory.max of job N, with an optional k, m or g
+ *     cgroup io N WEIGHT          io weight of job N, 1 to 10000 */
+void cgroup_cmd(int argc, char **argv) {
+    FILE *out = current_session ? current_session->out : stdout;
+    job_t *j;
+
+    if (argc == 1) {
+        cgroup_show(out);
+        fflush(out);
+    }
+    else if (argc == 2 && !strcmp(argv[1], "on")) {
+        if (!cgroup_on())
+            logger(STDERR_FILENO, "Error: no writable cgroup v2 hierarchy: %s", strerror(errno));
+    }
+    else if (argc == 2 && !strcmp(argv[1], "off"))
+        cgroup_enabled = false;
+    else if (argc == 4) {
+        if (!(j = search_job_pos(atoi(argv[2]))) || j->cgroup < 0)
+            logger(STDERR_FILENO, "Error: job %s has no cgroup", argv[2]);
+        else
+            cgroup_limit(j, argv[1], argv[3]);
+    }
+    else
+        logger(STDERR_FILENO, "Error: usage: cgroup [on | off | cpu N PERCENT|max | mem N BYTES|max | io N WEIGHT]");
+}
@@ -0,0 +1,218 @@
+#include "dsh.h"
+#include <pthread.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+/* Compile-and-run of C and C++ sources: a command whose name ends in .c or
+ * .cpp is compiled with gcc or g++ by dsh before the job is forked, then
+ * run.
+ *
+ * In memory mode, the default where memfd_create() exists, the compiler
+ * writes the program to a memfd that the child runs with fexecve(): nothing
+ * is written to the working directory, which may be read-only. The memfd is
+ * sealed and kept in a cache by source file (device, inode, size and mtime),
+ * so running the same source again skips the compiler until it changes.
+ * In disk mode the program is written next to the source, as foo for foo.c,
+ * and run from there.
+ */
+
+#define COMPILE_CACHE 32            /* programs kept in memory */
+
+typedef struct compiled {
+    struct compiled *next;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char *source;
+    int fd;                         /* the sealed memfd */
+    unsigned runs;
+} compiled_t;
+
+#ifdef __linux__
+bool compile_in_memory = true;
+#else
+bool compile_in_memory = false;
+#endif
+
+static compiled_t *cache;           /* most recently used first */
+static int cache_count;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* true if the command is a source file compile() handles */
+static bool is_source(const char *name) {
+    return endswith(name, ".c") || endswith(name, ".cpp");
+}
+
+/* Runs the compiler for source with output as -o, in the directory of the
+ * session; out is a descriptor it inherits, or -1. The compiler writes its
+ * errors where the job writes its own. */
+static bool run_compiler(job_t *j, const char *source, const char *output, int out) {
+    char *argv[] = { endswith(source, ".cpp") ? "g++" : "gcc", "-o", (char *) output, (char *) source, NULL };
+    int status, err = j->mystderr != STDERR_FILENO ? j->mystderr :
+                      current_session ? current_session->fd : STDERR_FILENO;
+    pid_t pid;
+
+    fflush(stdout);
+    switch (pid = fork()) {
+        case -1:
+            logger(STDERR_FILENO, "Fork failure at compiler");
+            return false;
+        case 0:
+            if (out >= 0)
+                fcntl(out, F_SETFD, 0);
+            if (err != STDERR_FILENO)
+                dup2(err, STDERR_FILENO);
+            if (current_session && fchdir(current_session->cwd) < 0)
+                _exit(127);
+            execvp(argv[0], argv);
+            _exit(127);
+    }
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+#ifdef __linux__
+/* Compiles source to a sealed memfd; returns it, or -1 */
+static int compile_memfd(job_t *j, const char *source) {
+    char output[64];
+    int fd = memfd_create(source, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return -1;
+    /* the linker opens the path again, which reopens the memfd */
+    snprintf(output, sizeof(output), "/proc/self/fd/%d", fd);
+    if (!run_compiler(j, source, output, fd)) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    return fd;
+}
+
+/* The program for source from the cache, compiling it on a miss. Returns a
+ * descriptor of its own for the caller, or -1. */
+static int compile_cached(job_t *j, const char *source) {
+    struct stat st;
+    compiled_t *c, **link;
+    int fd;
+
+    if (fstatat(current_session ? current_session->cwd : AT_FDCWD, source, &st, 0) < 0)
+        return -1;
+    pthread_mutex_lock(&cache_lock);
+    for (link = &cache; (c = *link) != NULL; link = &c->next)
+        if (c->dev == st.st_dev && c->ino == st.st_ino && c->size == st.st_size &&
+            c->mtime.tv_sec == st.st_mtim.tv_sec && c->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            *link = c->next;            /* to the front */
+            c->next = cache;
+            cache = c;
+            c->runs++;
+            fd = fd_dup(c->fd);
+            pthread_mutex_unlock(&cache_lock);
+            return fd;
+        }
+    pthread_mutex_unlock(&cache_lock);
+
+    /* compiled without the lock: two sessions may compile the same source
+     * at once, the cache then keeps both until one is evicted */
+    if ((fd = compile_memfd(j, source)) < 0 || !(c = calloc(1, sizeof(compiled_t))))
+        return fd;
+    *c = (compiled_t) { NULL, st.st_dev, st.st_ino, st.st_size, st.st_mtim, strdup(source), fd, 1 };
+    pthread_mutex_lock(&cache_lock);
+    c->next = cache;
+    cache = c;
+    if (++cache_count > COMPILE_CACHE) {
+        for (link = &cache; (*link)->next; link = &(*link)->next)
+            ;
+        close((*link)->fd);
+        free((*link)->source);
+        free(*link);
+        *link = NULL;
+        cache_count--;
+    }
+    fd = fd_dup(c->fd);
+    pthread_mutex_unlock(&cache_lock);
+    return fd;
+}
+#endif
+
+/* Called by dsh for every process of a job before it is forked: compiles
+ * the program when the command is a C or C++ source. In memory mode
+ * p->exec_fd is then the program for exec() to run; in disk mode
+ * argv[0] is changed to it. */
+void compile(job_t *j, process_t *p) {
+    char *source = p->argv[0];
+    double start;
+
+    if (!is_source(source))
+        return;
+    start = trace_clock();
+#ifdef __linux__
+    if (compile_in_memory) {
+        if ((p->exec_fd = compile_cached(j, source)) < 0)
+            logger(STDERR_FILENO, "Could not compile %s", source);
+        trace_span("compile", source, getpgrp(), getpid(), start);
+        return;
+    }
+#endif
+    {
+        size_t length = strrchr(source, '.') - source;
+        char *program = malloc(length + 3);
+        if (program == NULL)
+            return;
+        snprintf(program, length + 3, "./%.*s", (int) length, source);
+        if (run_compiler(j, source, program + 2, -1)) {
+            free(p->argv[0]);
+            p->argv[0] = program;
+        } else {
+            logger(STDERR_FILENO, "Could not compile %s", source);
+            free(program);
+        }
+    }
+    trace_span("compile", source, getpgrp(), getpid(), start);
+}
+
+/* The compile builtin:
+ *     compile                  shows the mode and the programs kept in memory
+ *     compile memory | disk    where the programs compiled from now on go
+ *     compile flush            forgets the programs kept in memory */
+void compile_cmd(int argc, char **argv) {
+    FILE *out = current_session ? current_session->out : stdout;
+    compiled_t *c;
+
+    if (argc == 1) {
+        pthread_mutex_lock(&cache_lock);
+        fprintf(out, "compiling to %s, %d of %d programs kept\n",
+                compile_in_memory ? "memory" : "disk", cache_count, COMPILE_CACHE);
+        for (c = cache; c; c = c->next)
+            fprintf(out, "%-32s %8lld bytes  %u runs\n", c->source,
+                    (long long) lseek(c->fd, 0, SEEK_END), c->runs);
+        pthread_mutex_unlock(&cache_lock);
+        fflush(out);
+    }
+    else if (argc == 2 && !strcmp(argv[1], "memory")) {
+#ifdef __linux__
+        compile_in_memory = true;
+#else
+        logger(STDERR_FILENO, "Error: compiling to memory needs memfd_create()");
+#endif
+    }
+    else if (argc == 2 && !strcmp(argv[1], "disk"))
+        compile_in_memory = false;
+    else if (argc == 2 && !strcmp(argv[1], "flush")) {
+        pthread_mutex_lock(&cache_lock);
+        while ((c = cache) != NULL) {
+            cache = c->next;
+            close(c->fd);
+            free(c->source);
+            free(c);
+        }
+        cache_count = 0;
+        pthread_mutex_unlock(&cache_lock);
+    }
+    else
+        logger(STDERR_FILENO, "Error: usage: compile [memory | disk | flush]");
+}
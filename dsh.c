@@ -1,6 +1,7 @@
 #include "dsh.h"
 #include <time.h>
 #include <stdarg.h>
+#include <sys/resource.h>
 
 
 /* enviroment map */
@@ -11,10 +12,9 @@ static char prompt_msg [20];
 
 static const char *LOG_FILENAME = "dsh.log";
 
-static const int PIPE_READ = 0;
-static const int PIPE_WRITE = 1;
-
-typedef int pipe_t[2]; /* Defines a pipe */
+/* initial size of the buffer holding the output of a $( ) substitution;
+ * it doubles whenever less than this amount is free */
+#define CAPTURE_CHUNK 4096
 
 /* resume a stopped job */
 void continue_job(job_t *j);
@@ -22,28 +22,50 @@ void continue_job(job_t *j);
 /* spawn a new job */
 void spawn_job(job_t *j, bool fg);
 
+/* forks the processes of a job without adding it to the job list */
+bool launch_job(job_t *j, bool fg);
+
+/* runs a command line and returns everything it wrote to stdout */
+char *capture_output(char *cmdline);
+
+/* expands the $( ) substitutions in the arguments of a job */
+bool expand_substitutions(job_t *j);
+
 /*frees a job*/
 bool free_job(job_t *j);
 
 /* Execute a program form the shell */
 void exec(process_t *p);
 
-/* compiles code written in c or cpp usign gcc*/
-void compile (process_t *p);
 
 /* writes a log file */
 void logger(int fd, const char *str, ...);
 /* Prints the processes running in background */
 void print_jobs();
 
-/* points to the head of a jobs linked list */
-job_t *job_head = NULL;
+/* points to the head of a jobs linked list; one list per thread, as each
+ * server session is served by a single thread from start to end */
+__thread job_t *job_head = NULL;
+
+__thread session_t *current_session = NULL;
+
+/* exit status of the last builtin, 0 unless the builtin sets it */
+__thread int builtin_status = 0;
+
+/* true in libdsh, and in dsh -c and scripts: dsh does not print its
+ * messages on stdout and children keep the stderr they were given instead
+ * of writing to dsh.log */
+#ifdef DSH_LIBRARY
+bool dsh_embedded = true;
+#else
+bool dsh_embedded = false;
+#endif
 
 /* points to the head of a jobs linked list */
 job_t *last_job = NULL;
 
 /*Determines whether dsh is interactive or not*/
-int dsh_is_interactive;
+extern int dsh_is_interactive;
 
 /* finds and returns a job given a jid*/
 job_t *search_job (int jid);
@@ -62,6 +84,9 @@ void add_job(job_t *j);
 /* Remove zombies*/
 void remove_zombies();
 
+/* Collects the status of children that changed state, without blocking */
+void reap_children();
+
 void io_redirection(process_t *process);
 
 void add_job(job_t *j){
@@ -104,6 +129,10 @@ void new_child(job_t *j, process_t *p, bool fg)
     
     /* also establish child process group in child to avoid race (if parent has not done it yet). */
     set_child_pgid(j, p);
+    sched_apply(j);
+    place_apply(p);
+    if (!cgroup_enter(j, p->pid))
+        child_error("Could not enter cgroup job-%u", j->cgroup_id);
     
     if(fg && isatty(STDIN_FILENO)){// if fg is set and program has terminal
         seize_tty(j->pgid);
@@ -112,30 +141,102 @@ void new_child(job_t *j, process_t *p, bool fg)
     
     /* Set the handling for job control signals back to the default. */
     signal (SIGINT, SIG_DFL);
+    signal (SIGPIPE, SIG_DFL);
+    signal (SIGCHLD, SIG_DFL);      /* the handler of the wait builtin */
     
     /* Log errors from this child */
-    int log = open(LOG_FILENAME, O_CREAT | O_WRONLY | O_APPEND);
-    dup2(log, STDERR_FILENO);
+    if (!dsh_embedded) {
+        int log = fd_open(LOG_FILENAME, O_CREAT | O_WRONLY | O_APPEND, 0644);
+        if (log >= 0) {
+            dup2(log, STDERR_FILENO);
+            close(log);
+        }
+    }
     
+    /* Jobs of a server session run in the directory of the session */
+    if (current_session && fchdir(current_session->cwd) < 0)
+        child_error("Could not enter the directory of session %d", current_session->id);
     
+    
+}
+
+/* Bookkeeping for a process that has just been reaped and marked completed */
+void process_reaped(job_t *j, process_t *p) {
+    uint64_t started = j->started;  /* stats_reaped() clears it when j is done */
+    trace_reaped(j, p);
+    stats_reaped(j, p);
+    sched_reaped(j, p);
+    cgroup_reaped(j, p);
+    zstream_reaped(j, p);
+    iohint_reaped(j, p);
+    pipestat_pids(p);
+    if (started && job_is_completed(j))
+        history_add(j, started);
+}
+
+/* waitpid() for the processes of j that also keeps the CPU time of the
+ * process it reaps */
+pid_t wait_job(job_t *j, pid_t pid, int *status, int options) {
+    struct rusage usage;
+    process_t *p;
+    pid_t reaped = wait4(pid, status, options, &usage);
+    if (reaped > 0) {
+        for (p = j->first_process; p && p->pid != reaped; p = p->next)
+            ;
+        if (p && !WIFSTOPPED(*status) && !WIFCONTINUED(*status))
+            p->cpu_usec = usage.ru_utime.tv_sec * 1000000ULL + usage.ru_utime.tv_usec +
+                          usage.ru_stime.tv_sec * 1000000ULL + usage.ru_stime.tv_usec;
+    }
+    return reaped;
+}
+
+/* Collects the status of the processes of a job that changed state,
+ * without blocking */
+void reap_job(job_t *j) {
+    int status;
+    process_t *p;
+    for (p = j->first_process; p; p = p->next) {
+        if (p->pid <= 0 || p->completed)
+            continue;
+        if (wait_job(j, p->pid, &status, WNOHANG | WUNTRACED) != p->pid)
+            continue;
+        p->status = status;
+        if (WIFSTOPPED(status))
+            p->stopped = true;
+        else {
+            p->completed = true;
+            process_reaped(j, p);
+        }
+    }
+}
+
+/* Collects the status of the processes in the job list that changed state,
+ * without blocking. Each is waited for by pid: waiting for any child would
+ * also reap the children of other server sessions. */
+void reap_children() {
+    job_t *j;
+    for (j = job_head; j; j = j->next)
+        reap_job(j);
 }
 
 /* Iterates through jobs and calls free on completed jobs*/
 void remove_zombies() {
     job_t *job = job_head;
     job_t *prev_job;
+    double start = trace_clock();
+    reap_children();
     while (job != NULL) {
         if (job_is_completed(job)) {
             logger(STDOUT_FILENO, "Job [%d]: %s has been successfully reaped", job->pgid, job->commandinfo);
             if (job == job_head) {
+                job_head = job_head -> next;
                 if(!free_job(job))
                    logger(STDOUT_FILENO, "Error while reaping job");
-                job_head = job_head -> next;
                 job = job_head;
                 
             } else {
                 prev_job -> next = job -> next;
-                free_job(prev_job);
+                free_job(job);
                 job = prev_job -> next;
             }
             
@@ -145,6 +246,7 @@ void remove_zombies() {
             job = job -> next;
         }
     }
+    trace_shell_span("remove_zombies", NULL, start);
 }
 
 /* Spawning a process with job control. fg is true if the
@@ -158,37 +260,105 @@ void remove_zombies() {
  * */
 
 void spawn_job(job_t *j, bool fg)
+{
+    double start = trace_clock();
+    add_job(j);
+    cgroup_job(j);
+    place_job(j);
+    sched_classify(j, fg);
+    if (fg || !sched_hold(j))
+        start_job(j, fg);
+    trace_shell_span("spawn_job", j->commandinfo, start);
+    parent_wait(j, fg);
+}
+
+/* Launches a job that is on the job list, now or once sched_admit() lets
+ * it start */
+void start_job(job_t *j, bool fg)
+{
+    /* background output goes to a spool instead of the terminal */
+    if (!fg && spool_enabled && j->mystdout == STDOUT_FILENO)
+        spool_job(j);
+    /* the output of a session's jobs goes to its client */
+    if (current_session && j->mystdout == STDOUT_FILENO)
+        j->mystdout = current_session->fd;
+    launch_job(j, fg);
+    spool_launched(j);
+    sched_started(j);
+}
+
+/* Forks every process of the job, connecting consecutive processes with
+ * pipes. The first process reads from j->mystdin and the last one writes to
+ * j->mystdout when they were pointed to descriptors other than the
+ * terminal (see capture_output() and libdsh.c); every process writes its
+ * errors to j->mystderr in that case. Returns false if a fork failed; the
+ * processes started until then keep running.
+ * */
+bool launch_job(job_t *j, bool fg)
 {
     DEBUG("Before for loop argv[1] = %s",j->first_process->argv[1]);
 	pid_t pid;
 	process_t *p;
-    job_head = NULL;
-    add_job(j);
-    pipe_t previous_filedes;
+    int previous_read = -1;     /* read end of the pipe from the previous process */
+    int previous_ring = -1;     /* its shared-memory ring (shmpipe.c), or -1 */
+    bool redirect_stdin = j->mystdin != STDIN_FILENO;
+    bool redirect_stdout = j->mystdout != STDOUT_FILENO;
+    bool redirect_stderr = j->mystderr != STDERR_FILENO;
     
+    j->started = stats_clock();
+    stats_count(STATS_JOBS);
 	for(p = j->first_process; p; p = p->next) {
         
         if(p->argv[0] == NULL){
             continue;
         }
         
-        pipe_t next_filedes;
+        pipe_t next_filedes = { -1, -1 };
+        compile(j, p);
+        zstream_open(p);
+        iohint_open(p);
+        double start = trace_clock();
         
-        if (pipe(next_filedes) < 0) {
+        if (p->next && cloexec_pipe(next_filedes) < 0) {
             logger(STDERR_FILENO, "Failed to create pipe");
+            if (previous_read >= 0)
+                close(previous_read);
+            if (previous_ring >= 0)
+                close(previous_ring);
+            return false;
         }
+        if (p->next)
+            pipestat_pipe(p, next_filedes);
+        int next_ring = p->next ? shmpipe_ring() : -1;
+        /* the child writes the time it reaches exec to it (see stats_reaped()) */
+        int stats_fd = stats_channel();
+        trace_shell_span("pipe", p->argv[0], start);
         DEBUG("Before switch");
+        fflush(stdout); /* stage builtins would print our pending output again */
+        start = trace_clock();
+        p->forked = stats_clock();
         switch (pid = fork()) {
             case -1: /* fork failure */
                 logger(STDERR_FILENO,"Fork failure.");
-                exit(EXIT_FAILURE);
+                close(next_filedes[PIPE_READ]);
+                close(next_filedes[PIPE_WRITE]);
+                if (previous_read >= 0)
+                    close(previous_read);
+                if (previous_ring >= 0)
+                    close(previous_ring);
+                if (next_ring >= 0)
+                    close(next_ring);
+                zstream_forked(p);
+                return false;
                 
             case 0: /* child process  */
                 p->pid = getpid();
                 
-                char *msg = malloc(sizeof(p->argv[0])+20);
-                sprintf(msg, "\n%d (Launched): %s\n", p->pid, p->argv[0]);
-                write(STDOUT_FILENO, msg, strlen(msg));
+                if (!dsh_embedded) {
+                    char msg[MAX_LEN_CMDLINE + 32];
+                    int len = snprintf(msg, sizeof(msg), "\n%d (Launched): %s\n", p->pid, p->argv[0]);
+                    write(STDOUT_FILENO, msg, len < (int) sizeof(msg) ? len : (int) sizeof(msg) - 1);
+                }
                 
                 
                 /* also establish child process group in child to avoid race (if parent has not done it yet). */
@@ -197,70 +367,94 @@ void spawn_job(job_t *j, bool fg)
                 DEBUG("Child %d was assigned to group %d", p->pid, j->pgid);
 
                 //If not the first process, read from pipe before the process
-                if (p != j->first_process) {
-                    close(previous_filedes[PIPE_WRITE]);
-                    dup2(previous_filedes[PIPE_READ], STDIN_FILENO);
-                    close(previous_filedes[PIPE_READ]);
-                }
-                //If it hahs a following pipe, write to it
-                if(p->next) {
-                    close(next_filedes[PIPE_READ]);
-                    dup2(next_filedes[PIPE_WRITE],STDOUT_FILENO);
-                    close(next_filedes[PIPE_WRITE]);
-                }
-                //If it is last process, dup output to stdout
-                else {
-                    dup2(STDOUT_FILENO, next_filedes[PIPE_WRITE]);
-                    close(next_filedes[PIPE_READ]);
-                    close(next_filedes[PIPE_WRITE]);
-                }
+                if (previous_read >= 0)
+                    dup2(previous_read, STDIN_FILENO);
+                else if (redirect_stdin)
+                    dup2(j->mystdin, STDIN_FILENO);
+                //If it has a following pipe, write to it
+                if (p->next)
+                    dup2(next_filedes[PIPE_WRITE], STDOUT_FILENO);
+                else if (redirect_stdout)
+                    dup2(j->mystdout, STDOUT_FILENO);
                 
                 new_child(j, p, fg);
-                compile(p);
+                if (redirect_stderr)
+                    dup2(j->mystderr, STDERR_FILENO);
+                /* the pipes, the fds the job was given and whatever else dsh
+                 * had open are closed, except those in keep[]: the trace, the
+                 * exec time pipe of stats, the program compiled to memory, the
+                 * ends of the <z and >z streams, the < and > files opened for
+                 * an I/O policy and the shared memory rings */
+                int keep[] = { trace_fd, stats_fd, p->exec_fd, zstream_fd(p->zin), zstream_fd(p->zout),
+                               p->ifd, p->ofd, previous_ring, next_ring };
+                fd_close_inherited(keep, sizeof(keep) / sizeof(keep[0]));
+                shmpipe_child(previous_ring, next_ring);
+                trace_span("child setup", p->argv[0], j->pgid, p->pid, start);
 
                 DEBUG("Child process %d detected after compile attempt", p -> pid);
                 io_redirection(p);
+                fd_audit_child(p);
+                trace_mark('B', "run", p->argv[0], j->pgid, p->pid);
+                stats_exec(p, false);
+                run_stage_builtin(p);
                 exec(p);
                 
-                logger(STDERR_FILENO,"Failure executing child");
-                exit(EXIT_FAILURE);
+                child_error("Failure executing child");
+                _exit(EXIT_FAILURE);
                 
             default: /* parent */
+                trace_shell_span("fork", p->argv[0], start);
                 /* establish child process group */
                 
                 p->pid = pid;
                 set_child_pgid(j, p);
-                
-                    //The next pipe becomes the previous one
-                previous_filedes[PIPE_WRITE] = next_filedes[PIPE_WRITE];
-                previous_filedes[PIPE_READ] = next_filedes[PIPE_READ];
-        }
-        //Close remaining ends
-        if (p->next == NULL) {
-            close(next_filedes[PIPE_READ]);
+                cgroup_enter(j, pid);
+                if (p->exec_fd >= 0) {
+                    close(p->exec_fd);
+                    p->exec_fd = -1;
+                }
+                zstream_forked(p);
+                pipestat_pids(p);
+                stats_count(STATS_STAGES);
         }
-        close(previous_filedes[PIPE_WRITE]);
-        parent_wait(j, fg);
+        /* the child has its copies: dsh keeps only the read end of the next
+         * pipe, until the next process is forked */
+        if (previous_read >= 0)
+            close(previous_read);
+        if (previous_ring >= 0)
+            close(previous_ring);
+        if (p->next)
+            close(next_filedes[PIPE_WRITE]);
+        previous_read = next_filedes[PIPE_READ];
+        previous_ring = next_ring;
     }
+    trace_job(j);
+    return true;
 }
 
 /*Makes the parent process wait for a child to finish execution
  when the child is on the foreground*/
 void parent_wait (job_t *j, int fg) {
-    if(fg){
+    if(fg && j->pgid > 0){
         DEBUG("parent is waiting for child");
+        double start = trace_clock();
         int status, pid;
-        while((pid = waitpid(WAIT_ANY, &status, WUNTRACED)) > 0){
-            process_t *p = get_process(pid);
+        while((pid = wait_job(j, -j->pgid, &status, WUNTRACED)) > 0){
+            process_t *p = j->first_process;
+            while (p && p->pid != pid)
+                p = p->next;
+            if (p == NULL)
+                continue;
+            p->status = status;
             if (WIFEXITED(status)){
                 p->completed = true;
-                if (status == EXIT_SUCCESS) {
-                    printf("%d (Completed): %s\n", pid, p->argv[0]);
-                }
-                else {
-                    printf("%d (Failed): %s\n", pid, p->argv[0]);
+                if (!dsh_embedded) {
+                    if (status == EXIT_SUCCESS)
+                        printf("%d (Completed): %s\n", pid, p->argv[0]);
+                    else
+                        printf("%d (Failed): %s\n", pid, p->argv[0]);
+                    fflush(stdout);
                 }
-                fflush(stdout);
             }
             else if (WIFSTOPPED(status)) {
                 DEBUG("Process %d stopped", p->pid);
@@ -276,35 +470,54 @@ void parent_wait (job_t *j, int fg) {
             else if (WIFCONTINUED(status)) { DEBUG("Process %d resumed", p->pid); p->stopped = 0; }
             else if (WIFSIGNALED(status)) { DEBUG("Process %d terminated", p->pid); p->completed = 1; }
             else logger(STDERR_FILENO, "Child %d terminated abnormally", pid);
+            if (p->completed)
+                process_reaped(j, p);
             if (job_is_stopped(j) && isatty(STDIN_FILENO)) {
                 seize_tty(getpid());
                 break;
             }
         }
+        trace_shell_span("parent_wait", j->commandinfo, start);
     }
 }
 
 /* Handles file input/output if there is any*/
 void io_redirection(process_t *process){
-    if (process -> ifile) {
-        int fd0 = open(process -> ifile, O_RDONLY);
+    heredoc_stdin(process);
+    /* dsh could not open the file of <z or >z: nothing to read or write */
+    if ((process -> izip && !process -> zin) || (process -> ozip && !process -> zout))
+        _exit(EXIT_FAILURE);
+    if (process -> zin) {
+        dup2(zstream_fd(process -> zin), STDIN_FILENO);
+        close(zstream_fd(process -> zin));
+    }
+    else if (process -> ifd >= 0)
+        dup2(process -> ifd, STDIN_FILENO);
+    else if (process -> ifile && !process -> izip) {
+        int fd0 = fd_open(process -> ifile, O_RDONLY, 0);
         if(fd0 >= 0) {
             dup2(fd0, STDIN_FILENO);
             close(fd0);
         }
         else {
-            logger(STDERR_FILENO,"Could not open file for input");
+            child_error("Could not open %s for input (errno %d)", process -> ifile, errno);
         }
     }
     
-    if (process -> ofile) {
-        int fd1 = creat(process -> ofile, 0644);
+    if (process -> zout) {
+        dup2(zstream_fd(process -> zout), STDOUT_FILENO);
+        close(zstream_fd(process -> zout));
+    }
+    else if (process -> ofd >= 0)
+        dup2(process -> ofd, STDOUT_FILENO);
+    else if (process -> ofile && !process -> ozip) {
+        int fd1 = fd_open(process -> ofile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
         if (fd1 >=0) {
             dup2(fd1, STDOUT_FILENO);
             close(fd1);
         }
         else {
-            logger(STDERR_FILENO,"Could not open file for output");
+            child_error("Could not open %s for output (errno %d)", process -> ofile, errno);
         }
     }
     
@@ -326,62 +539,186 @@ void continue_job(job_t *job){
     }
 }
 
+/* Commands that dsh implements itself. They still run in the forked child
+ * of their pipeline stage, so job control works as usual, but they skip the
+ * exec and the loading of a program. A stage builtin returns its exit
+ * status, or a negative value to fall back to the program of the same name.
+ */
+static const struct {
+    const char *name;
+    int (*run)(int argc, char **argv);
+} stage_builtins[] = {
+    { "wc", builtin_wc },
+    { "sort", builtin_sort },
+    { "par", builtin_par },
+};
+
+void run_stage_builtin(process_t *p){
+    int i, status;
+    for (i = 0; i < sizeof(stage_builtins) / sizeof(stage_builtins[0]); i++) {
+        if (!strcmp(p->argv[0], stage_builtins[i].name)) {
+            if ((status = stage_builtins[i].run(p->argc, p->argv)) >= 0) {
+                /* _exit: exit() would also sync the shell's buffered stdin
+                 * and move the read offset of a batch file */
+                fflush(stdout);
+                _exit(status);
+            }
+            return;
+        }
+    }
+}
+
 /* Compiles and execute a job */
 void exec(process_t *p){
-    if(execvp(p->argv[0], p->argv) < 0) {
-        logger(STDERR_FILENO, "%s: Command not found.", p->argv[0]);
-        exit(EXIT_FAILURE);
+    /* a program compile() kept in memory */
+    if (p->exec_fd >= 0)
+        fexecve(p->exec_fd, p->argv, environ);
+    if(p->exec_fd >= 0 || execvp(p->argv[0], p->argv) < 0) {
+        /* as sh: 127 when there is no such command, 126 when it is there
+         * but cannot be run */
+        int err = errno, missing = err == ENOENT || err == ENOTDIR;
+        stats_exec(p, true);
+        if (missing)
+            child_error("%s: Command not found.", p->argv[0]);
+        else
+            child_error("%s: Cannot execute (errno %d).", p->argv[0], err);
+        /* not exit(): it would move the read offset of a batch file */
+        _exit(missing ? 127 : 126);
     }
 }
 
-void compile(process_t *p){
-    char *filename_p = p->argv[0];
-    char *str_end_p;
+/* Runs cmdline with its stdout connected to a pipe and returns what it
+ * wrote, NUL terminated. The buffer grows geometrically so large outputs are
+ * read in linear time; nothing is written to disk.
+ */
+char *capture_output(char *cmdline) {
+    size_t len = 0, size = CAPTURE_CHUNK;
+    char *buffer = malloc(size);
+    job_t *j = parse_cmdline(cmdline);
     
-    if((str_end_p = strstr(filename_p, ".c")) != NULL || (str_end_p = strstr(filename_p, ".cpp")) != NULL){
-        printf("Compiling...");
-        int length = (int) (str_end_p - filename_p);
-        if(length<=0){
-            logger(STDERR_FILENO, "Filename is not valid."); //Output to logger!
-            return;
-        }
-        DEBUG("Filename ends with .c or .cpp\n");
-        char *compiled_name = (char *) malloc(sizeof(char)*length);
-        memcpy(compiled_name, filename_p, length);
-        compiled_name[length] = '\0';
-        DEBUG("New filename is: %s\n",compiled_name);
+    while (j != NULL && buffer != NULL) {
+        job_t *next = j->next;
+        j->next = NULL;
+        pipe_t capture;
         
+        if (j->first_process->argc > 0 && expand_substitutions(j)) {
+            if (cloexec_pipe(capture) < 0) {
+                logger(STDERR_FILENO, "Failed to create pipe for $(%s)", cmdline);
+                free_job(j);
+                j = next;
+                continue;
+            }
+            j->mystdout = capture[PIPE_WRITE];
+            launch_job(j, false);
+            close(capture[PIPE_WRITE]);
+            
+            while (1) {
+                if (size - len <= CAPTURE_CHUNK) {
+                    char *bigger = realloc(buffer, size * 2);
+                    if (bigger == NULL)
+                        break;
+                    buffer = bigger;
+                    size *= 2;
+                }
+                ssize_t n = read(capture[PIPE_READ], buffer + len, size - len - 1);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    break;
+                len += n;
+            }
+            close(capture[PIPE_READ]);
+            parent_wait(j, true);
+        }
+        free_job(j);
+        j = next;
+    }
+    if (buffer != NULL)
+        buffer[len] = '\0';
+    return buffer;
+}
+
+/* Replaces every $(cmdline) in the arguments of the job's processes by the
+ * output of cmdline; the result is split into arguments on whitespace */
+bool expand_substitutions(job_t *j) {
+    process_t *p;
+    for (p = j->first_process; p; p = p->next) {
+        int i, argc = 0, size = MAX_ARGS;
+        char **argv = NULL;
         
-        char **c_argv = (char **) malloc(sizeof(char *)*5);
-        c_argv[0] = (strstr(filename_p, ".c") != NULL)? "gcc":"g++";
-        c_argv[1] = "-o";
-        c_argv[2] = compiled_name;
-        c_argv[3] = filename_p;
-        c_argv[4] = "\0";
-        DEBUG("command : %s %s %s %s\n",
-              c_argv[0],c_argv[1],c_argv[2],c_argv[3]);
-        
-        int status;
-        pid_t pid;
+        for (i = 0; i < p->argc; i++)
+            if (strstr(p->argv[i], "$(") != NULL)
+                break;
+        if (i == p->argc)
+            continue; /* nothing to expand */
         
-        //FORKEXEC
-        switch (pid = fork()) {
-            case -1: logger(2, "Fork failure at compiler");
-            case 0:
-                execv("/usr/bin/gcc", c_argv);
-            default:
-                waitpid(pid, &status, WUNTRACED);
-                 if (WIFEXITED(status)){
-                     printf("status: %d", status);
-                 }
+        if (!(argv = malloc(sizeof(char *) * size)))
+            return false;
+        for (i = 0; i < p->argc; i++) {
+            char *arg = p->argv[i];
+            char *start;
+            if ((start = strstr(arg, "$(")) == NULL) {
+                argv[argc++] = arg;
+                if (argc == size && !(argv = realloc(argv, sizeof(char *) * (size *= 2))))
+                    return false;
+                continue;
+            }
+            
+            /* build the expanded text of this argument */
+            size_t length = strlen(arg) + 1;
+            char *text = calloc(length, sizeof(char));
+            char *rest = arg;
+            while (text && (start = strstr(rest, "$(")) != NULL) {
+                int depth = 0;
+                char *end = start + 1;
+                do {
+                    if (*end == '(') depth++;
+                    else if (*end == ')') depth--;
+                } while (depth > 0 && *++end != '\0');
+                if (*end == '\0') {
+                    logger(STDERR_FILENO, "Unterminated $( in %s", arg);
+                    break;
+                }
+                *end = '\0';
+                char *output = capture_output(start + 2);
+                *end = ')';
+                if (output == NULL)
+                    break;
+                /* trailing newlines are dropped, as in sh */
+                size_t n = strlen(output);
+                while (n > 0 && output[n-1] == '\n')
+                    output[--n] = '\0';
+                length += n;
+                if ((text = realloc(text, length)) != NULL) {
+                    strncat(text, rest, start - rest);
+                    strcat(text, output);
+                }
+                free(output);
+                rest = end + 1;
+            }
+            if (text == NULL)
+                return false;
+            strcat(text, rest);
+            free(arg);
+            
+            /* split it into arguments */
+            char *save;
+            char *word = strtok_r(text, " \t\n\r\v\f", &save);
+            while (word != NULL) {
+                if (!(argv[argc++] = strdup(word)))
+                    return false;
+                if (argc == size && !(argv = realloc(argv, sizeof(char *) * (size *= 2))))
+                    return false;
+                word = strtok_r(NULL, " \t\n\r\v\f", &save);
+            }
+            free(text);
         }
-        sprintf(p->argv[0], "./%s", compiled_name);
-        free(compiled_name);
-        free(c_argv);
-
-
-        DEBUG("Pointers freed up!");
+        argv[argc] = NULL;
+        free(p->argv);
+        p->argv = argv;
+        p->argc = argc;
     }
+    return true;
 }
 
 /*
@@ -394,18 +731,121 @@ bool builtin_cmd(job_t *last_job, int argc, char **argv){
      */
     
     if (!strcmp(argv[0], "quit")) {
+        if (current_session) { /* ends the session, not the server */
+            current_session->quit = true;
+            return true;
+        }
         exit(EXIT_SUCCESS);
 	}
     else if (!strcmp("jobs", argv[0])) {
-        print_jobs();
+        if (argc > 1 && !strcmp(argv[1], "-c")) {
+            if (!history_cmd(argc, argv))
+                logger(STDERR_FILENO, "Error: usage: jobs -c [-f] [-n N] [TEXT]");
+        }
+        else
+            print_jobs();
         return true;
     }
 	else if (!strcmp("cd", argv[0])) {
-        if(argc <= 1 || chdir(argv[1]) == -1) {
+        if (current_session && argc > 1) {
+            /* the process has one cwd for all sessions: keep a directory
+             * fd per session instead, the children fchdir() to it */
+            int cwd = openat(current_session->cwd, argv[1], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (cwd < 0) {
+                logger(STDERR_FILENO,"Error: invalid arguments for directory change");
+                return true;
+            }
+            close(current_session->cwd);
+            current_session->cwd = cwd;
+        }
+        else if(argc <= 1 || chdir(argv[1]) == -1) {
             logger(STDERR_FILENO,"Error: invalid arguments for directory change");
         }
         return true;
     }
+    else if (!strcmp("stats", argv[0])) {
+        FILE *out = current_session ? current_session->out : stdout;
+        if (argc == 1)
+            stats_print(out, false);
+        else if (argc == 2 && !strcmp(argv[1], "-j"))
+            stats_print(out, true);
+        else if (argc == 2 && !strcmp(argv[1], "-r"))
+            stats_reset();
+        else
+            logger(STDERR_FILENO, "Error: usage: stats [-j | -r]");
+        return true;
+    }
+    else if (!strcmp("trace", argv[0])) {
+        if (argc == 3 && !strcmp(argv[1], "on")) {
+            if (!trace_start(argv[2]))
+                logger(STDERR_FILENO, "Error: could not open %s for the trace", argv[2]);
+        }
+        else if (argc == 2 && !strcmp(argv[1], "off"))
+            trace_stop();
+        else
+            logger(STDERR_FILENO, "Error: usage: trace on file | trace off");
+        return true;
+    }
+    else if (!strcmp("fds", argv[0])) {
+        if (argc == 1) {
+            fflush(stdout);
+            fd_list(current_session ? current_session->fd : STDOUT_FILENO, "dsh");
+        }
+        else if (argc == 3 && !strcmp(argv[1], "audit") && !strcmp(argv[2], "on"))
+            fd_audit = true;
+        else if (argc == 3 && !strcmp(argv[1], "audit") && !strcmp(argv[2], "off"))
+            fd_audit = false;
+        else
+            logger(STDERR_FILENO, "Error: usage: fds [audit on | audit off]");
+        return true;
+    }
+    else if (!strcmp("spool", argv[0])) {
+        spool_cmd(argc, argv);
+        return true;
+    }
+    else if (!strcmp("sched", argv[0])) {
+        sched_cmd(argc, argv);
+        return true;
+    }
+    else if (!strcmp("cgroup", argv[0])) {
+        cgroup_cmd(argc, argv);
+        return true;
+    }
+    else if (!strcmp("place", argv[0])) {
+        place_cmd(argc, argv);
+        return true;
+    }
+    else if (!strcmp("compile", argv[0])) {
+        compile_cmd(argc, argv);
+        return true;
+    }
+    else if (!strcmp("shmpipe", argv[0])) {
+        shmpipe_cmd(argc, argv);
+        return true;
+    }
+    else if (!strcmp("pipestat", argv[0])) {
+        pipestat_cmd(argc, argv);
+        return true;
+    }
+    else if (!strcmp("iohint", argv[0])) {
+        iohint_cmd(argc, argv);
+        return true;
+    }
+    else if (!strcmp("wait", argv[0])) {
+        builtin_status = wait_cmd(argc, argv);
+        return true;
+    }
+    else if (!strcmp("record", argv[0])) {
+        if (argc == 3 && !strcmp(argv[1], "on")) {
+            if (!record_start(argv[2]))
+                logger(STDERR_FILENO, "Error: could not open %s for the journal", argv[2]);
+        }
+        else if (argc == 2 && !strcmp(argv[1], "off"))
+            record_stop();
+        else
+            logger(STDERR_FILENO, "Error: usage: record on file | record off");
+        return true;
+    }
     
         //Background command, works as long as next argument is a reasonable id
     else if (!strcmp("bg", argv[0])) {
@@ -425,6 +865,10 @@ bool builtin_cmd(job_t *last_job, int argc, char **argv){
             logger(STDERR_FILENO, "Error: job is already completed!");
             return true;
         }
+        if (job->queued) {
+            logger(STDERR_FILENO, "Error: job is queued; sched job %d PRIO changes its turn", position);
+            return true;
+        }
         
         printf("#Sending job '%s' to background\n", job -> commandinfo);
         fflush(stdout);
@@ -449,7 +893,7 @@ bool builtin_cmd(job_t *last_job, int argc, char **argv){
                 logger(STDERR_FILENO, "Could not find requested job");
                 return true;
             }
-            if (job -> notified == false) {
+            if (!job -> bg) {
                 logger(STDERR_FILENO, "The job is already in foreground.");
                 return true;
             }
@@ -466,11 +910,28 @@ bool builtin_cmd(job_t *last_job, int argc, char **argv){
         
         printf("#Bringing job '%s' to foreground\n", job -> commandinfo);
         fflush(stdout);
+        /* a queued job skips the queue and starts in the foreground */
+        if (job->queued) {
+            job->queued = false;
+            job->bg = false;
+            sched_classify(job, true);
+            start_job(job, true);
+            parent_wait(job, true);
+            return true;
+        }
+        /* a spooled job: what it wrote meanwhile, then its output as it comes */
+        if (job->spool)
+            spool_attach(job->spool, current_session ? current_session->fd : STDOUT_FILENO, false, true);
         continue_job(job);
         job -> bg = false;
         if (isatty(STDIN_FILENO))
             seize_tty(job->pgid);
         parent_wait(job, true);
+        if (job->spool) {
+            if (job_is_completed(job))
+                spool_wait(job->spool, SPOOL_DRAIN_WAIT);
+            spool_detach(job->spool);
+        }
         return true;
     }
     return false;       /* not a builtin command */
@@ -526,29 +987,32 @@ char* promptmsg(){
 
 void print_jobs(){
     int count = 1;
+    FILE *out = current_session ? current_session->out : stdout;
     remove_zombies();
     job_t *j = job_head;
     if (j == NULL) {
-        char *msg = "No jobs are running\n";
-        write(STDOUT_FILENO, msg, strlen(msg));
+        fputs("No jobs are running\n", out);
+        fflush(out);
         return;
     }
     while(j!=NULL){
-        printf("[%d]", count);
-        if(j->notified)
-            printf("    Stopped     ");
+        fprintf(out, "[%d]", count);
+        if(j->queued)
+            fprintf(out, "    Queued      ");
+        else if(j->notified)
+            fprintf(out, "    Stopped     ");
         else {
             if(j->bg)
-                printf(" bg ");
+                fprintf(out, " bg ");
             else
-                printf(" fg ");
-            printf(" Running        ");
+                fprintf(out, " fg ");
+            fprintf(out, " Running        ");
         }
-        printf("%s\n", j->commandinfo);
+        fprintf(out, "%s\n", j->commandinfo);
         j = j->next;
         count++;
     }
-    fflush(stdout);
+    fflush(out);
 }
 
 
@@ -557,7 +1021,22 @@ void logger(int fd, const char *str, ...){
     
     FILE *file;
     
-    file=fopen(LOG_FILENAME,"a");
+    /* an application linking libdsh gets the errors on its stderr */
+    if (dsh_embedded) {
+        if (fd == STDERR_FILENO) {
+            va_start(argptr, str);
+            fprintf(stderr, "dsh: ");
+            vfprintf(stderr, str, argptr);
+            fprintf(stderr, "\n");
+            va_end(argptr);
+        }
+        return;
+    }
+    
+    int log = fd_open(LOG_FILENAME, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    file = log >= 0 ? fdopen(log, "a") : NULL;
+    if (file == NULL && log >= 0)
+        close(log);
     
     if (file!=NULL){
         time_t ltime; /* calendar time */
@@ -572,6 +1051,10 @@ void logger(int fd, const char *str, ...){
             fprintf(file, "[%s]: ", time);
             printf("[%s]: ", time);
         }
+        if (current_session) {
+            fprintf(file, "session %d: ", current_session->id);
+            printf("session %d: ", current_session->id);
+        }
         va_start(argptr, str);
         vfprintf(file, str, argptr);
         va_end(argptr);
@@ -585,15 +1068,227 @@ void logger(int fd, const char *str, ...){
     }
 }
 
-int main(){
+/* logger() takes the locks of stdout and of the time zone, and a thread of
+ * a server session may have held them when another one forked: in the
+ * child they would never be released. vsnprintf() to the stack takes none,
+ * and errors are given by number since strerror() may take the locale's. */
+void child_error(const char *str, ...) {
+    va_list argptr;
+    char line[MAX_LEN_CMDLINE];
+    int len = snprintf(line, sizeof(line), "dsh: %d: ", (int) getpid());
+
+    va_start(argptr, str);
+    len += vsnprintf(line + len, sizeof(line) - len - 1, str, argptr);
+    va_end(argptr);
+    if (len > (int) sizeof(line) - 2)
+        len = sizeof(line) - 2;
+    line[len++] = '\n';
+    write(STDERR_FILENO, line, len);
+}
+
+/* builtin_cmd() for the first process of the job, traced */
+static bool run_builtin(job_t *j) {
+    double start = trace_clock();
+    builtin_status = 0;
+    bool builtin = builtin_cmd(j, j->first_process->argc, j->first_process->argv);
+    if (builtin)
+        trace_shell_span("builtin_cmd", j->commandinfo, start);
+    return builtin;
+}
+
+/* Runs the jobs of a parsed command line one after the other; returns the
+ * exit status of the last one */
+int run_jobs(job_t *j) {
+    int status = 0;
+    while(j!= NULL){
+        /* detach the job from the command line so that the job list
+         * only links jobs that were spawned */
+        job_t *next = j->next;
+        j->next = NULL;
+        if(!expand_substitutions(j)) {
+            logger(STDERR_FILENO, "Failed to expand %s", j->commandinfo);
+            free_job(j);
+            status = 1;
+        }
+        /* Check for built-in commands */
+        else if(j->first_process->argc == 0 || run_builtin(j)){
+            status = j->first_process->argc == 0 ? 0 : builtin_status;
+            free_job(j);
+        }
+        else {
+            DEBUG("***going to spawn job***");
+            spawn_job(j,!(j->bg));
+            /* spawn_job() left it on the job list */
+            status = j->bg ? 0 : job_exit_status(j);
+        }
+        j = next;
+    }
+    return status;
+}
+
+#ifndef DSH_LIBRARY
+/* Runs the last line of dsh -c in place of dsh, as sh -c does, when it is
+ * a single program in the foreground and nothing waits to see it finish:
+ * no fork, no wait. Returns false, with j untouched, to run it as usual;
+ * true with its status if it was a builtin after all. */
+static bool exec_in_place(job_t *j, int *status) {
+    process_t *p = j->first_process;
+    if (j->next || j->bg || p->next || p->argc == 0 || p->izip || p->ozip || sched_queued() ||
+        trace_fd >= 0 || record_fd >= 0 || getenv("DSH_STATS") || getenv("DSH_CGROUP"))
+        return false;
+    if (!expand_substitutions(j)) {
+        logger(STDERR_FILENO, "Failed to expand %s", j->commandinfo);
+        free_job(j);
+        *status = 1;
+        return true;
+    }
+    if (run_builtin(j)) {
+        *status = builtin_status;
+        free_job(j);
+        return true;
+    }
+    compile(j, p);
+    io_redirection(p);
+    run_stage_builtin(p);
+    exec(p);
+    return true;
+}
+
+/* Runs one line of dsh -c or of a script, parsed ahead (readahead.c);
+ * returns its exit status. The last line of dsh -c may replace dsh. */
+static int run_line(readahead_line_t *line, bool exec_last) {
+    job_t *j = line->jobs;
+    int status = 0;
+    record_read(line->text);
+    free(line->text);
+    if (j == NULL)
+        return line->failed ? 1 : 0;
+    if (!(exec_last && exec_in_place(j, &status)))
+        status = run_jobs(j);
+    record_done(status);
+    reap_children();
+    sched_admit();
+    return status;
+}
+
+/* The lines of in but for the comments, without the banners, the terminal
+ * setup and the prompt of the interactive loop */
+static int run_lines(FILE *in, bool exec_last) {
+    /* the text of dsh -c is all there: no thread to wait for it */
+    readahead_t *ahead = readahead_start(in, true, !exec_last);
+    readahead_line_t line;
+    int status = 0;
+    bool last;
+    if (ahead == NULL) {
+        fprintf(stderr, "dsh: %s\n", strerror(ENOMEM));
+        fclose(in);
+        return 127;
+    }
+    while (readahead_next(ahead, &line, exec_last ? &last : NULL))
+        status = run_line(&line, exec_last && last);
+    readahead_stop(ahead);
+    fclose(in);
+    sched_drain();
+    return status;
+}
+
+/* dsh -c: the lines of text */
+static int run_string(char *text) {
+    FILE *in = fmemopen(text, strlen(text), "r");
+    if (in == NULL) {
+        fprintf(stderr, "dsh: -c: %s\n", strerror(errno));
+        return 127;
+    }
+    return run_lines(in, true);
+}
+
+/* dsh script, also what a #!/path/to/dsh line runs: the lines of the file
+ * as dsh -c runs them */
+static int run_script(const char *path) {
+    FILE *in = fopen(path, "re");
+    if (in == NULL) {
+        fprintf(stderr, "dsh: %s: %s\n", path, strerror(errno));
+        return 127;
+    }
+    return run_lines(in, false);
+}
+
+int main(int argc, char **argv){
+    int opt, threads = 0;
+    char *socket_path = NULL, *command = NULL;
+    uint64_t line_read = 0;
+    while ((opt = getopt(argc, argv, "+s:t:c:")) != -1) {
+        switch (opt) {
+            case 's': socket_path = optarg; break;
+            case 't': threads = atoi(optarg); break;
+            case 'c': command = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-s socket [-t threads] | -c cmdline | script]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (getenv("DSH_STATS"))
+        stats_dump_at_exit(getenv("DSH_STATS"));
+    if (getenv("DSH_TRACE") && !trace_start(getenv("DSH_TRACE")))
+        fprintf(stderr, "dsh: cannot write the trace to %s\n", getenv("DSH_TRACE"));
+    if (getenv("DSH_FD_AUDIT"))
+        fd_audit = true;
+    if (getenv("DSH_SPOOL") && !spool_on(getenv("DSH_SPOOL")))
+        fprintf(stderr, "dsh: DSH_SPOOL is not a size: %s\n", getenv("DSH_SPOOL"));
+    if (getenv("DSH_CGROUP") && !cgroup_on())
+        fprintf(stderr, "dsh: no writable cgroup v2 hierarchy for DSH_CGROUP\n");
+    if (getenv("DSH_SHMPIPE") && !shmpipe_on(getenv("DSH_SHMPIPE")))
+        fprintf(stderr, "dsh: DSH_SHMPIPE is not a power of 2: %s\n", getenv("DSH_SHMPIPE"));
+    if (getenv("DSH_PIPE_SIZE") && !pipestat_size(getenv("DSH_PIPE_SIZE")))
+        fprintf(stderr, "dsh: DSH_PIPE_SIZE is not a size: %s\n", getenv("DSH_PIPE_SIZE"));
+    if (getenv("DSH_PIPESTAT") && !pipestat_on(getenv("DSH_PIPESTAT")))
+        fprintf(stderr, "dsh: cannot sample the pipes every %s ms\n", getenv("DSH_PIPESTAT"));
+    if (getenv("DSH_RECORD") && !record_start(getenv("DSH_RECORD")))
+        fprintf(stderr, "dsh: cannot write the journal to %s\n", getenv("DSH_RECORD"));
+    if (socket_path)
+        return serve(socket_path, threads);
+    if (command || optind < argc) {
+        dsh_embedded = true;
+        return command ? run_string(command) : run_script(argv[optind]);
+    }
+
     printf("#Initializing the Devil Shell...\n");
     init_dsh(); //Comment this out in order to compile properly on gcc
     printf("#Devil Shell has started\n");
     job_head = NULL;
+    /* input that is not a terminal is read and parsed ahead (readahead.c) */
+    readahead_t *ahead = isatty(STDIN_FILENO) ? NULL : readahead_start(stdin, false, true);
 	while(1) {
         job_t *j = NULL;
-        if(!(j = readcmdline(promptmsg()))) {
-			if (feof(stdin)) { /* End of file (ctrl-d) */
+        bool end = false;
+        reap_children();
+        sched_admit();
+        if (line_read) /* from reading the last line to the next prompt */
+            stats_record(STATS_PROMPT, stats_clock() - line_read);
+        double start = trace_clock();
+        if (ahead) {
+            readahead_line_t line;
+            fputs(promptmsg(), stdout);
+            fflush(stdout);
+            end = !readahead_next(ahead, &line, NULL);
+            if (!end) {
+                record_read(line.text);
+                free(line.text);
+                j = line.jobs;
+            }
+        }
+        else if (sched_queued()) { /* keep starting queued jobs at the prompt */
+            fputs(promptmsg(), stdout);
+            fflush(stdout);
+            sched_wait_input(STDIN_FILENO);
+            j = readcmdline("");
+        } else
+            j = readcmdline(promptmsg());
+        trace_shell_span("readcmdline", NULL, start);
+        line_read = stats_clock();
+        if(!j) {
+			if (end || (!ahead && feof(stdin))) { /* End of file (ctrl-d) */
+				sched_drain();
 				fflush(stdout);
 				printf("\n");
 				exit(EXIT_SUCCESS);
@@ -603,19 +1298,8 @@ int main(){
         /* Only for debugging purposes to show parser output; turn off in the
          * final code */
         if(PRINT_INFO) print_job(j);
-        /* Your code goes here */
         /* You need to loop through jobs list since a command line can contain ;*/
-        while(j!= NULL){
-            /* Check for built-in commands */
-            int argc = j->first_process->argc;
-            char **argv = j->first_process->argv;
-            if(!builtin_cmd(j, argc, argv)){
-                DEBUG("***going to spawn job***");
-                spawn_job(j,!(j->bg));
-            }
-            j = j->next;
-            
-        }
-        
+        record_done(run_jobs(j));
     }
 }
+#endif /* DSH_LIBRARY */
@@ -1,6 +1,10 @@
 #ifndef __DSH_H__         /* check if this header file is already defined elsewhere */
 #define __DSH_H__
 
+#ifdef __linux__
+#define _GNU_SOURCE     /* pipe2(), before any system header */
+#endif
+
 #include <stdio.h>
 #include <sys/types.h>  /* pid_t */
 #include <unistd.h>     /* getpid()*/
@@ -11,6 +15,12 @@
 #include <string.h>     /* strncpy */
 #include <sys/stat.h>   /* file modes */
 #include <fcntl.h>      /* file open */
+#include <stdint.h>     /* uint64_t */
+
+static const int PIPE_READ = 0;
+static const int PIPE_WRITE = 1;
+
+typedef int pipe_t[2]; /* Defines a pipe */
 
 /* Max length of input/output file name specified during I/O redirection */
 #define MAX_LEN_FILENAME 80
@@ -20,12 +30,7 @@
 
 #define MAX_ARGS 20 /* Maximum number of arguments to any command */
 
-/*file descriptors for input and output; the range of fds are from 0 to 1023;
- * 0, 1, 2 are reserved for stdin, stdout, stderr */
-#define INPUT_FD  1000
-#define OUTPUT_FD 1001
-
-#define MAX_HISTORY 20 /* flush the completed jobs after reaching the MAX_HISTORY */
+#define MAX_HISTORY 1024 /* completed jobs kept by the history ring (history.c) */
 
 #define MAX_ARGS 20 /* Maximum number of arguments to any command */
 
@@ -36,6 +41,10 @@
 typedef enum { false, true } bool;
 
 /* A process is a single process (a command to run an executable program).  */
+typedef struct placement placement_t;
+typedef struct zstream zstream_t;
+typedef struct pipestat pipestat_t;
+
 typedef struct process {
         struct process *next;       /* next process in pipeline */
 	    int argc;		            /* useful for free(ing) argv */
@@ -46,12 +55,30 @@ typedef struct process {
         int status;                 /* reported status value from job control; 0 on success and nonzero otherwise */
         char *ifile;                /* stores input file name when < is issued */
         char *ofile;                /* stores output file name when > is issued */
+        uint64_t forked;            /* stats_clock() when it was forked */
+        uint64_t execed;            /* stats_clock() when it reached exec, 0 until known */
+        bool exec_failed;           /* its exec failed, as its child wrote */
+        placement_t *placement;     /* CPUs it is pinned to (place.c), or NULL */
+        int exec_fd;                /* program compiled to memory (compile.c), or -1 */
+        char *here_delim;           /* word ending the here-document of <<, until it is read */
+        char *here_data;            /* text of a here-document or here-string (heredoc.c), or NULL */
+        size_t here_len;
+        bool here_strip;            /* <<- removes leading tabs */
+        bool izip, ozip;            /* <z, >z: the file is compressed */
+        zstream_t *zin, *zout;      /* their compression threads (zstream.c), or NULL */
+        int ifd, ofd;               /* < and > files dsh opened for an I/O policy (iohint.c), or -1 */
+        bool inocache, onocache;    /* the policies they were opened under: dropped from */
+        bool oprealloc;             /* the page cache once reaped, allocated ahead */
+        uint64_t cpu_usec;          /* user and system time, once reaped */
+        pipestat_t *pipe_in;        /* the pipe from the previous process (pipestat.c), or NULL */
 } process_t;
 
 /* A job is a process itself or a pipeline of processes.
  * Each job has exactly one process group (pgid) containing all the processes in the job. 
  * Each process group has exactly one process that is its leader.
  */
+typedef struct spool spool_t;
+
 typedef struct job {
         struct job *next;           /* next job */
         char *commandinfo;          /* entire command line input given by the user; useful for logging and message display*/
@@ -60,6 +87,16 @@ typedef struct job {
         bool notified;              /* true if user was informed about stopped job */
         int mystdin, mystdout, mystderr;  /* standard i/o channels */
         bool bg;                    /* true when & is issued on the command line */
+        uint64_t started;           /* stats_clock() at launch; 0 once its time is recorded */
+        spool_t *spool;             /* keeps the output of a background job, or NULL */
+        bool queued;                /* waiting for sched_admit() to start it */
+        bool counted;               /* counted among the running background jobs */
+        int sched_class;            /* SCHED_FG, SCHED_BG or SCHED_BATCH */
+        int priority;               /* in the queue; higher starts first */
+        int cgroup;                 /* directory of the job's cgroup, or -1 */
+        unsigned cgroup_id;         /* the n of its cgroup job-<n>, 0 if none */
+        uint64_t cpu_usec, memory_peak;  /* read from the cgroup once it is done */
+        bool stream_failed;         /* a <z or >z stream of it failed */
 } job_t;
 
 /* Finds a job for which the pgid is still -1 (indicates not processed);
@@ -72,6 +109,11 @@ bool job_is_stopped(job_t *j);
 /* Return true if all processes in the job have completed.  */
 bool job_is_completed(job_t *j);
 
+/* Exit status of the last process of the job as the shell reports it:
+ * 128 + the signal number if it was killed or stopped, 1 if it exited with
+ * 0 but a <z or >z stream of the job failed, -1 while it runs */
+int job_exit_status(job_t *j);
+
 /* Find the last job.  */
 job_t *find_last_job();
 
@@ -105,10 +147,261 @@ int endswith(const char* haystack, const char* needle);
  * will always return NULL. 
  *
  * The parser supports these symbols: <, >, |, &, ;
+ * and $(cmdline) substitutions inside arguments.
  */
 
 job_t* readcmdline(char *msg);
 
+/* Same as readcmdline() but parses the given command line instead of
+ * reading it from stdin */
+job_t* parse_cmdline(char *cmdline);
+
+/* Stage builtins: commands run by dsh itself inside the forked child of a
+ * pipeline stage. Each returns the exit status of the command, or -1 when
+ * it cannot handle the arguments and the program must be exec'ed instead. */
+
+/* wc -l, -w and -c with the same output as coreutils wc */
+int builtin_wc(int argc, char **argv);
+
+/* sort -n -r -u -b -t -k -o -S -T; sorts in parallel under a memory cap */
+int builtin_sort(int argc, char **argv);
+
+/* par [-o] [-b bytes] N cmd: runs N copies of a line filter on shards of
+ * its input and merges their output, in input order with -o */
+int builtin_par(int argc, char **argv);
+
+/* Runs p in the current process and exits if it is a stage builtin;
+ * returns if it is not one */
+void run_stage_builtin(process_t *p);
+
+/* Server mode: dsh -s socket serves every connection to a Unix socket as
+ * a session of its own. The lines a client sends are run like the lines of
+ * a batch file; the output of the jobs goes back through the connection. */
+typedef struct session {
+        int id;                     /* numbers the sessions in the log */
+        int fd;                     /* the connection */
+        FILE *out;                  /* messages of the builtins, e.g. jobs */
+        int cwd;                    /* directory of the session, changed by cd */
+        bool quit;                  /* true once the client sent quit */
+} session_t;
+
+/* The session served by the calling thread; NULL when not in server mode.
+ * The job list is per thread too, so every session has its own jobs. */
+extern __thread session_t *current_session;
+
+extern __thread job_t *job_head;
+extern int dsh_is_interactive;
+
+/* true when dsh is linked into another program as libdsh */
+extern bool dsh_embedded;
+
+/* Forks the processes of a job without adding it to the job list, and
+ * waits for a job in the foreground; see also libdsh.h */
+bool launch_job(job_t *j, bool fg);
+void parent_wait(job_t *j, int fg);
+bool free_job(job_t *j);
+
+/* Descriptors (fd.c): everything dsh opens for itself is closed on exec,
+ * and a child closes what it inherited but the fds it keeps before exec */
+extern bool fd_audit;
+int cloexec_pipe(pipe_t fds);
+int fd_open(const char *path, int flags, mode_t mode);
+int fd_dup(int fd);
+int fd_socket(int domain, int type);
+int fd_accept(int listener);
+void fd_close_inherited(const int *keep, int n);
+void fd_list(int out, const char *who);
+void fd_audit_child(process_t *p);
+
+/* Job at a position of the job list, counting from 1 as jobs prints them;
+ * the last job if there are fewer */
+job_t *search_job_pos(int pos);
+
+/* Collects the status of the processes of one job without blocking */
+void reap_job(job_t *j);
+
+/* waitpid() that also keeps the CPU time of the process of j it reaps */
+pid_t wait_job(job_t *j, pid_t pid, int *status, int options);
+
+/* Runs the jobs of a parsed command line one after the other; returns the
+ * exit status of the last one (0 for a builtin or a background job) */
+int run_jobs(job_t *j);
+
+/* Collects the status of the jobs' processes without blocking, and frees
+ * the jobs that completed */
+void reap_children();
+void remove_zombies();
+
+/* writes a log line to dsh.log and stdout; fd 2 marks it as an error */
+void logger(int fd, const char *str, ...);
+
+/* logger() for a child between its fork and its exec: one write() to its
+ * stderr, and no lock another thread of dsh may have held at the fork */
+void child_error(const char *str, ...);
+
+/* Listens on the Unix socket at path and serves its clients with a pool
+ * of nthreads threads; only returns on error */
+int serve(const char *path, int nthreads);
+
+/* Tracing (trace.c): Chrome trace events of the job lifecycle, turned on
+ * with DSH_TRACE=file or the trace builtin. While it is off trace_clock()
+ * returns 0 and the other functions return at once. */
+extern int trace_fd;
+double trace_clock();
+bool trace_start(const char *path);
+void trace_stop();
+void trace_shell_span(const char *name, const char *detail, double start);
+void trace_span(const char *name, const char *detail, int pgid, int pid, double start);
+void trace_mark(char ph, const char *name, const char *detail, int pgid, int pid);
+void trace_job(job_t *j);
+void trace_reaped(job_t *j, process_t *p);
+
+/* Statistics (stats.c): latency histograms and counters, always on, shown
+ * by the stats builtin. Latencies are in nanoseconds of stats_clock(). */
+enum { STATS_PARSE, STATS_FORK_EXEC, STATS_EXEC_EXIT, STATS_JOB_WALL, STATS_PROMPT,
+       STATS_JOB_CPU, STATS_HISTOGRAMS };
+enum { STATS_JOBS, STATS_STAGES, STATS_REAPED, STATS_EXEC_FAILED, STATS_COUNTERS };
+uint64_t stats_clock();
+void stats_record(int which, uint64_t ns);
+void stats_count(int which);
+int stats_channel();
+void stats_exec(process_t *p, bool failed);
+void stats_reaped(job_t *j, process_t *p);
+void stats_print(FILE *out, bool json);
+void stats_reset();
+void stats_dump_at_exit(const char *path);
+
+/* Session journal (record.c): every command line with its timing, cwd and
+ * exit status, turned on with DSH_RECORD=file or the record builtin and
+ * replayed by dsh-replay. A journal is JOURNAL_MAGIC followed by records,
+ * each a journal_record_t then the cwd (cwd_len bytes, none when it did not
+ * change since the previous line of the session) then the line (line_len
+ * bytes, without the last newline; the lines of its here-documents follow
+ * it). Integers are in the byte order of the host. */
+#define JOURNAL_MAGIC     "DSHJ\002\n"
+#define JOURNAL_MAGIC_LEN 6
+typedef struct journal_record {
+        uint32_t size;              /* of the record, header included */
+        uint32_t session;           /* 0 outside server mode */
+        uint64_t gap;               /* ns since the previous line of the session was read */
+        uint64_t duration;          /* ns from reading the line to the next prompt */
+        int32_t status;             /* exit status of the line, see run_jobs() */
+        uint32_t line_len;
+        uint16_t cwd_len;
+} journal_record_t;
+extern int record_fd;
+bool record_start(const char *path);
+void record_stop();
+void record_read(const char *cmdline);
+void record_done(int status);
+
+/* Output spooling (spool.c): with spool_enabled the jobs started with &
+ * write to a spool that keeps their output, shown by the spool builtin and
+ * replayed by fg */
+#define SPOOL_DRAIN_WAIT 1000       /* ms fg waits for the output of a job that exited */
+extern bool spool_enabled;
+bool spool_on(const char *cap);
+bool spool_job(job_t *j);
+void spool_launched(job_t *j);
+void spool_release(spool_t *s);
+void spool_attach(spool_t *s, int fd, bool all, bool live);
+bool spool_wait(spool_t *s, int ms);
+void spool_detach(spool_t *s);
+void spool_tail(spool_t *s, int lines, int fd);
+void spool_size(spool_t *s, uint64_t *total, uint64_t *spilled);
+void spool_cmd(int argc, char **argv);
+
+/* Admission control (sched.c): at most sched_max background jobs run at
+ * once and none starts while the load average is above sched_load; the
+ * others wait on the job list, queued, until sched_admit() starts them */
+enum { SCHED_FG, SCHED_BG, SCHED_BATCH, SCHED_CLASSES };
+extern int sched_max;
+extern double sched_load;
+void start_job(job_t *j, bool fg);
+void sched_classify(job_t *j, bool fg);
+void sched_apply(job_t *j);
+bool sched_hold(job_t *j);
+void sched_started(job_t *j);
+void sched_reaped(job_t *j, process_t *p);
+bool sched_queued();
+void sched_admit();
+void sched_wait_input(int tty);
+void sched_drain();
+void sched_drop();
+void sched_cmd(int argc, char **argv);
+
+/* Per-job cgroups (cgroup.c), on with DSH_CGROUP or the cgroup builtin */
+bool cgroup_on();
+void cgroup_job(job_t *j);
+bool cgroup_enter(job_t *j, pid_t pid);
+void cgroup_reaped(job_t *j, process_t *p);
+void cgroup_release(job_t *j);
+void cgroup_cmd(int argc, char **argv);
+
+/* exit status of the last builtin */
+extern __thread int builtin_status;
+
+/* The wait builtin (wait.c); returns its exit status */
+int wait_cmd(int argc, char **argv);
+
+/* Compile-and-run of .c and .cpp commands (compile.c) */
+extern bool compile_in_memory;
+void compile(job_t *j, process_t *p);
+void compile_cmd(int argc, char **argv);
+
+/* Here-documents and here-strings (heredoc.c) */
+bool read_heredocs(job_t *first_job, FILE *in, const char *prompt, char **cmdline);
+void heredoc_stdin(process_t *p);
+
+/* Compressed redirections, <z and >z (zstream.c) */
+void zstream_open(process_t *p);
+int zstream_fd(zstream_t *z);
+void zstream_forked(process_t *p);
+void zstream_reaped(job_t *j, process_t *p);
+void zstream_release(process_t *p);
+
+/* I/O policies of the < and > redirections (iohint.c) */
+void iohint_open(process_t *p);
+void iohint_reaped(job_t *j, process_t *p);
+void iohint_cmd(int argc, char **argv);
+
+/* Shared-memory rings between the stages of a pipeline (shmpipe.c) */
+bool shmpipe_on(const char *size);
+int shmpipe_ring();
+void shmpipe_child(int in, int out);
+void shmpipe_cmd(int argc, char **argv);
+
+/* Capacity and fill of the pipes between stages (pipestat.c) */
+bool pipestat_on(const char *ms);
+bool pipestat_size(const char *bytes);
+void pipestat_pipe(process_t *p, pipe_t fds);
+void pipestat_pids(process_t *p);
+void pipestat_release(process_t *p);
+void pipestat_cmd(int argc, char **argv);
+
+/* Type-ahead of the lines of input that is not a terminal (readahead.c) */
+typedef struct readahead readahead_t;
+typedef struct readahead_line {
+        char *text;                 /* the line, to be freed */
+        job_t *jobs;                /* parsed, with their here-documents; NULL for none */
+        bool failed;                /* its here-documents could not be read */
+} readahead_line_t;
+readahead_t *readahead_start(FILE *in, bool comments, bool threaded);
+bool readahead_next(readahead_t *r, readahead_line_t *line, bool *last);
+void readahead_stop(readahead_t *r);
+
+/* History of the completed jobs, jobs -c (history.c) */
+void history_add(job_t *j, uint64_t started);
+bool history_cmd(int argc, char **argv);
+
+/* CPU placement of the stages of a job (place.c) */
+void place_job(job_t *j);
+void place_apply(process_t *p);
+void place_cmd(int argc, char **argv);
+
+/* Called for every process dsh reaps, once it is marked completed */
+void process_reaped(job_t *j, process_t *p);
+
 #ifdef NDEBUG
         #define DEBUG(M, ...)
 #else
@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+#include "dshring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <linux/futex.h>
+
+/* The client side of the rings of dshring.h. The writer publishes head and
+ * the reader tail with release stores; a side that finds the ring full or
+ * empty says so in its waits word, looks again and sleeps on the sequence
+ * the other side bumps when it sees that word set. Both look at the other
+ * side's waits word after their own store, with sequentially consistent
+ * atomics, so that one of them always sees the other. A sleep also ends
+ * every DSHRING_CHECK ms to find out whether the other side died without
+ * closing. */
+
+#define DSHRING_CHECK 1000
+
+enum { RING_NONE, RING_PIPE, RING_ON };
+
+struct dshring {
+    dshring_header_t *h;
+    unsigned char *data;
+    size_t map_size;
+    int fd;                         /* 0 or 1 */
+    int state;                      /* RING_NONE: the fd only; RING_PIPE: the
+                                       fd until the other side is on the ring */
+    int writer;
+};
+
+#define LOAD(p)       __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v)   __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define LOAD_SC(p)    __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define STORE_SC(p, v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+
+static void ring_wake(uint32_t *seq) {
+    __atomic_fetch_add(seq, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static void ring_sleep(uint32_t *seq, uint32_t seen) {
+    struct timespec check = { DSHRING_CHECK / 1000, (DSHRING_CHECK % 1000) * 1000000L };
+    syscall(SYS_futex, seq, FUTEX_WAIT, seen, &check, NULL, 0);
+}
+
+/* true if the process on the other side is gone */
+static int ring_gone(int32_t pid) {
+    return pid > 0 && kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+/* The ring in the descriptor named by var, or NULL */
+static dshring_t *ring_open(const char *var, int fd, int writer) {
+    const char *value = getenv(var);
+    dshring_header_t *h;
+    dshring_t *r;
+    struct stat st;
+    int ring;
+
+    if (value == NULL || (ring = atoi(value)) <= STDERR_FILENO)
+        return NULL;
+    unsetenv(var);                  /* not for the programs this one runs */
+    if (fstat(ring, &st) < 0 || st.st_size <= DSHRING_HEADER)
+        return NULL;
+    h = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring, 0);
+    close(ring);
+    if (h == MAP_FAILED)
+        return NULL;
+    if (h->magic != DSHRING_MAGIC || h->size + DSHRING_HEADER > (uint64_t) st.st_size ||
+        !(r = calloc(1, sizeof(dshring_t)))) {
+        munmap(h, st.st_size);
+        return NULL;
+    }
+    r->h = h;
+    r->data = (unsigned char *) h + DSHRING_HEADER;
+    r->map_size = st.st_size;
+    r->fd = fd;
+    r->writer = writer;
+    r->state = RING_PIPE;
+    STORE(writer ? &h->writer_pid : &h->reader_pid, (int32_t) getpid());
+    __atomic_fetch_or(&h->flags, writer ? DSHRING_WRITER : DSHRING_READER, __ATOMIC_SEQ_CST);
+    return r;
+}
+
+dshring_t *dshring_open_in(void) {
+    static dshring_t plain = { NULL, NULL, 0, STDIN_FILENO, RING_NONE, 0 };
+    dshring_t *r = ring_open("DSH_RING_IN", STDIN_FILENO, 0);
+    return r ? r : &plain;
+}
+
+dshring_t *dshring_open_out(void) {
+    static dshring_t plain = { NULL, NULL, 0, STDOUT_FILENO, RING_NONE, 1 };
+    dshring_t *r = ring_open("DSH_RING_OUT", STDOUT_FILENO, 1);
+    return r ? r : &plain;
+}
+
+/* The reader: the pipe until its end, then the ring if the writer took it */
+static int reader_on_ring(dshring_t *r, ssize_t *n, void *buf, size_t len) {
+    if (r->state == RING_NONE || r->state == RING_PIPE) {
+        while ((*n = read(r->fd, buf, len)) < 0 && errno == EINTR)
+            ;
+        if (*n != 0 || r->state == RING_NONE || !(LOAD_SC(&r->h->flags) & DSHRING_WRITER))
+            return 0;
+        r->state = RING_ON;
+    }
+    return 1;
+}
+
+ssize_t dshring_peek(dshring_t *r, const void **data, size_t len) {
+    dshring_header_t *h = r->h;
+    uint64_t head, tail;
+
+    if (r->state != RING_ON) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    tail = h->tail;
+    while ((head = LOAD(&h->head)) == tail) {
+        uint32_t seen = LOAD_SC(&h->data_seq);
+        uint32_t flags;
+        STORE_SC(&h->reader_waits, 1);
+        flags = LOAD_SC(&h->flags);
+        if ((head = LOAD_SC(&h->head)) != tail) {
+            STORE_SC(&h->reader_waits, 0);
+            break;
+        }
+        if ((flags & DSHRING_WRITER_DONE) || ring_gone(LOAD(&h->writer_pid))) {
+            STORE_SC(&h->reader_waits, 0);
+            return 0;
+        }
+        ring_sleep(&h->data_seq, seen);
+        STORE_SC(&h->reader_waits, 0);
+    }
+    /* up to the end of the data, where it wraps */
+    if (len > head - tail)
+        len = head - tail;
+    if (len > h->size - (tail & (h->size - 1)))
+        len = h->size - (tail & (h->size - 1));
+    *data = r->data + (tail & (h->size - 1));
+    return len;
+}
+
+void dshring_consume(dshring_t *r, size_t n) {
+    dshring_header_t *h = r->h;
+    STORE_SC(&h->tail, h->tail + n);
+    if (LOAD_SC(&h->writer_waits))
+        ring_wake(&h->space_seq);
+}
+
+ssize_t dshring_read(dshring_t *r, void *buf, size_t len) {
+    const void *data;
+    ssize_t n;
+
+    if (!r->writer && !reader_on_ring(r, &n, buf, len))
+        return n;
+    if ((n = dshring_peek(r, &data, len)) > 0) {
+        memcpy(buf, data, n);
+        dshring_consume(r, n);
+    }
+    return n;
+}
+
+static ssize_t fd_write(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const char *) buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        done += n;
+    }
+    return done;
+}
+
+/* The writer goes over to the ring once the reader is on it: the end of
+ * stdout tells the reader that what follows is in the ring */
+static void writer_switch(dshring_t *r) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+        dup2(null, r->fd);
+        close(null);
+    } else
+        close(r->fd);
+    r->state = RING_ON;
+}
+
+ssize_t dshring_write(dshring_t *r, const void *buf, size_t len) {
+    dshring_header_t *h = r->h;
+    size_t done = 0;
+
+    if (r->state == RING_PIPE && (LOAD_SC(&h->flags) & DSHRING_READER))
+        writer_switch(r);
+    if (r->state != RING_ON)
+        return fd_write(r->fd, buf, len);
+    while (done < len) {
+        uint64_t head = h->head, tail = LOAD(&h->tail);
+        size_t n, at;
+        while (head - tail == h->size) {
+            uint32_t seen = LOAD_SC(&h->space_seq);
+            uint32_t flags;
+            STORE_SC(&h->writer_waits, 1);
+            flags = LOAD_SC(&h->flags);
+            if ((tail = LOAD_SC(&h->tail)) != head - h->size) {
+                STORE_SC(&h->writer_waits, 0);
+                break;
+            }
+            if ((flags & DSHRING_READER_DONE) || ring_gone(LOAD(&h->reader_pid))) {
+                STORE_SC(&h->writer_waits, 0);
+                errno = EPIPE;
+                return -1;
+            }
+            ring_sleep(&h->space_seq, seen);
+            STORE_SC(&h->writer_waits, 0);
+        }
+        if (LOAD(&h->flags) & DSHRING_READER_DONE) {
+            errno = EPIPE;
+            return -1;
+        }
+        n = h->size - (head - tail);
+        if (n > len - done)
+            n = len - done;
+        at = head & (h->size - 1);
+        if (n > h->size - at)
+            n = h->size - at;
+        memcpy(r->data + at, (const char *) buf + done, n);
+        STORE_SC(&h->head, head + n);
+        if (LOAD_SC(&h->reader_waits))
+            ring_wake(&h->data_seq);
+        done += n;
+    }
+    return done;
+}
+
+int dshring_close(dshring_t *r) {
+    if (r->h == NULL)               /* the plain fd, kept for exit() */
+        return 0;
+    __atomic_fetch_or(&r->h->flags, r->writer ? DSHRING_WRITER_DONE : DSHRING_READER_DONE, __ATOMIC_SEQ_CST);
+    ring_wake(r->writer ? &r->h->data_seq : &r->h->space_seq);
+    munmap(r->h, r->map_size);
+    free(r);
+    return 0;
+}
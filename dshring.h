@@ -0,0 +1,76 @@
+#ifndef __DSHRING_H__
+#define __DSHRING_H__
+
+/* dshring: the shared-memory transport dsh sets up between the adjacent
+ * stages of a pipeline once "shmpipe on" is given (shmpipe.c). Every pipe of
+ * the pipeline is doubled by a ring in a memfd, a single-producer single-
+ * consumer queue with futex wakeups: data crosses it with one copy in and
+ * one copy out, and no system call while neither side has to wait. The
+ * writer finds the descriptor of its ring in DSH_RING_OUT, the reader in
+ * DSH_RING_IN. Build a filter with dshring.c and use
+ *
+ *     dshring_t *in = dshring_open_in(), *out = dshring_open_out();
+ *     while ((n = dshring_read(in, buf, sizeof(buf))) > 0)
+ *         dshring_write(out, buf, n);
+ *     dshring_close(out);
+ *     dshring_close(in);
+ *
+ * in place of read(0) and write(1). Programs that know nothing of it keep
+ * the pipe: the writer goes on writing to its stdout until the reader has
+ * attached to the ring, then closes stdout, and the reader takes the ring
+ * once it has read the pipe to its end. Without a ring, or outside dsh,
+ * dshring_read() and dshring_write() are read(0) and write(1).
+ *
+ * Functions that return int or ssize_t return -1 with errno set on
+ * failure; dshring_write() fails with EPIPE once the reader is gone.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DSHRING_MAGIC    0x64736872u        /* "dshr" */
+#define DSHRING_HEADER   4096               /* the data starts a page in */
+
+/* flags */
+#define DSHRING_WRITER      1u              /* the writer uses the ring */
+#define DSHRING_READER      2u              /* the reader uses the ring */
+#define DSHRING_WRITER_DONE 4u
+#define DSHRING_READER_DONE 8u
+
+/* The start of the memfd; the writer and the reader each own a cache line */
+typedef struct dshring_header {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t size;                          /* of the data, a power of 2 */
+    int32_t writer_pid, reader_pid;
+    char pad0[64 - 24];
+    uint64_t head;                          /* bytes written; the writer's */
+    uint32_t writer_waits;                  /* the writer sleeps on space */
+    uint32_t space_seq;                     /* futex: the reader made space */
+    char pad1[64 - 16];
+    uint64_t tail;                          /* bytes read; the reader's */
+    uint32_t reader_waits;                  /* the reader sleeps on data */
+    uint32_t data_seq;                      /* futex: the writer added data */
+} dshring_header_t;
+
+typedef struct dshring dshring_t;
+
+/* The stdin and stdout of a stage; never NULL, they fall back to the fds */
+dshring_t *dshring_open_in(void);
+dshring_t *dshring_open_out(void);
+
+/* read(0) and write(1) through the ring; dshring_write() writes it all */
+ssize_t dshring_read(dshring_t *r, void *buf, size_t len);
+ssize_t dshring_write(dshring_t *r, const void *buf, size_t len);
+
+/* Reads in place: points *data to what can be read at once, up to len,
+ * and returns its length (0 at the end); dshring_consume() then frees n
+ * bytes of it. Returns -1 with errno ENOTSUP while the data does not come
+ * from the ring, which dshring_read() then reads. */
+ssize_t dshring_peek(dshring_t *r, const void **data, size_t len);
+void dshring_consume(dshring_t *r, size_t n);
+
+/* Tells the other side this one is done, and frees r */
+int dshring_close(dshring_t *r);
+
+#endif
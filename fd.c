@@ -0,0 +1,175 @@
+#include "dsh.h"
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <dirent.h>
+#endif
+
+/* Descriptor hygiene. Every descriptor dsh opens for itself is close-on-exec
+ * from the start, through the functions below, so that no job inherits it:
+ * a job that keeps the write end of another job's pipe open keeps that
+ * pipe's reader from ever seeing EOF. Between fork and exec a child also
+ * closes everything above stderr but the few descriptors it still needs
+ * (fd_close_inherited()), which catches what close-on-exec cannot: the
+ * descriptors of a program that links libdsh, and the stage builtins,
+ * which are not exec'ed.
+ *
+ * With the audit on (DSH_FD_AUDIT or "fds audit on") every child writes the
+ * descriptors it is about to exec with to its stderr, dsh.log by default.
+ */
+
+#define FD_AUDIT_LINE 4096
+#define FD_SCAN_MAX   1024      /* descriptors probed where /proc is missing */
+
+bool fd_audit = false;
+
+/* Creates a pipe whose ends are closed on exec. dup2() clears the flag on
+ * the copies a child makes of them, so only the children forked meanwhile
+ * by other server threads lose them. */
+int cloexec_pipe(pipe_t fds) {
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) < 0)
+        return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+/* open() with O_CLOEXEC */
+int fd_open(const char *path, int flags, mode_t mode) {
+    return open(path, flags | O_CLOEXEC, mode);
+}
+
+/* dup() of fd that is closed on exec */
+int fd_dup(int fd) {
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+/* socket() and accept() returning descriptors that are closed on exec;
+ * where the flag cannot be given at once, a fork by another thread in
+ * between can still copy them, and fd_close_inherited() closes those */
+int fd_socket(int domain, int type) {
+#ifdef SOCK_CLOEXEC
+    return socket(domain, type | SOCK_CLOEXEC, 0);
+#else
+    int fd = socket(domain, type, 0);
+    if (fd >= 0)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+#endif
+}
+
+int fd_accept(int listener) {
+#ifdef __linux__
+    return accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+#else
+    int fd = accept(listener, NULL, NULL);
+    if (fd >= 0)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+#endif
+}
+
+/* Closes [from, to] */
+static void fd_close_range(int from, int to) {
+    int max;
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, (unsigned) from, (unsigned) to, 0) == 0)
+        return;
+#endif
+    max = (int) sysconf(_SC_OPEN_MAX);
+    if (to >= (max > 0 ? max : FD_SCAN_MAX))
+        to = (max > 0 ? max : FD_SCAN_MAX) - 1;
+    for (; from <= to; from++)
+        close(from);
+}
+
+/* Called by a child between fork and exec: closes every descriptor above
+ * stderr but the n in keep (the negative ones are ignored) */
+void fd_close_inherited(const int *keep, int n) {
+    int from = STDERR_FILENO + 1;
+    while (1) {
+        int i, next = -1;
+        /* the lowest kept descriptor at or above from */
+        for (i = 0; i < n; i++)
+            if (keep[i] >= from && (next < 0 || keep[i] < next))
+                next = keep[i];
+        if (next < 0)
+            break;
+        if (next > from)
+            fd_close_range(from, next - 1);
+        from = next + 1;
+    }
+    fd_close_range(from, ~0U >> 1);
+}
+
+/* What fd refers to, as the kernel names it where it can */
+static void fd_describe(int fd, char *buf, size_t size) {
+    struct stat st;
+#ifdef __linux__
+    char link[64];
+    ssize_t n;
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    if ((n = readlink(link, buf, size - 1)) >= 0) {
+        buf[n] = '\0';
+        return;
+    }
+#endif
+    if (fstat(fd, &st) < 0)
+        snprintf(buf, size, "?");
+    else if (S_ISFIFO(st.st_mode))
+        snprintf(buf, size, "pipe");
+    else if (S_ISSOCK(st.st_mode))
+        snprintf(buf, size, "socket");
+    else if (isatty(fd))
+        snprintf(buf, size, "tty");
+    else
+        snprintf(buf, size, "%s:%llu", S_ISDIR(st.st_mode) ? "dir" : "file",
+                 (unsigned long long) st.st_ino);
+}
+
+static size_t fd_append(char *line, size_t len, int fd) {
+    char target[256];
+    int flags = fcntl(fd, F_GETFD);
+    if (flags < 0 || len >= FD_AUDIT_LINE - 300)
+        return len;
+    fd_describe(fd, target, sizeof(target));
+    return len + snprintf(line + len, FD_AUDIT_LINE - len, " %d=%s%s", fd, target,
+                          flags & FD_CLOEXEC ? " (cloexec)" : "");
+}
+
+/* Writes the descriptors the calling process has open to out, as a single
+ * line starting with who */
+void fd_list(int out, const char *who) {
+    char line[FD_AUDIT_LINE];
+    size_t len = snprintf(line, sizeof(line), "%s:", who);
+    int fd;
+#ifdef __linux__
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            fd = atoi(entry->d_name);
+            if (entry->d_name[0] != '.' && fd != dirfd(dir))
+                len = fd_append(line, len, fd);
+        }
+        closedir(dir);
+    } else
+#endif
+    for (fd = 0; fd < FD_SCAN_MAX; fd++)
+        len = fd_append(line, len, fd);
+    line[len++] = '\n';
+    write(out, line, len);
+}
+
+/* Called by a child that is about to exec p */
+void fd_audit_child(process_t *p) {
+    char who[MAX_LEN_CMDLINE];
+    if (!fd_audit)
+        return;
+    snprintf(who, sizeof(who), "fd audit: %d %s", (int) getpid(), p->argv[0]);
+    fd_list(STDERR_FILENO, who);
+}
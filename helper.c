@@ -26,6 +26,23 @@ bool job_is_completed(job_t *j)
 	return true;
 }
 
+/* Exit status of the last process of the job as the shell reports it */
+int job_exit_status(job_t *j)
+{
+	process_t *p = j->first_process;
+	while(p && p->next)
+		p = p->next;
+	if(!p || (!p->completed && !p->stopped))
+		return -1;
+	if(WIFEXITED(p->status))
+		return WEXITSTATUS(p->status) == 0 && j->stream_failed ? 1 : WEXITSTATUS(p->status);
+	if(WIFSIGNALED(p->status))
+		return 128 + WTERMSIG(p->status);
+	if(WIFSTOPPED(p->status))
+		return 128 + WSTOPSIG(p->status);
+	return -1;
+}
+
 /* Find the last job.  */
 job_t *find_last_job(job_t *first_job) {
     job_t *j = first_job;
@@ -53,15 +70,30 @@ bool free_job(job_t *j)
 	if(!j)
 		return true;
 	free(j->commandinfo);
-	process_t *p;
-	for(p = j->first_process; p; p = p->next) {
+	process_t *p, *next;
+	for(p = j->first_process; p; p = next) {
 		int i;
 		for(i = 0; i < p->argc; i++)
 			free(p->argv[i]);
 		free(p->argv);
         	free(p->ifile);
         	free(p->ofile);
+		free(p->placement);
+		if(p->exec_fd > STDERR_FILENO)
+			close(p->exec_fd);
+		free(p->here_delim);
+		free(p->here_data);
+		zstream_release(p);
+		pipestat_release(p);
+		if(p->ifd > STDERR_FILENO)
+			close(p->ifd);
+		if(p->ofd > STDERR_FILENO)
+			close(p->ofd);
+		next = p->next;
+		free(p);
 	}
+	spool_release(j->spool);
+	cgroup_release(j);
 	free(j);
 	return true;
 }
@@ -0,0 +1,160 @@
+#include "dsh.h"
+#include <limits.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+/* Here-documents and here-strings:
+ *
+ *     cmd <<WORD       the lines that follow, up to one that is WORD
+ *     cmd <<-WORD      the same, with the leading tabs of the lines removed
+ *     cmd <<<word      word and a newline; word may be quoted
+ *
+ * parse_cmdline() keeps the delimiter of a here-document, whose lines
+ * read_heredocs() then takes from the input the command line came from.
+ * The child of the process gets the text as its stdin: a pipe it fills
+ * itself when the text fits the pipe, or else a sealed memfd, which it may
+ * seek in and map like a file. Either way nothing is written to disk;
+ * only where there is no memfd does a large text go to a temporary file.
+ * The lines read, delimiter included, are also added to the text of the
+ * command line, so that the session journal (record.c) replays them.
+ */
+
+#define HERE_PIPE_MAX PIPE_BUF      /* a pipe always holds that much */
+
+/* Adds line to the end of the string *cmdline */
+static bool append_line(char **cmdline, const char *line) {
+    size_t len = strlen(*cmdline), n = strlen(line);
+    char *more = realloc(*cmdline, len + n + 1);
+    if (more == NULL)
+        return false;
+    memcpy(more + len, line, n + 1);
+    *cmdline = more;
+    return true;
+}
+
+/* Reads the lines of the here-document of p from in, with prompt before
+ * each of them if there is one, and adds them to *cmdline if it is given */
+static bool read_heredoc(process_t *p, FILE *in, const char *prompt, char **cmdline) {
+    char line[MAX_LEN_CMDLINE], *data;
+    size_t len = 0, size = 256;
+
+    if (!(p->here_data = malloc(size)))
+        return false;
+    while (1) {
+        char *text = line;
+        size_t n;
+        if (prompt) {
+            fputs(prompt, stdout);
+            fflush(stdout);
+        }
+        if (!fgets(line, sizeof(line), in)) {
+            logger(STDERR_FILENO, "Here-document ended by end of file, not by %s", p->here_delim);
+            break;
+        }
+        if (cmdline && *cmdline && !append_line(cmdline, line))
+            return false;
+        if (p->here_strip)
+            text += strspn(text, "\t");
+        n = strcspn(text, "\n");
+        if (n == strlen(p->here_delim) && !strncmp(text, p->here_delim, n))
+            break;
+        n = strlen(text);
+        if (len + n + 1 > size) {
+            while (len + n + 1 > size)
+                size *= 2;
+            if (!(data = realloc(p->here_data, size)))
+                return false;
+            p->here_data = data;
+        }
+        memcpy(p->here_data + len, text, n);
+        len += n;
+    }
+    p->here_len = len;
+    free(p->here_delim);
+    p->here_delim = NULL;
+    return true;
+}
+
+/* Reads the here-documents of the jobs parsed from a line of in, in the
+ * order they appear on it, adding their lines to the malloc()ed line
+ * *cmdline if it is given. If they could not be stored, the jobs are freed
+ * and it returns false. */
+bool read_heredocs(job_t *first_job, FILE *in, const char *prompt, char **cmdline) {
+    job_t *j;
+    process_t *p;
+    for (j = first_job; j; j = j->next)
+        for (p = j->first_process; p; p = p->next)
+            if (p->here_delim && !read_heredoc(p, in, prompt, cmdline)) {
+                logger(STDERR_FILENO, "Here-document too large for memory");
+                while ((j = first_job) != NULL) {
+                    first_job = j->next;
+                    free_job(j);
+                }
+                return false;
+            }
+    return true;
+}
+
+static bool write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* A descriptor to read the text of p from, or -1 */
+static int here_fd(process_t *p) {
+    int fd;
+    if (p->here_len <= HERE_PIPE_MAX) {
+        pipe_t fds;
+        if (cloexec_pipe(fds) < 0)
+            return -1;
+        /* fits in the pipe: written in full before anyone reads */
+        write_all(fds[1], p->here_data, p->here_len);
+        close(fds[1]);
+        return fds[0];
+    }
+#ifdef __linux__
+    if ((fd = memfd_create("heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING)) >= 0) {
+        if (!write_all(fd, p->here_data, p->here_len)) {
+            close(fd);
+            return -1;
+        }
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+        lseek(fd, 0, SEEK_SET);
+        return fd;
+    }
+#endif
+    /* no memfd: an unlinked temporary file */
+    FILE *tmp = tmpfile();
+    if (tmp == NULL)
+        return -1;
+    fd = fd_dup(fileno(tmp));
+    fclose(tmp);
+    if (fd >= 0 && (!write_all(fd, p->here_data, p->here_len) || lseek(fd, 0, SEEK_SET) < 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Called by the child of p: makes the here-document or here-string of p
+ * its stdin */
+void heredoc_stdin(process_t *p) {
+    int fd;
+    if (p->here_data == NULL)
+        return;
+    if ((fd = here_fd(p)) < 0) {
+        child_error("Could not set up the here-document (errno %d)", errno);
+        return;
+    }
+    dup2(fd, STDIN_FILENO);
+    close(fd);
+}
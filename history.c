@@ -0,0 +1,140 @@
+#include "dsh.h"
+#include <pthread.h>
+#include <ctype.h>
+#include <time.h>
+
+/* The history of completed jobs: a ring of the last MAX_HISTORY of them,
+ * from every session, each kept as a fixed-size summary made when its last
+ * process is reaped. Adding one overwrites the oldest in O(1), so a batch
+ * of any length keeps a bounded record while its jobs are freed as soon as
+ * they are done. "jobs -c" shows it:
+ *
+ *     jobs -c [-f] [-n N] [TEXT]   the completed jobs, oldest first; with -f
+ *                                  only those with a stage that failed, with
+ *                                  TEXT only those whose command contains it,
+ *                                  with -n only the last N of them
+ */
+
+#define HISTORY_STAGES 8                /* exit statuses kept per job */
+
+typedef struct history {
+    uint64_t number;                    /* 1 for the first job completed */
+    pid_t pgid;
+    int session;                        /* 0 for the terminal */
+    time_t ended;
+    uint64_t wall_usec, cpu_usec;
+    int stages;                         /* may be more than HISTORY_STAGES */
+    int status[HISTORY_STAGES];         /* as job_exit_status() gives them */
+    bool failed;                        /* a stage did not exit with 0 */
+    char command[MAX_LEN_CMDLINE];
+} history_t;
+
+static history_t ring[MAX_HISTORY];
+static uint64_t completed, failed;      /* all of them, also those overwritten */
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int history_status(process_t *p) {
+    if (WIFEXITED(p->status))
+        return WEXITSTATUS(p->status);
+    if (WIFSIGNALED(p->status))
+        return 128 + WTERMSIG(p->status);
+    return -1;
+}
+
+/* Called once the last process of j is reaped; started is the
+ * stats_clock() of its launch */
+void history_add(job_t *j, uint64_t started) {
+    history_t h = { 0 };
+    process_t *p;
+    uint64_t cpu = 0;
+    size_t i;
+
+    h.pgid = j->pgid;
+    h.session = current_session ? current_session->id : 0;
+    h.ended = time(NULL);
+    h.wall_usec = (stats_clock() - started) / 1000;
+    for (p = j->first_process; p; p = p->next, h.stages++) {
+        int status = history_status(p);
+        if (h.stages < HISTORY_STAGES)
+            h.status[h.stages] = status;
+        if (status != 0)
+            h.failed = true;
+        cpu += p->cpu_usec;
+    }
+    /* the cgroup also counts what the processes left running */
+    h.cpu_usec = j->cpu_usec > cpu ? j->cpu_usec : cpu;
+    snprintf(h.command, sizeof(h.command), "%s", j->commandinfo + strspn(j->commandinfo, " \t"));
+    for (i = strcspn(h.command, "\n"); i > 0 && isspace((unsigned char) h.command[i - 1]); i--)
+        ;
+    h.command[i] = '\0';
+
+    pthread_mutex_lock(&history_lock);
+    h.number = ++completed;
+    failed += h.failed;
+    ring[(h.number - 1) % MAX_HISTORY] = h;
+    pthread_mutex_unlock(&history_lock);
+}
+
+static void history_print(FILE *out, history_t *h) {
+    char statuses[HISTORY_STAGES * 5 + 8], when[16];
+    struct tm tm;
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < h->stages && i < HISTORY_STAGES; i++)
+        len += snprintf(statuses + len, sizeof(statuses) - len, "%s%d", i ? "|" : "", h->status[i]);
+    if (h->stages > HISTORY_STAGES)
+        snprintf(statuses + len, sizeof(statuses) - len, "|...");
+    strftime(when, sizeof(when), "%H:%M:%S", localtime_r(&h->ended, &tm));
+    fprintf(out, "%6llu %7d %3d %s %-12s %9.3fs %9.3fs  %s\n", (unsigned long long) h->number,
+            (int) h->pgid, h->session, when, statuses, h->wall_usec / 1e6, h->cpu_usec / 1e6, h->command);
+}
+
+/* jobs -c; returns false on a usage error */
+bool history_cmd(int argc, char **argv) {
+    FILE *out = current_session ? current_session->out : stdout;
+    bool only_failed = false;
+    const char *text = NULL;
+    history_t *shown;
+    uint64_t first, number, total, total_failed;
+    int i, count = 0, last = MAX_HISTORY;
+
+    for (i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "-f"))
+            only_failed = true;
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            if ((last = atoi(argv[++i])) <= 0)
+                return false;
+        }
+        else if (argv[i][0] != '-' && text == NULL)
+            text = argv[i];
+        else
+            return false;
+    }
+    if (!(shown = malloc(MAX_HISTORY * sizeof(history_t))))
+        return true;
+
+    /* the newest first, so that -n keeps the last ones */
+    pthread_mutex_lock(&history_lock);
+    total = completed;
+    total_failed = failed;
+    first = completed > MAX_HISTORY ? completed - MAX_HISTORY + 1 : 1;
+    for (number = completed; number >= first && number > 0 && count < last; number--) {
+        history_t *h = &ring[(number - 1) % MAX_HISTORY];
+        if ((only_failed && !h->failed) || (text && !strstr(h->command, text)))
+            continue;
+        shown[count++] = *h;
+    }
+    pthread_mutex_unlock(&history_lock);
+
+    fprintf(out, "%llu jobs completed, %llu failed; the last %d kept\n", (unsigned long long) total,
+            (unsigned long long) total_failed, total < MAX_HISTORY ? (int) total : MAX_HISTORY);
+    if (count > 0)
+        fprintf(out, "%6s %7s %3s %-8s %-12s %10s %10s  %s\n",
+                "#", "pgid", "ses", "ended", "exit", "wall", "cpu", "command");
+    while (count > 0)
+        history_print(out, &shown[--count]);
+    fflush(out);
+    free(shown);
+    return true;
+}
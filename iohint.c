@@ -0,0 +1,176 @@
+#include "dsh.h"
+#include <pthread.h>
+
+/* I/O policies of the < and > redirections:
+ *
+ *     iohint in seq            input files are read sequentially: dsh opens them
+ *                              before the fork, marks them POSIX_FADV_SEQUENTIAL
+ *                              (a larger readahead window for the open file the
+ *                              child inherits) and reads their first
+ *                              IOHINT_READAHEAD bytes ahead, so that the page
+ *                              cache is warm when the child starts
+ *     iohint in nocache        their pages are dropped from the page cache once
+ *                              the process is reaped
+ *     iohint out prealloc SIZE output files get SIZE bytes of disk (k, m or g)
+ *                              allocated at once with fallocate(), so that a
+ *                              large output is laid out in few extents; what
+ *                              the process did not write is given back when
+ *                              it is reaped
+ *     iohint out nocache       output files are written back and dropped from
+ *                              the page cache once the process is reaped
+ *     iohint in|out off        back to plain open() by the child
+ *
+ * The policies are shell-wide: those set in a server session apply to the
+ * jobs of every session from then on. A process keeps those it was opened
+ * under until it is reaped.
+ *
+ * Bulk output is not opened with O_DIRECT: the programs a shell runs write
+ * with buffers and offsets O_DIRECT would refuse. Dropping the written back
+ * pages at the end keeps them out of the page cache all the same.
+ */
+
+#define IOHINT_READAHEAD (16 << 20)
+
+typedef struct iohint_policy {
+    bool in_sequential, in_nocache, out_nocache;
+    off_t out_prealloc;
+} iohint_policy_t;
+
+static iohint_policy_t policy;
+static pthread_mutex_t iohint_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static iohint_policy_t iohint_policy(void) {
+    iohint_policy_t now;
+    pthread_mutex_lock(&iohint_lock);
+    now = policy;
+    pthread_mutex_unlock(&iohint_lock);
+    return now;
+}
+
+/* Called by dsh for every process of a job before it is forked: opens its
+ * redirections when a policy applies to them */
+void iohint_open(process_t *p) {
+    int dir = current_session ? current_session->cwd : AT_FDCWD;
+    iohint_policy_t now = iohint_policy();
+    struct stat st;
+
+    if (p->ifile && !p->izip && p->ifd < 0 && (now.in_sequential || now.in_nocache) &&
+        (p->ifd = openat(dir, p->ifile, O_RDONLY | O_CLOEXEC)) >= 0) {
+        p->inocache = now.in_nocache;
+        if (now.in_sequential) {
+            posix_fadvise(p->ifd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            if (fstat(p->ifd, &st) == 0 && S_ISREG(st.st_mode)) {
+#ifdef __linux__
+                readahead(p->ifd, 0, st.st_size < IOHINT_READAHEAD ? st.st_size : IOHINT_READAHEAD);
+#else
+                posix_fadvise(p->ifd, 0, IOHINT_READAHEAD, POSIX_FADV_WILLNEED);
+#endif
+            }
+        }
+    }
+    if (p->ofile && !p->ozip && p->ofd < 0 && (now.out_prealloc > 0 || now.out_nocache) &&
+        (p->ofd = openat(dir, p->ofile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) >= 0) {
+        p->onocache = now.out_nocache;
+        if (now.out_prealloc > 0 && fstat(p->ofd, &st) == 0 && S_ISREG(st.st_mode)) {
+            p->oprealloc = true;
+#ifdef __linux__
+            /* the size stays what the process writes */
+            fallocate(p->ofd, FALLOC_FL_KEEP_SIZE, 0, now.out_prealloc);
+#endif
+        }
+    }
+}
+
+/* Called once p is reaped: applies the policies that act at the end and
+ * closes the files */
+void iohint_reaped(job_t *j, process_t *p) {
+    struct stat st;
+    if (p->ifd >= 0) {
+        if (p->inocache)
+            posix_fadvise(p->ifd, 0, 0, POSIX_FADV_DONTNEED);
+        close(p->ifd);
+        p->ifd = -1;
+    }
+    if (p->ofd >= 0) {
+        /* gives back the blocks allocated past the end */
+        if (p->oprealloc && fstat(p->ofd, &st) == 0)
+            ftruncate(p->ofd, st.st_size);
+        if (p->onocache) {
+            fdatasync(p->ofd);
+            posix_fadvise(p->ofd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        close(p->ofd);
+        p->ofd = -1;
+    }
+}
+
+static bool iohint_size(const char *value, off_t *size) {
+    char *end;
+    long long amount = strtoll(value, &end, 10);
+    if (amount <= 0 || strlen(end) > 1 || (*end && !strchr("kKmMgG", *end)))
+        return false;
+    switch (*end) {
+        case 'k': case 'K': amount *= 1024; break;
+        case 'm': case 'M': amount *= 1024 * 1024; break;
+        case 'g': case 'G': amount *= 1024 * 1024 * 1024; break;
+    }
+    *size = amount;
+    return true;
+}
+
+/* The iohint builtin; see above */
+void iohint_cmd(int argc, char **argv) {
+    FILE *out = current_session ? current_session->out : stdout;
+    iohint_policy_t now = iohint_policy();
+    int i;
+
+    if (argc == 1) {
+        fprintf(out, "in: %s\n", now.in_sequential && now.in_nocache ? "seq nocache" :
+                now.in_sequential ? "seq" : now.in_nocache ? "nocache" : "off");
+        if (now.out_prealloc > 0)
+            fprintf(out, "out: prealloc %lld%s\n", (long long) now.out_prealloc,
+                    now.out_nocache ? " nocache" : "");
+        else
+            fprintf(out, "out: %s\n", now.out_nocache ? "nocache" : "off");
+        fflush(out);
+        return;
+    }
+    if (argc > 2 && !strcmp(argv[1], "in")) {
+        for (i = 2; i < argc; i++)
+            if (!strcmp(argv[i], "seq"))
+                now.in_sequential = true;
+            else if (!strcmp(argv[i], "nocache"))
+                now.in_nocache = true;
+            else if (!strcmp(argv[i], "off"))
+                now.in_sequential = now.in_nocache = false;
+            else
+                goto usage;
+        pthread_mutex_lock(&iohint_lock);
+        policy.in_sequential = now.in_sequential;
+        policy.in_nocache = now.in_nocache;
+        pthread_mutex_unlock(&iohint_lock);
+        return;
+    }
+    if (argc > 2 && !strcmp(argv[1], "out")) {
+        for (i = 2; i < argc; i++)
+            if (!strcmp(argv[i], "prealloc") && i + 1 < argc) {
+                if (!iohint_size(argv[++i], &now.out_prealloc))
+                    goto usage;
+            }
+            else if (!strcmp(argv[i], "nocache"))
+                now.out_nocache = true;
+            else if (!strcmp(argv[i], "off")) {
+                now.out_prealloc = 0;
+                now.out_nocache = false;
+            }
+            else
+                goto usage;
+        pthread_mutex_lock(&iohint_lock);
+        policy.out_prealloc = now.out_prealloc;
+        policy.out_nocache = now.out_nocache;
+        pthread_mutex_unlock(&iohint_lock);
+        return;
+    }
+usage:
+    logger(STDERR_FILENO, "Error: usage: iohint [in seq|nocache|off ... | out prealloc SIZE[kmg]|nocache|off ...]");
+}
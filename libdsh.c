@@ -0,0 +1,201 @@
+#include "dsh.h"
+#include "libdsh.h"
+
+/* libdsh: a pipeline is a job_t built from argv arrays instead of by the
+ * parser, launched with launch_job() and waited for with parent_wait() and
+ * reap_job(), the same code the shell runs. It is never put on the job
+ * list, so the caller owns it and the shell's job control does not see it. */
+
+static process_t *stage(dsh_pipeline_t *pl, int index)
+{
+    process_t *p = pl->first_process;
+    while (p != NULL && index-- > 0)
+        p = p->next;
+    return p;
+}
+
+static process_t *last_stage(dsh_pipeline_t *pl)
+{
+    process_t *p = pl->first_process;
+    while (p != NULL && p->next != NULL)
+        p = p->next;
+    return p;
+}
+
+dsh_pipeline_t *dsh_pipeline_new(void)
+{
+    job_t *j = malloc(sizeof(job_t));
+    if (j == NULL || !init_job(j)) {
+        free(j);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return j;
+}
+
+int dsh_pipeline_add(dsh_pipeline_t *pl, char *const argv[])
+{
+    process_t *p, *last = last_stage(pl);
+    int i, argc = 0, index = dsh_pipeline_stages(pl);
+
+    if (argv == NULL || argv[0] == NULL || pl->pgid > 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (argv[argc] != NULL)
+        argc++;
+    if (!(p = malloc(sizeof(process_t))) || !init_process(p)) {
+        free(p);
+        errno = ENOMEM;
+        return -1;
+    }
+    free(p->argv);
+    if (!(p->argv = calloc(argc + 1, sizeof(char *)))) {
+        free(p);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = 0; i < argc; i++, p->argc++) {
+        if (!(p->argv[i] = strdup(argv[i]))) {
+            while (i-- > 0)
+                free(p->argv[i]);
+            free(p->argv);
+            free(p);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    if (last == NULL)
+        pl->first_process = p;
+    else
+        last->next = p;
+
+    /* commandinfo names the stages in log messages */
+    size_t len = strlen(pl->commandinfo);
+    if (len > 0 && len + 3 < MAX_LEN_CMDLINE)
+        strcat(pl->commandinfo, " | ");
+    strncat(pl->commandinfo, argv[0], MAX_LEN_CMDLINE - strlen(pl->commandinfo) - 1);
+    return index;
+}
+
+int dsh_pipeline_set_fd(dsh_pipeline_t *pl, int which, int fd)
+{
+    if (fd < 0 || pl->pgid > 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    switch (which) {
+        case STDIN_FILENO: pl->mystdin = fd; break;
+        case STDOUT_FILENO: pl->mystdout = fd; break;
+        case STDERR_FILENO: pl->mystderr = fd; break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+    return 0;
+}
+
+int dsh_pipeline_set_file(dsh_pipeline_t *pl, int which, const char *path)
+{
+    process_t *p = which == STDIN_FILENO ? pl->first_process : last_stage(pl);
+    char **file;
+    char *copy;
+
+    if (p == NULL || pl->pgid > 0 || (which != STDIN_FILENO && which != STDOUT_FILENO)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!(copy = strdup(path))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    /* io_redirection() opens them in the child, after the fds are set up */
+    file = which == STDIN_FILENO ? &p->ifile : &p->ofile;
+    free(*file);
+    *file = copy;
+    return 0;
+}
+
+int dsh_pipeline_start(dsh_pipeline_t *pl)
+{
+    if (pl->first_process == NULL || pl->pgid > 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* not in the foreground: the library never hands over the terminal */
+    if (!launch_job(pl, false)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+int dsh_pipeline_poll(dsh_pipeline_t *pl)
+{
+    if (pl->pgid <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    reap_job(pl);
+    return job_is_completed(pl);
+}
+
+int dsh_pipeline_wait(dsh_pipeline_t *pl)
+{
+    if (pl->pgid <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!job_is_completed(pl))
+        parent_wait(pl, true);
+    return dsh_pipeline_status(pl, dsh_pipeline_stages(pl) - 1);
+}
+
+int dsh_pipeline_run(dsh_pipeline_t *pl)
+{
+    if (dsh_pipeline_start(pl) < 0)
+        return -1;
+    return dsh_pipeline_wait(pl);
+}
+
+int dsh_pipeline_signal(dsh_pipeline_t *pl, int sig)
+{
+    if (pl->pgid <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return kill(-pl->pgid, sig);
+}
+
+int dsh_pipeline_stages(dsh_pipeline_t *pl)
+{
+    process_t *p;
+    int count = 0;
+    for (p = pl->first_process; p; p = p->next)
+        count++;
+    return count;
+}
+
+pid_t dsh_pipeline_pid(dsh_pipeline_t *pl, int stage_index)
+{
+    process_t *p = stage(pl, stage_index);
+    return p != NULL ? p->pid : -1;
+}
+
+int dsh_pipeline_status(dsh_pipeline_t *pl, int stage_index)
+{
+    process_t *p = stage(pl, stage_index);
+    if (p == NULL || !p->completed)
+        return -1;
+    if (WIFEXITED(p->status))
+        return WEXITSTATUS(p->status);
+    if (WIFSIGNALED(p->status))
+        return 128 + WTERMSIG(p->status);
+    return -1;
+}
+
+void dsh_pipeline_free(dsh_pipeline_t *pl)
+{
+    free_job(pl);
+}
@@ -0,0 +1,75 @@
+#ifndef __LIBDSH_H__
+#define __LIBDSH_H__
+
+/* libdsh: runs pipelines the way dsh does (process group per pipeline,
+ * stage builtins such as sort and wc, close-on-exec pipes) from a C
+ * program, without formatting and parsing a command line. Build it with
+ * "make libdsh.a libdsh.so" and link with -ldsh -lpthread -lz.
+ *
+ *     char *grep[] = { "grep", "ERROR", NULL };
+ *     char *wc[] = { "wc", "-l", NULL };
+ *     dsh_pipeline_t *pl = dsh_pipeline_new();
+ *     dsh_pipeline_add(pl, grep);
+ *     dsh_pipeline_add(pl, wc);
+ *     dsh_pipeline_set_file(pl, STDIN_FILENO, "app.log");
+ *     dsh_pipeline_set_fd(pl, STDOUT_FILENO, fd);
+ *     status = dsh_pipeline_run(pl);
+ *     dsh_pipeline_free(pl);
+ *
+ * Functions that return int return 0 (or a count or status) on success
+ * and -1 with errno set on failure. The library writes nothing to stdout;
+ * its errors go to stderr.
+ */
+
+#include <sys/types.h>
+
+typedef struct job dsh_pipeline_t;
+
+/* Returns an empty pipeline, or NULL when out of memory */
+dsh_pipeline_t *dsh_pipeline_new(void);
+
+/* Appends a stage running argv (NULL terminated; argv[0] is looked up in
+ * PATH). The strings are copied. Returns the index of the stage. */
+int dsh_pipeline_add(dsh_pipeline_t *pl, char *const argv[]);
+
+/* Connects the stdin of the first stage, the stdout of the last stage or
+ * the stderr of every stage (which is STDIN_FILENO, STDOUT_FILENO or
+ * STDERR_FILENO) to fd. The caller keeps fd open until the pipeline has
+ * started, and should make its other descriptors close-on-exec: a child
+ * that inherits the write end of a pipe keeps its reader from seeing EOF. */
+int dsh_pipeline_set_fd(dsh_pipeline_t *pl, int which, int fd);
+
+/* Same as dsh_pipeline_set_fd() for a file, opened by the child: stdin of
+ * the first stage, or stdout of the last stage added so far (created or
+ * truncated) */
+int dsh_pipeline_set_file(dsh_pipeline_t *pl, int which, const char *path);
+
+/* Forks the stages and returns without waiting */
+int dsh_pipeline_start(dsh_pipeline_t *pl);
+
+/* Returns 1 once every stage has exited, 0 otherwise; does not block */
+int dsh_pipeline_poll(dsh_pipeline_t *pl);
+
+/* Waits for every stage and returns the exit status of the last one */
+int dsh_pipeline_wait(dsh_pipeline_t *pl);
+
+/* dsh_pipeline_start() then dsh_pipeline_wait() */
+int dsh_pipeline_run(dsh_pipeline_t *pl);
+
+/* Sends sig to every process of a started pipeline */
+int dsh_pipeline_signal(dsh_pipeline_t *pl, int sig);
+
+/* Number of stages */
+int dsh_pipeline_stages(dsh_pipeline_t *pl);
+
+/* Process id of a stage, once started */
+pid_t dsh_pipeline_pid(dsh_pipeline_t *pl, int stage);
+
+/* Exit status of a stage (128 + the signal number if it was killed), or
+ * -1 if it has not exited yet */
+int dsh_pipeline_status(dsh_pipeline_t *pl, int stage);
+
+/* Frees the pipeline; a started one must have been waited for */
+void dsh_pipeline_free(dsh_pipeline_t *pl);
+
+#endif /* __LIBDSH_H__ */
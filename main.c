@@ -10,5 +10,26 @@
 #include "dsh.c"
 #include "helper.c"
 #include "parse.c"
+#include "wc.c"
+#include "sort.c"
+#include "par.c"
+#include "server.c"
+#include "trace.c"
+#include "stats.c"
+#include "record.c"
+#include "spool.c"
+#include "fd.c"
+#include "sched.c"
+#include "cgroup.c"
+#include "place.c"
+#include "compile.c"
+#include "wait.c"
+#include "heredoc.c"
+#include "zstream.c"
+#include "iohint.c"
+#include "history.c"
+#include "shmpipe.c"
+#include "pipestat.c"
+#include "readahead.c"
 
 
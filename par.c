@@ -0,0 +1,378 @@
+#include "dsh.h"
+#include <poll.h>
+
+/* Builtin par: runs N copies of a stateless filter as one pipeline stage.
+ *
+ *     par [-o] [-b BYTES] N command [args...]
+ *
+ * par reads its stdin in blocks cut after a newline and hands them out
+ * round robin to the copies that are not busy. Without -o each copy is
+ * started once, gets its blocks on its stdin, and its output is passed on
+ * a whole line at a time in whatever order the copies produce it. With -o
+ * each block gets a fresh copy of the command (at most N at a time) and the
+ * outputs are written in block order, so the result is what the command
+ * would print for the whole input, as long as it handles lines on their own.
+ */
+
+#define PAR_BLOCK         (64 * 1024)     /* unordered: block handed to a copy */
+#define PAR_ORDERED_BLOCK (1024 * 1024)   /* ordered: whole input of one copy */
+#define PAR_MAX_WORKERS   256
+#define PAR_ERROR         (-2)
+
+typedef struct par_buffer {
+    char *data;
+    size_t len, size, off;
+} par_buffer_t;
+
+typedef struct par_worker {
+    pid_t pid;              /* -1 when not running */
+    int in, out;            /* pipes to its stdin and from its stdout; -1 when closed */
+    par_buffer_t pending;   /* input not yet written to the copy */
+    par_buffer_t output;    /* output held back: partial line, or a later block */
+} par_worker_t;
+
+static int par_argc;
+static char **par_argv;
+static par_worker_t *par_workers;
+static int par_nworkers;
+static struct pollfd *par_fds;      /* 2 * i: stdin of copy i, 2 * i + 1: its stdout */
+static par_buffer_t par_input;
+static bool par_eof;
+
+static bool par_append(par_buffer_t *b, const char *data, size_t len)
+{
+    if (b->len + len > b->size) {
+        size_t size = b->size ? b->size : 4096;
+        while (size < b->len + len)
+            size *= 2;
+        char *bigger = realloc(b->data, size);
+        if (bigger == NULL)
+            return false;
+        b->data = bigger;
+        b->size = size;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return true;
+}
+
+/* memrchr for '\n', which not every libc has */
+static char *par_last_newline(char *data, size_t len)
+{
+    while (len > 0)
+        if (data[--len] == '\n')
+            return data + len;
+    return NULL;
+}
+
+static bool par_write_all(const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Forks a copy of the command reading from and writing to pipes */
+static bool par_start(par_worker_t *w)
+{
+    pipe_t in, out;
+
+    if (cloexec_pipe(in) < 0)
+        return false;
+    if (cloexec_pipe(out) < 0) {
+        close(in[0]);
+        close(in[1]);
+        return false;
+    }
+    if ((w->pid = fork()) < 0) {
+        close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+        return false;
+    }
+    if (w->pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        signal(SIGPIPE, SIG_DFL);
+        /* the other copies only see EOF once every write end is closed */
+        fd_close_inherited(NULL, 0);
+        process_t p = { .argc = par_argc, .argv = par_argv };
+        run_stage_builtin(&p);
+        execvp(par_argv[0], par_argv);
+        fprintf(stderr, "par: %s: %s\n", par_argv[0], strerror(errno));
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    w->in = in[1];
+    w->out = out[0];
+    fcntl(w->in, F_SETFL, fcntl(w->in, F_GETFL) | O_NONBLOCK);
+    return true;
+}
+
+/* Reads stdin until a block of the given size ending in a newline is
+ * buffered, then moves it to the worker's pending input. At EOF whatever is
+ * left is the last block. Returns false when there is no more input. */
+static bool par_next_block(par_worker_t *w, size_t block)
+{
+    par_buffer_t *in = &par_input;
+    char *nl = NULL;
+
+    while (!par_eof && (in->len < block || !(nl = par_last_newline(in->data, in->len)))) {
+        if (in->size - in->len < block) {
+            char *bigger = realloc(in->data, in->size + block);
+            if (bigger == NULL)
+                break;
+            in->data = bigger;
+            in->size += block;
+        }
+        ssize_t n = read(STDIN_FILENO, in->data + in->len, in->size - in->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            par_eof = true;
+        else
+            in->len += n;
+    }
+    if (in->len == 0)
+        return false;
+    size_t len = par_eof || nl == NULL ? in->len : (size_t) (nl - in->data + 1);
+    if (!par_append(&w->pending, in->data, len))
+        return false;
+    memmove(in->data, in->data + len, in->len - len);
+    in->len -= len;
+    return true;
+}
+
+static bool par_input_done(void)
+{
+    return par_eof && par_input.len == 0;
+}
+
+/* Writes as much pending input as the copy takes without blocking, and
+ * closes its stdin once it has all the input it will get */
+static void par_feed(par_worker_t *w, bool last)
+{
+    while (w->pending.off < w->pending.len) {
+        ssize_t n = write(w->in, w->pending.data + w->pending.off, w->pending.len - w->pending.off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n < 0)
+            break;          /* EPIPE: the copy is gone, drop its input */
+        w->pending.off += n;
+    }
+    w->pending.len = w->pending.off = 0;
+    if (last) {
+        close(w->in);
+        w->in = -1;
+    }
+}
+
+/* Reaps a copy. par succeeds if any copy did, as grep does when some
+ * block matched; otherwise it returns the status of the last failure. */
+static int par_wait(par_worker_t *w, int status)
+{
+    int wstatus;
+
+    if (w->pid > 0 && waitpid(w->pid, &wstatus, 0) == w->pid && status != EXIT_SUCCESS)
+        status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+    w->pid = -1;
+    return status;
+}
+
+static bool par_poll(void)
+{
+    int i;
+
+    for (i = 0; i < par_nworkers; i++) {
+        par_worker_t *w = &par_workers[i];
+        par_fds[2 * i].fd = w->in >= 0 && w->pending.len > 0 ? w->in : -1;
+        par_fds[2 * i].events = POLLOUT;
+        par_fds[2 * i + 1].fd = w->out;
+        par_fds[2 * i + 1].events = POLLIN;
+    }
+    while (poll(par_fds, 2 * par_nworkers, -1) < 0)
+        if (errno != EINTR)
+            return false;
+    return true;
+}
+
+/* Copies started once and fed round robin; output merged line by line */
+static int par_unordered(size_t block)
+{
+    char buf[PAR_BLOCK];
+    int i, next = 0, running = 0, status = -1;
+
+    for (i = 0; i < par_nworkers; i++, running++)
+        if (!par_start(&par_workers[i]))
+            return PAR_ERROR;
+
+    while (running > 0) {
+        /* hand blocks to the idle copies, taking them in turn, until every
+         * copy is busy: poll() would not wake for a copy waiting on input */
+        for (i = 0; i < par_nworkers && !par_input_done(); i++) {
+            par_worker_t *w = &par_workers[next];
+            next = (next + 1) % par_nworkers;
+            if (w->in >= 0 && w->pending.len == 0) {
+                par_next_block(w, block);
+                par_feed(w, false);
+                if (w->pending.len == 0)
+                    i = -1;     /* it took the whole block: go round again */
+            }
+        }
+        if (par_input_done())
+            for (i = 0; i < par_nworkers; i++)
+                if (par_workers[i].in >= 0 && par_workers[i].pending.len == 0)
+                    par_feed(&par_workers[i], true);
+
+        if (!par_poll())
+            return PAR_ERROR;
+        for (i = 0; i < par_nworkers; i++) {
+            par_worker_t *w = &par_workers[i];
+            if (par_fds[2 * i].revents)
+                par_feed(w, par_input_done());
+            if (!par_fds[2 * i + 1].revents)
+                continue;
+            ssize_t n = read(w->out, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n > 0) {
+                /* only whole lines go out, so lines of two copies never mix */
+                char *nl = par_last_newline(buf, n);
+                if (nl == NULL) {
+                    par_append(&w->output, buf, n);
+                    continue;
+                }
+                size_t head = nl - buf + 1;
+                if (!par_write_all(w->output.data, w->output.len) || !par_write_all(buf, head))
+                    return EXIT_FAILURE;
+                w->output.len = 0;
+                par_append(&w->output, buf + head, n - head);
+                continue;
+            }
+            if (!par_write_all(w->output.data, w->output.len))
+                return EXIT_FAILURE;
+            w->output.len = 0;
+            close(w->out);
+            w->out = -1;
+            if (w->in >= 0) {
+                close(w->in);
+                w->in = -1;
+            }
+            status = par_wait(w, status);
+            running--;
+        }
+    }
+    return status;
+}
+
+/* A copy per block, at most N running; outputs written in block order.
+ * par_workers is used as a ring of the blocks in flight, oldest at head. */
+static int par_ordered(size_t block)
+{
+    char buf[PAR_BLOCK];
+    int i, head = 0, count = 0, status = -1;
+
+    for (;;) {
+        while (count < par_nworkers && !par_input_done()) {
+            par_worker_t *w = &par_workers[(head + count) % par_nworkers];
+            if (!par_next_block(w, block))
+                break;
+            if (!par_start(w))
+                return PAR_ERROR;
+            par_feed(w, true);
+            count++;
+        }
+        if (count == 0)
+            return status;
+
+        if (!par_poll())
+            return PAR_ERROR;
+        for (i = 0; i < par_nworkers; i++) {
+            par_worker_t *w = &par_workers[i];
+            if (par_fds[2 * i].revents)
+                par_feed(w, true);
+            if (!par_fds[2 * i + 1].revents)
+                continue;
+            ssize_t n = read(w->out, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n > 0) {
+                /* the oldest block streams straight through, later ones wait */
+                if (i == head) {
+                    if (!par_write_all(buf, n))
+                        return EXIT_FAILURE;
+                } else
+                    par_append(&w->output, buf, n);
+                continue;
+            }
+            close(w->out);
+            w->out = -1;
+        }
+
+        /* retire finished blocks from the front, in order */
+        while (count > 0 && par_workers[head].out < 0) {
+            status = par_wait(&par_workers[head], status);
+            head = (head + 1) % par_nworkers;
+            if (--count > 0) {
+                par_worker_t *w = &par_workers[head];
+                if (!par_write_all(w->output.data, w->output.len))
+                    return EXIT_FAILURE;
+                w->output.len = 0;
+            }
+        }
+    }
+}
+
+/* Entry point of the par stage builtin */
+int builtin_par(int argc, char **argv)
+{
+    bool ordered = false;
+    size_t block = 0;
+    int i, status;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-o"))
+            ordered = true;
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+            block = strtoul(argv[++i], NULL, 10);
+        else
+            break;
+    }
+    if (i + 1 >= argc || (par_nworkers = atoi(argv[i])) <= 0 || par_nworkers > PAR_MAX_WORKERS) {
+        fprintf(stderr, "usage: par [-o] [-b bytes] N command [args...]\n");
+        return 2;
+    }
+    par_argc = argc - i - 1;
+    par_argv = argv + i + 1;
+    if (block == 0)
+        block = ordered ? PAR_ORDERED_BLOCK : PAR_BLOCK;
+
+    par_workers = calloc(par_nworkers, sizeof(par_worker_t));
+    par_fds = calloc(2 * par_nworkers, sizeof(struct pollfd));
+    if (par_workers == NULL || par_fds == NULL) {
+        perror("par");
+        return 2;
+    }
+    for (i = 0; i < par_nworkers; i++) {
+        par_workers[i].pid = -1;
+        par_workers[i].in = par_workers[i].out = -1;
+    }
+
+    /* a copy that exits early must not take par down with it */
+    signal(SIGPIPE, SIG_IGN);
+    status = ordered ? par_ordered(block) : par_unordered(block);
+    if (status == PAR_ERROR) {
+        fprintf(stderr, "par: %s: %s\n", par_argv[0], strerror(errno));
+        return 2;
+    }
+    /* no input at all: nothing was run */
+    return status < 0 ? EXIT_SUCCESS : status;
+}
@@ -15,6 +15,17 @@ bool init_job(job_t *j)
 	j->mystdout = STDOUT_FILENO;	/* 1 */ 
 	j->mystderr = STDERR_FILENO;	/* 2 */
 	j->bg = false;
+	j->started = 0;
+	j->spool = NULL;
+	j->queued = false;
+	j->counted = false;
+	j->sched_class = SCHED_FG;
+	j->priority = 0;
+	j->cgroup = -1;
+	j->cgroup_id = 0;
+	j->cpu_usec = 0;
+	j->memory_peak = 0;
+	j->stream_failed = false;
 	return true;
 }
 
@@ -29,6 +40,21 @@ bool init_process(process_t *p)
 	p->next = NULL;
 	p->ifile = NULL;
 	p->ofile = NULL;
+	p->forked = 0;
+	p->execed = 0;
+	p->exec_failed = false;
+	p->placement = NULL;
+	p->exec_fd = -1;
+	p->here_delim = NULL;
+	p->here_data = NULL;
+	p->here_len = 0;
+	p->here_strip = false;
+	p->izip = p->ozip = false;
+	p->zin = p->zout = NULL;
+	p->ifd = p->ofd = -1;
+	p->inocache = p->onocache = p->oprealloc = false;
+	p->cpu_usec = 0;
+	p->pipe_in = NULL;
 
 	if(!(p->argv = (char **)calloc(MAX_ARGS,sizeof(char *))))
 		return false;
@@ -48,16 +74,32 @@ bool readprocessinfo(process_t *p, char *cmd)
 	int args_pos = 0;   /* iterator for arguments*/
 
 	int argc = 0;
+	int depth = 0;      /* nesting level of $( ) inside the current argument */
 	
 	while (isspace(cmd[cmd_pos])){++cmd_pos;} /* ignore any spaces */
 	if(cmd[cmd_pos] == '\0')
 		return true;
 	
 	while(cmd[cmd_pos] != '\0'){
+		if(argc == MAX_ARGS-1) {
+			fprintf(stderr, "%s\n", "reading cmdline: too many arguments");
+			return false;
+		}
 		if(!(p->argv[argc] = (char *)calloc(MAX_LEN_CMDLINE, sizeof(char))))
 			return false;
-		while(cmd[cmd_pos] != '\0' && !isspace(cmd[cmd_pos])) 
+		/* a $( ) substitution is kept as part of a single argument even
+		 * if it contains spaces; it is expanded right before execution */
+		while(cmd[cmd_pos] != '\0' && (depth > 0 || !isspace(cmd[cmd_pos]))) {
+			if(cmd[cmd_pos] == '$' && cmd[cmd_pos+1] == '(') {
+				p->argv[argc][args_pos++] = cmd[cmd_pos++];
+				++depth;
+			}
+			else if(cmd[cmd_pos] == '(' && depth > 0)
+				++depth;
+			else if(cmd[cmd_pos] == ')' && depth > 0)
+				--depth;
 			p->argv[argc][args_pos++] = cmd[cmd_pos++];
+		}
 		p->argv[argc][args_pos] = '\0';
 		args_pos = 0;
 		++argc;
@@ -75,7 +117,7 @@ bool readprocessinfo(process_t *p, char *cmd)
  * and grouping are not supported. If the parser found some error, it
  * will always return NULL. 
  *
- * The parser supports these symbols: <, >, |, &, ;
+ * The parser supports these symbols: <, >, |, &, ; and <<, <<<, <z, >z
  */
 
 job_t* readcmdline(char *msg) 
@@ -88,8 +130,70 @@ job_t* readcmdline(char *msg)
 	    	fprintf(stderr, "%s\n","malloc: no space");
         	return NULL;
     	}
-	fgets(cmdline, MAX_LEN_CMDLINE, stdin);
+	if(!fgets(cmdline, MAX_LEN_CMDLINE, stdin)) {
+		free(cmdline);
+		return NULL;
+	}
+	double start = trace_clock();
+	uint64_t parse_start = stats_clock();
+	job_t *first_job = parse_cmdline(cmdline);
+	stats_record(STATS_PARSE, stats_clock() - parse_start);
+	trace_shell_span("parse", cmdline, start);
+	if(first_job && !read_heredocs(first_job, stdin, isatty(STDIN_FILENO) ? "> " : NULL, &cmdline))
+		first_job = NULL;
+	record_read(cmdline);           /* with the lines of its here-documents */
+	free(cmdline);
+	return first_job;
+}
+
+/* Parses the <<WORD, <<-WORD or <<<word at cmdline+*pos for p and moves
+ * *pos past it; the word may be quoted with ' or " */
+static bool read_here(process_t *p, char *cmdline, int *pos)
+{
+	bool string = cmdline[*pos+2] == '<';
+	char *word, quote = '\0';
+	int len = 0;
+
+	*pos += string ? 3 : 2;
+	p->here_strip = !string && cmdline[*pos] == '-';
+	if(p->here_strip)
+		++*pos;
+	while (isspace(cmdline[*pos]) && cmdline[*pos] != '\n'){++*pos;} /* ignore any spaces */
+	if(cmdline[*pos] == '\'' || cmdline[*pos] == '"')
+		quote = cmdline[(*pos)++];
+	if(!(word = (char *)malloc(strlen(cmdline + *pos) + 2))) {
+		fprintf(stderr, "%s\n","malloc: no space");
+		return false;
+	}
+	while(cmdline[*pos] != '\0' && cmdline[*pos] != '\n' &&
+	      (quote ? cmdline[*pos] != quote : !isspace(cmdline[*pos])))
+		word[len++] = cmdline[(*pos)++];
+	if(quote && cmdline[*pos] == quote)
+		++*pos;
+	else if(quote || len == 0) {
+		fprintf(stderr, "%s\n", string ? "reading cmdline: bad here-string" : "reading cmdline: bad here-document word");
+		free(word);
+		return false;
+	}
+	word[len] = '\0';
+	free(p->here_delim);
+	free(p->here_data);
+	p->here_delim = p->here_data = NULL;
+	if(string) {
+		word[len++] = '\n';
+		p->here_data = word;
+		p->here_len = len;
+	}
+	else
+		p->here_delim = word;
+	while(isspace(cmdline[*pos]) && cmdline[*pos] != '\n'){++*pos;}
+	return true;
+}
 
+/* Same as readcmdline() but parses the given string instead of reading a
+ * line from stdin; used for $( ) substitutions */
+job_t* parse_cmdline(char *cmdline)
+{
 	/* sequence is true only when the command line contains ; */
 	bool sequence = false;
 	/* seq_pos is used for storing the command line before ; */
@@ -109,7 +213,7 @@ job_t* readcmdline(char *msg)
 
 		/* cmdline is NOOP, i.e., just return with spaces */
 		while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
-		if(cmdline[cmdline_pos] == '\n' || cmdline[cmdline_pos] == '\0' || feof(stdin))
+		if(cmdline[cmdline_pos] == '\n' || cmdline[cmdline_pos] == '\0')
 			return NULL;
 
 		/* Check for invalid special symbols (characters) */
@@ -168,6 +272,14 @@ job_t* readcmdline(char *msg)
 			switch (cmdline[cmdline_pos]) {
 
 			    case '<': /* input redirection */
+				if(cmdline[cmdline_pos+1] == '<') { /* here-document or here-string */
+					if(!read_here(current_process, cmdline, &cmdline_pos)) {
+						delete_job(current_job,first_job);
+						return NULL;
+					}
+					valid_input = false;
+					break;
+				}
 				current_process->ifile = (char *) calloc(MAX_LEN_FILENAME, sizeof(char));
 				if(!current_process->ifile) {
 					fprintf(stderr, "%s\n","malloc: no space");
@@ -175,6 +287,10 @@ job_t* readcmdline(char *msg)
 					return NULL;
                 		}
 				++cmdline_pos;
+				if(cmdline[cmdline_pos] == 'z' && isspace(cmdline[cmdline_pos+1])) { /* <z: compressed */
+					current_process->izip = true;
+					++cmdline_pos;
+				}
 				while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
 				iofile_seek = 0;
 				while(cmdline[cmdline_pos] != '\0' && !isspace(cmdline[cmdline_pos])){
@@ -186,7 +302,6 @@ job_t* readcmdline(char *msg)
 					current_process->ifile[iofile_seek++] = cmdline[cmdline_pos++];
 				}
 				current_process->ifile[iofile_seek] = '\0';
-				current_job->mystdin = INPUT_FD;
 				while(isspace(cmdline[cmdline_pos])) {
 					if(cmdline[cmdline_pos] == '\n')
 						break;
@@ -203,6 +318,10 @@ job_t* readcmdline(char *msg)
                     			return NULL;
                 		}
 				++cmdline_pos;
+				if(cmdline[cmdline_pos] == 'z' && isspace(cmdline[cmdline_pos+1])) { /* >z: compressed */
+					current_process->ozip = true;
+					++cmdline_pos;
+				}
 				while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
 				iofile_seek = 0;
 				while(cmdline[cmdline_pos] != '\0' && !isspace(cmdline[cmdline_pos])){
@@ -214,7 +333,6 @@ job_t* readcmdline(char *msg)
 					current_process->ofile[iofile_seek++] = cmdline[cmdline_pos++];
 				}
 				current_process->ofile[iofile_seek] = '\0';
-				current_job->mystdout = OUTPUT_FD;
 				while(isspace(cmdline[cmdline_pos])) {
 					if(cmdline[cmdline_pos] == '\n')
 						break;
@@ -266,6 +384,31 @@ job_t* readcmdline(char *msg)
 				end_of_input = true;
 				break;
 
+			   case '$': /* command substitution; copied verbatim up to the matching ) */
+				if(cmdline[cmdline_pos+1] == '(') {
+					int depth = 0;
+					cmd[cmd_pos++] = cmdline[cmdline_pos++];
+					do {
+						if(cmdline[cmdline_pos] == '\n' || cmdline[cmdline_pos] == '\0') {
+							fprintf(stderr, "%s\n", "reading cmdline: unterminated $(");
+							delete_job(current_job,first_job);
+							return NULL;
+						}
+						if(cmd_pos == MAX_LEN_CMDLINE-1) {
+							fprintf(stderr,"%s\n","reading cmdline: length exceeds the max limit");
+							delete_job(current_job,first_job);
+							return NULL;
+						}
+						if(cmdline[cmdline_pos] == '(')
+							++depth;
+						else if(cmdline[cmdline_pos] == ')')
+							--depth;
+						cmd[cmd_pos++] = cmdline[cmdline_pos++];
+					} while(depth > 0);
+					break;
+				}
+				/* a lone $ is an ordinary character */
+
 			   default:
 				if(!valid_input) {
 					fprintf(stderr, "%s\n", "reading cmdline: could not fathom input");
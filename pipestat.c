@@ -0,0 +1,293 @@
+#include "dsh.h"
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <limits.h>
+
+/* Capacity and fill of the pipes between the stages of a pipeline.
+ *
+ *     pipestat                 the pipes of the jobs: capacity, fill and, once
+ *                              sampled, how often each was empty (its reader
+ *                              starved) or full (its writer blocked), and the
+ *                              stage that holds the pipeline back
+ *     pipestat on [MS]         samples every pipe every MS ms (50 by default)
+ *     pipestat off             stops sampling
+ *     pipestat size BYTES      pipes of BYTES (k or m) for the jobs started from
+ *                              now on, 0 for the default of the system
+ *     pipestat size N BYTES    resizes the pipes of job N, which may be running
+ *
+ * DSH_PIPE_SIZE=BYTES and DSH_PIPESTAT=MS set the same at startup. Linux
+ * only: F_SETPIPE_SZ sets the capacities (up to /proc/sys/fs/pipe-max-size
+ * without CAP_SYS_RESOURCE) and FIONREAD reads the fills.
+ *
+ * dsh keeps no end of a pipe open: it would keep the reader from seeing the
+ * end of its input or the writer from getting SIGPIPE until dsh gets around
+ * to reap the other side. The sampler thread opens the pipe again through
+ * /proc/<pid>/fd of a stage for every sample instead, and checks that it is
+ * still the same pipe. The list of pipes is shared by all the sessions.
+ */
+
+#define PIPESTAT_TICK 50            /* ms between samples by default */
+
+struct pipestat {
+    struct pipestat *next;
+    pid_t writer, reader;           /* 0 until forked, and once reaped */
+    dev_t dev;
+    ino_t ino;
+    int capacity;
+    int fill;                       /* at the last sample */
+    uint64_t samples, empty, full, fill_sum;
+};
+
+static pipestat_t *pipes;
+static pthread_mutex_t pipestat_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pipe_size;               /* of new pipes, 0 for the default */
+static int tick;                    /* ms between samples, 0 when off */
+static bool sampling;               /* the sampler thread runs */
+
+/* Parses BYTES with an optional k or m */
+static bool pipestat_parse(const char *value, int *size) {
+    char *end;
+    long amount = strtol(value, &end, 10);
+    if (amount < 0 || strlen(end) > 1 || (*end && !strchr("kKmM", *end)))
+        return false;
+    switch (*end) {
+        case 'k': case 'K': amount <<= 10; break;
+        case 'm': case 'M': amount <<= 20; break;
+    }
+    if (amount > INT_MAX)
+        return false;
+    *size = amount;
+    return true;
+}
+
+/* The pipe s through the stdout of its writer or the stdin of its reader,
+ * opened anew, or -1 once neither has it */
+static int pipestat_open(pipestat_t *s) {
+#ifdef __linux__
+    char path[64];
+    struct stat st;
+    int i, fd;
+    for (i = 0; i < 2; i++) {
+        pid_t pid = i ? s->writer : s->reader;
+        if (pid <= 0)
+            continue;
+        snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int) pid, i ? STDOUT_FILENO : STDIN_FILENO);
+        if ((fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+            continue;
+        if (fstat(fd, &st) == 0 && st.st_dev == s->dev && st.st_ino == s->ino)
+            return fd;
+        close(fd);
+    }
+#endif
+    return -1;
+}
+
+static void pipestat_sample(pipestat_t *s) {
+    int fd = pipestat_open(s), fill;
+    if (fd < 0)
+        return;
+    if (ioctl(fd, FIONREAD, &fill) == 0) {
+        s->fill = fill;
+        s->fill_sum += fill;
+        s->samples++;
+        if (fill == 0)
+            s->empty++;
+        /* a writer waits for a whole free page */
+        else if (fill > s->capacity - 4096)
+            s->full++;
+    }
+    close(fd);
+}
+
+static void *pipestat_thread(void *arg) {
+    pipestat_t *s;
+    pthread_mutex_lock(&pipestat_lock);
+    while (tick > 0) {
+        struct timespec pause = { tick / 1000, (tick % 1000) * 1000000L };
+        for (s = pipes; s; s = s->next)
+            pipestat_sample(s);
+        pthread_mutex_unlock(&pipestat_lock);
+        nanosleep(&pause, NULL);
+        pthread_mutex_lock(&pipestat_lock);
+    }
+    sampling = false;
+    pthread_mutex_unlock(&pipestat_lock);
+    return NULL;
+}
+
+bool pipestat_on(const char *ms) {
+#ifdef __linux__
+    pthread_t thread;
+    int every = ms && *ms ? atoi(ms) : PIPESTAT_TICK;
+    if (every <= 0)
+        return false;
+    pthread_mutex_lock(&pipestat_lock);
+    tick = every;
+    if (!sampling && pthread_create(&thread, NULL, pipestat_thread, NULL) == 0) {
+        pthread_detach(thread);
+        sampling = true;
+    }
+    pthread_mutex_unlock(&pipestat_lock);
+    return sampling;
+#else
+    return false;
+#endif
+}
+
+bool pipestat_size(const char *bytes) {
+    int size;
+    if (!pipestat_parse(bytes, &size))
+        return false;
+    pipe_size = size;
+    return true;
+}
+
+/* Called by dsh with the pipe it has just made from p to the next process:
+ * gives it its capacity and starts to follow it */
+void pipestat_pipe(process_t *p, pipe_t fds) {
+#ifdef __linux__
+    pipestat_t *s;
+    struct stat st;
+
+    if (pipe_size > 0 && fcntl(fds[PIPE_WRITE], F_SETPIPE_SZ, pipe_size) < 0)
+        logger(STDERR_FILENO, "Could not give the pipe after %s %d bytes", p->argv[0], pipe_size);
+    if (fstat(fds[PIPE_READ], &st) < 0 || !(s = calloc(1, sizeof(pipestat_t))))
+        return;
+    s->dev = st.st_dev;
+    s->ino = st.st_ino;
+    s->capacity = fcntl(fds[PIPE_READ], F_GETPIPE_SZ);
+    pthread_mutex_lock(&pipestat_lock);
+    s->next = pipes;
+    pipes = s;
+    p->next->pipe_in = s;
+    pthread_mutex_unlock(&pipestat_lock);
+#endif
+}
+
+/* Called once p is forked, and once it is reaped: the pids the sampler
+ * finds the pipes through */
+void pipestat_pids(process_t *p) {
+    pid_t pid = p->completed ? 0 : p->pid;
+    pthread_mutex_lock(&pipestat_lock);
+    if (p->pipe_in)
+        p->pipe_in->reader = pid;
+    if (p->next && p->next->pipe_in)
+        p->next->pipe_in->writer = pid;
+    pthread_mutex_unlock(&pipestat_lock);
+}
+
+void pipestat_release(process_t *p) {
+    pipestat_t **link;
+    if (p->pipe_in == NULL)
+        return;
+    pthread_mutex_lock(&pipestat_lock);
+    for (link = &pipes; *link; link = &(*link)->next)
+        if (*link == p->pipe_in) {
+            *link = p->pipe_in->next;
+            break;
+        }
+    pthread_mutex_unlock(&pipestat_lock);
+    free(p->pipe_in);
+    p->pipe_in = NULL;
+}
+
+/* Share of the samples of s, in percent */
+static int pipestat_share(pipestat_t *s, uint64_t count) {
+    return s->samples ? (int) (count * 100 / s->samples) : 0;
+}
+
+/* Prints the pipes of j, and the stage whose input pipe is full most often
+ * while its output pipe is empty: the first stage counts as always fed and
+ * the last as never held back */
+static void pipestat_job(FILE *out, int pos, job_t *j) {
+    process_t *p, *previous = NULL, *slowest = NULL;
+    int score, best = -1, n = 0;
+    bool sampled = false;
+
+    fprintf(out, "[%d] %s\n", pos, j->commandinfo);
+    for (p = j->first_process; p; previous = p, p = p->next) {
+        pipestat_t *in = p->pipe_in, *next = p->next ? p->next->pipe_in : NULL;
+        if (in) {
+            int fd = pipestat_open(in);
+            if (fd >= 0) {
+                ioctl(fd, FIONREAD, &in->fill);
+                in->capacity = fcntl(fd, F_GETPIPE_SZ);
+                close(fd);
+            }
+            fprintf(out, "    %s | %s: capacity %d, fill %d", previous->argv[0], p->argv[0],
+                    in->capacity, in->fill);
+            if (in->samples)
+                fprintf(out, ", average %llu, empty %d%%, full %d%% of %llu samples",
+                        (unsigned long long) (in->fill_sum / in->samples), pipestat_share(in, in->empty),
+                        pipestat_share(in, in->full), (unsigned long long) in->samples);
+            fputc('\n', out);
+            sampled |= in->samples > 0;
+            n++;
+        }
+        score = (in ? pipestat_share(in, in->full) : 100) + (next ? pipestat_share(next, next->empty) : 100);
+        if ((in || next) && score > best) {
+            best = score;
+            slowest = p;
+        }
+    }
+    if (n == 0)
+        fprintf(out, "    no pipes\n");
+    else if (sampled && slowest)
+        fprintf(out, "    bottleneck: %s\n", slowest->argv[0]);
+}
+
+void pipestat_cmd(int argc, char **argv) {
+    FILE *out = current_session ? current_session->out : stdout;
+    job_t *j;
+    int pos, size;
+
+    if (argc == 1) {
+        pthread_mutex_lock(&pipestat_lock);
+        if (pipe_size)
+            fprintf(out, "pipes of %d bytes, ", pipe_size);
+        else
+            fputs("pipes of the default size, ", out);
+        if (tick)
+            fprintf(out, "sampled every %d ms\n", tick);
+        else
+            fputs("not sampled\n", out);
+        for (j = job_head, pos = 1; j; j = j->next, pos++)
+            if (!job_is_completed(j))
+                pipestat_job(out, pos, j);
+        pthread_mutex_unlock(&pipestat_lock);
+        fflush(out);
+    }
+    else if (argc <= 3 && !strcmp(argv[1], "on")) {
+        if (!pipestat_on(argc == 3 ? argv[2] : NULL))
+            logger(STDERR_FILENO, "Error: pipestat on needs Linux and a number of ms");
+    }
+    else if (argc == 2 && !strcmp(argv[1], "off")) {
+        pthread_mutex_lock(&pipestat_lock);
+        tick = 0;
+        pthread_mutex_unlock(&pipestat_lock);
+    }
+    else if (argc == 3 && !strcmp(argv[1], "size")) {
+        if (!pipestat_size(argv[2]))
+            logger(STDERR_FILENO, "Error: usage: pipestat size BYTES");
+    }
+    else if (argc == 4 && !strcmp(argv[1], "size")) {
+        process_t *p;
+        if (!(j = search_job_pos(atoi(argv[2]))) || !pipestat_parse(argv[3], &size) || size == 0) {
+            logger(STDERR_FILENO, "Error: usage: pipestat size N BYTES");
+            return;
+        }
+        pthread_mutex_lock(&pipestat_lock);
+        for (p = j->first_process; p; p = p->next) {
+            int fd = p->pipe_in ? pipestat_open(p->pipe_in) : -1;
+            if (fd < 0)
+                continue;
+            if (fcntl(fd, F_SETPIPE_SZ, size) < 0)
+                logger(STDERR_FILENO, "Could not give the pipe to %s %d bytes", p->argv[0], size);
+            p->pipe_in->capacity = fcntl(fd, F_GETPIPE_SZ);
+            close(fd);
+        }
+        pthread_mutex_unlock(&pipestat_lock);
+    }
+    else
+        logger(STDERR_FILENO, "Error: usage: pipestat [on [MS] | off | size [N] BYTES]");
+}
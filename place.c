@@ -0,0 +1,285 @@
+#include "dsh.h"
+#include <pthread.h>
+
+/* CPU placement of the processes of a job, decided when the job is spawned
+ * and applied by each child before it execs:
+ *
+ *     off      the kernel places them (the default)
+ *     pack     the stages of a pipeline share a cache: stage k is pinned to
+ *              the k-th CPU of one L3 domain, taken in an order that puts
+ *              SMT siblings next to each other, so that adjacent stages
+ *              pass their pipe data through a shared L1/L2 or at least the
+ *              L3. Successive jobs take the domains in turn.
+ *     spread   every job gets a whole NUMA node (an L3 domain where there is
+ *              one node), the nodes in turn, so that independent jobs stay
+ *              off each other's caches and memory
+ *     list     the stages get the CPU lists given to "place list", the last
+ *              one for the stages beyond
+ *
+ * The topology is read from sysfs once and limited to the CPUs dsh may run
+ * on. Outside Linux the policy is kept but nothing is pinned.
+ */
+
+#define PLACE_MAX_LISTS 16
+
+enum { PLACE_OFF, PLACE_PACK, PLACE_SPREAD, PLACE_LIST };
+static const char *place_names[] = { "off", "pack", "spread", "list" };
+
+static int place_policy = PLACE_OFF;
+static unsigned place_next;         /* domain of the next job */
+
+#ifdef __linux__
+#include <sched.h>
+
+struct placement {
+    cpu_set_t cpus;
+};
+
+typedef struct domain {
+    int count;
+    int cpus[CPU_SETSIZE];          /* SMT siblings next to each other */
+} domain_t;
+
+static pthread_once_t place_once = PTHREAD_ONCE_INIT;
+static cpu_set_t allowed;
+static domain_t *caches, *nodes;    /* L3 domains and NUMA nodes */
+static int cache_count, node_count;
+static cpu_set_t place_lists[PLACE_MAX_LISTS];
+static int place_list_count;
+
+/* Parses a CPU list as the kernel writes them, "0-3,8,10-11" */
+static bool place_parse(const char *list, cpu_set_t *set) {
+    char *end;
+    CPU_ZERO(set);
+    while (*list && *list != '\n') {
+        long from = strtol(list, &end, 10), to = from;
+        if (end == list || from < 0)
+            return false;
+        if (*end == '-' && (to = strtol(end + 1, &end, 10)) < from)
+            return false;
+        if (to >= CPU_SETSIZE)
+            return false;
+        if (*end && *end != ',' && *end != '\n')
+            return false;
+        for (; from <= to; from++)
+            CPU_SET(from, set);
+        list = *end == ',' ? end + 1 : end;
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+/* Writes set as a CPU list */
+static void place_format(const cpu_set_t *set, char *buf, size_t size) {
+    size_t len = 0;
+    int cpu, from = -1;
+    buf[0] = '\0';
+    for (cpu = 0; cpu <= CPU_SETSIZE; cpu++) {
+        bool in = cpu < CPU_SETSIZE && CPU_ISSET(cpu, set);
+        if (in && from < 0)
+            from = cpu;
+        else if (!in && from >= 0) {
+            if (len < size)
+                len += snprintf(buf + len, size - len, from == cpu - 1 ? "%s%d" : "%s%d-%d",
+                                len ? "," : "", from, cpu - 1);
+            from = -1;
+        }
+    }
+}
+
+static bool place_read(const char *path, cpu_set_t *set) {
+    char buf[1024];
+    int fd = fd_open(path, O_RDONLY, 0);
+    ssize_t n;
+    if (fd < 0)
+        return false;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return false;
+    buf[n] = '\0';
+    return place_parse(buf, set);
+}
+
+/* Adds the domain made of the allowed CPUs of set, unless it is known;
+ * its CPUs are ordered core by core */
+static void place_add(domain_t **domains, int *count, cpu_set_t *set) {
+    char path[128];
+    cpu_set_t seen, siblings;
+    domain_t *d;
+    int i, cpu, sibling;
+
+    CPU_AND(set, set, &allowed);
+    if (CPU_COUNT(set) == 0)
+        return;
+    for (i = 0; i < *count; i++) {
+        cpu_set_t known;
+        CPU_ZERO(&known);
+        for (cpu = 0; cpu < (*domains)[i].count; cpu++)
+            CPU_SET((*domains)[i].cpus[cpu], &known);
+        if (CPU_EQUAL(&known, set))
+            return;
+    }
+    if (!(d = realloc(*domains, (*count + 1) * sizeof(domain_t))))
+        return;
+    *domains = d;
+    d = &d[(*count)++];
+    d->count = 0;
+    CPU_ZERO(&seen);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, set) || CPU_ISSET(cpu, &seen))
+            continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        if (!place_read(path, &siblings)) {
+            CPU_ZERO(&siblings);
+            CPU_SET(cpu, &siblings);
+        }
+        for (sibling = 0; sibling < CPU_SETSIZE; sibling++)
+            if (CPU_ISSET(sibling, &siblings) && CPU_ISSET(sibling, set) && !CPU_ISSET(sibling, &seen)) {
+                CPU_SET(sibling, &seen);
+                d->cpus[d->count++] = sibling;
+            }
+    }
+}
+
+static void place_topology() {
+    char path[128];
+    cpu_set_t set, online;          /* node ids fit a cpu_set_t as well */
+    int cpu, node;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        CPU_ZERO(&allowed);
+        for (cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &allowed);
+    }
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index3/shared_cpu_list", cpu);
+        if (place_read(path, &set))
+            place_add(&caches, &cache_count, &set);
+    }
+    if (place_read("/sys/devices/system/node/online", &online))
+        for (node = 0; node < CPU_SETSIZE; node++) {
+            if (!CPU_ISSET(node, &online))
+                continue;
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+            if (place_read(path, &set))
+                place_add(&nodes, &node_count, &set);
+        }
+    /* without sysfs, all of them make one domain */
+    if (cache_count == 0) {
+        set = allowed;
+        place_add(&caches, &cache_count, &set);
+    }
+    if (node_count == 0) {
+        set = allowed;
+        place_add(&nodes, &node_count, &set);
+    }
+}
+
+/* Decides where the processes of a job that is about to be spawned run */
+void place_job(job_t *j) {
+    domain_t *d;
+    process_t *p;
+    int k = 0;
+
+    if (place_policy == PLACE_OFF)
+        return;
+    pthread_once(&place_once, place_topology);
+    if (place_policy == PLACE_SPREAD && node_count > 1)
+        d = &nodes[__atomic_fetch_add(&place_next, 1, __ATOMIC_RELAXED) % node_count];
+    else
+        d = &caches[__atomic_fetch_add(&place_next, 1, __ATOMIC_RELAXED) % cache_count];
+    for (p = j->first_process; p; p = p->next, k++) {
+        int i;
+        if (!(p->placement = malloc(sizeof(placement_t))))
+            return;
+        CPU_ZERO(&p->placement->cpus);
+        if (place_policy == PLACE_LIST)
+            p->placement->cpus = place_lists[k < place_list_count ? k : place_list_count - 1];
+        else if (place_policy == PLACE_PACK)
+            CPU_SET(d->cpus[k % d->count], &p->placement->cpus);
+        else
+            for (i = 0; i < d->count; i++)
+                CPU_SET(d->cpus[i], &p->placement->cpus);
+    }
+}
+
+/* Called by the child of p before it execs */
+void place_apply(process_t *p) {
+    if (p->placement && sched_setaffinity(0, sizeof(cpu_set_t), &p->placement->cpus) < 0)
+        child_error("Could not pin %s (errno %d)", p->argv[0], errno);
+}
+
+static void place_show(FILE *out) {
+    char list[256];
+    job_t *j;
+    process_t *p;
+    int pos = 1;
+
+    pthread_once(&place_once, place_topology);
+    place_format(&allowed, list, sizeof(list));
+    fprintf(out, "placement: %s; CPUs %s in %d L3 domain%s and %d node%s\n", place_names[place_policy],
+            list, cache_count, cache_count == 1 ? "" : "s", node_count, node_count == 1 ? "" : "s");
+    for (j = job_head; j; j = j->next, pos++) {
+        if (!j->first_process->placement)
+            continue;
+        fprintf(out, "[%d]", pos);
+        for (p = j->first_process; p; p = p->next) {
+            if (p->placement)
+                place_format(&p->placement->cpus, list, sizeof(list));
+            fprintf(out, "%s %s on %s", p == j->first_process ? "" : " |", p->argv[0],
+                    p->placement ? list : "any");
+        }
+        fprintf(out, "\n");
+    }
+}
+
+static bool place_set_lists(int argc, char **argv) {
+    int i;
+    if (argc < 1 || argc > PLACE_MAX_LISTS)
+        return false;
+    for (i = 0; i < argc; i++)
+        if (!place_parse(argv[i], &place_lists[i]))
+            return false;
+    place_list_count = argc;
+    return true;
+}
+#else
+void place_job(job_t *j) {}
+void place_apply(process_t *p) {}
+static void place_show(FILE *out) {
+    fprintf(out, "placement: %s; not supported on this system\n", place_names[place_policy]);
+}
+static bool place_set_lists(int argc, char **argv) {
+    return argc > 0;
+}
+#endif
+
+/* The place builtin:
+ *     place                    shows the policy, the topology and where the jobs run
+ *     place off|pack|spread    policy for the jobs spawned from now on
+ *     place list CPUS...       pins stage k to the k-th CPU list, "0-3,8" */
+void place_cmd(int argc, char **argv) {
+    FILE *out = current_session ? current_session->out : stdout;
+    int i;
+
+    if (argc == 1) {
+        place_show(out);
+        fflush(out);
+        return;
+    }
+    if (argc > 2 && !strcmp(argv[1], "list")) {
+        if (!place_set_lists(argc - 2, argv + 2))
+            logger(STDERR_FILENO, "Error: place list takes up to %d CPU lists such as 0-3,8", PLACE_MAX_LISTS);
+        else
+            place_policy = PLACE_LIST;
+        return;
+    }
+    for (i = PLACE_OFF; i < PLACE_LIST; i++)
+        if (argc == 2 && !strcmp(argv[1], place_names[i])) {
+            place_policy = i;
+            return;
+        }
+    logger(STDERR_FILENO, "Error: usage: place [off | pack | spread | list CPUS...]");
+}
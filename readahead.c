@@ -0,0 +1,172 @@
+#include "dsh.h"
+#include <pthread.h>
+#include <time.h>
+
+/* Type-ahead for input that is not a terminal: piped stdin, scripts,
+ * dsh -c and the connections of server sessions. A reader thread reads the
+ * lines as they arrive, parses them and reads their here-documents, and
+ * queues up to READAHEAD_DEPTH of them ready to run; the shell takes them
+ * from the queue, so that the next job is launched as soon as the last one
+ * is done instead of after a read and a parse. The queue is bounded so that
+ * a long input is not parsed far ahead of what runs, and the reader waits
+ * for room. The queue also tells whether a line is waiting, which stdio
+ * cannot say without peeking into its FILE. The text of dsh -c is in
+ * memory already, so it gets no thread: each line is parsed when taken.
+ *
+ * A terminal keeps readcmdline(): reading ahead from it while a job runs in
+ * the foreground would stop dsh with SIGTTIN, and would take the lines typed
+ * for the job. Errors of the parser show up when a line is read, so
+ * possibly before the output of the jobs ahead of it.
+ */
+
+#define READAHEAD_DEPTH 64
+#define READAHEAD_TICK 100          /* ms between admission checks, as in sched.c */
+
+struct readahead {
+    FILE *in;
+    bool comments;                  /* skip the lines that start with # */
+    bool threaded;                  /* a reader thread fills the queue */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready, room;
+    readahead_line_t lines[READAHEAD_DEPTH];
+    int head, count;
+    bool ended;                     /* no more lines will be queued */
+    bool stopping;                  /* readahead_stop() wants the reader to end */
+};
+
+static void readahead_free_line(readahead_line_t *line) {
+    job_t *j;
+    while ((j = line->jobs) != NULL) {
+        line->jobs = j->next;
+        free_job(j);
+    }
+    free(line->text);
+}
+
+/* Reads and parses the next line of r->in and queues it; false at the end */
+static bool readahead_read(readahead_t *r) {
+    char line[MAX_LEN_CMDLINE];
+    readahead_line_t ready = { NULL, NULL, false };
+
+    do {    /* blank lines are not queued, so that the last line is known */
+        if (!fgets(line, sizeof(line), r->in))
+            return false;
+    } while (line[strspn(line, " \t\n")] == '\0' || (r->comments && line[strspn(line, " \t")] == '#'));
+    double start = trace_clock();
+    uint64_t parse_start = stats_clock();
+    ready.jobs = parse_cmdline(line);
+    stats_record(STATS_PARSE, stats_clock() - parse_start);
+    trace_shell_span("parse", line, start);
+    ready.text = strdup(line);      /* gets the lines of its here-documents */
+    if (ready.jobs && !read_heredocs(ready.jobs, r->in, NULL, &ready.text)) {
+        ready.jobs = NULL;
+        ready.failed = true;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    while (r->count == READAHEAD_DEPTH && !r->stopping)
+        pthread_cond_wait(&r->room, &r->lock);    /* until it is half empty */
+    if (r->stopping) {
+        pthread_mutex_unlock(&r->lock);
+        readahead_free_line(&ready);
+        return false;
+    }
+    r->lines[(r->head + r->count++) % READAHEAD_DEPTH] = ready;
+    pthread_cond_signal(&r->ready);
+    pthread_mutex_unlock(&r->lock);
+    return true;
+}
+
+static void *readahead_thread(void *arg) {
+    readahead_t *r = arg;
+    while (readahead_read(r))
+        ;
+    pthread_mutex_lock(&r->lock);
+    r->ended = true;
+    pthread_cond_signal(&r->ready);
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+/* Starts to read in ahead, in a thread if threaded and one can be made;
+ * without, readahead_next() reads each line itself, as for input that is
+ * already in memory */
+readahead_t *readahead_start(FILE *in, bool comments, bool threaded) {
+    readahead_t *r = calloc(1, sizeof(readahead_t));
+    if (r == NULL)
+        return NULL;
+    r->in = in;
+    r->comments = comments;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->ready, NULL);
+    pthread_cond_init(&r->room, NULL);
+    r->threaded = threaded && pthread_create(&r->thread, NULL, readahead_thread, r) == 0;
+    return r;
+}
+
+/* Takes the next line from the queue into *line, waiting for it and
+ * starting queued jobs meanwhile; false at the end of the input. With last,
+ * also waits for the line after it, to tell whether it is the last one. */
+bool readahead_next(readahead_t *r, readahead_line_t *line, bool *last) {
+    int ahead = last ? 1 : 0;
+
+    if (!r->threaded) {
+        while (r->count <= ahead && !r->ended)
+            r->ended = !readahead_read(r);
+    }
+    pthread_mutex_lock(&r->lock);
+    while (r->count <= ahead && !r->ended) {
+        if (sched_queued()) {
+            struct timespec tick;
+            clock_gettime(CLOCK_REALTIME, &tick);
+            tick.tv_nsec += READAHEAD_TICK * 1000000L;
+            tick.tv_sec += tick.tv_nsec / 1000000000L;
+            tick.tv_nsec %= 1000000000L;
+            if (pthread_cond_timedwait(&r->ready, &r->lock, &tick) != 0) {
+                pthread_mutex_unlock(&r->lock);
+                reap_children();
+                sched_admit();
+                pthread_mutex_lock(&r->lock);
+            }
+        }
+        else
+            pthread_cond_wait(&r->ready, &r->lock);
+    }
+    if (r->count == 0) {
+        pthread_mutex_unlock(&r->lock);
+        return false;
+    }
+    *line = r->lines[r->head];
+    r->head = (r->head + 1) % READAHEAD_DEPTH;
+    r->count--;
+    if (last)
+        *last = r->count == 0;
+    /* the reader refills half the queue at a time, not a line per job */
+    if (r->count == READAHEAD_DEPTH / 2)
+        pthread_cond_signal(&r->room);
+    pthread_mutex_unlock(&r->lock);
+    return true;
+}
+
+/* Frees r, in stays open. Before the end of the input, the caller first
+ * makes a read of in blocked in the reader return, as by a shutdown() of
+ * its socket; the lines queued are dropped. */
+void readahead_stop(readahead_t *r) {
+    pthread_mutex_lock(&r->lock);
+    r->stopping = true;
+    pthread_cond_signal(&r->room);
+    pthread_mutex_unlock(&r->lock);
+    if (r->threaded)
+        pthread_join(r->thread, NULL);
+    while (r->count > 0) {
+        readahead_line_t *line = &r->lines[r->head];
+        r->head = (r->head + 1) % READAHEAD_DEPTH;
+        r->count--;
+        readahead_free_line(line);
+    }
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->ready);
+    pthread_cond_destroy(&r->room);
+    free(r);
+}
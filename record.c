@@ -0,0 +1,135 @@
+#include "dsh.h"
+#include <limits.h>
+
+/* Session journal: a compact binary record of every command line dsh runs,
+ * with the time since the previous line of the same session, the time it
+ * took to get back to the prompt, the directory it ran in and its exit
+ * status. dsh-replay (replay.c) issues a journal against dsh again, so a
+ * real session becomes a repeatable load test.
+ *
+ * Each record is written with a single write() to a file opened with
+ * O_APPEND, so the server sessions share the journal without a lock. The
+ * line being run is kept per thread between record_read() and record_done().
+ * A line that has here-documents is kept with their lines, delimiters
+ * included, so that dsh-replay sends them along with it.
+ */
+
+/* -1 when recording is off; every record function returns right away then */
+int record_fd = -1;
+
+static uint64_t record_started;     /* stats_clock() at record_start() */
+static int record_generation;       /* bumped by record_start() */
+
+static __thread struct {
+    int generation, session;        /* what the rest was kept for */
+    uint64_t last_read, read_at;
+    bool pending;                   /* line read but not run yet */
+    char *line;                     /* malloc()ed, without the last newline */
+    char line_cwd[PATH_MAX];        /* where the line runs, "" if unknown */
+    char cwd[PATH_MAX];             /* of the last record */
+} rec;
+
+/* Directory the calling session runs its jobs in */
+static bool record_cwd(char *buf, size_t size) {
+    if (current_session == NULL)
+        return getcwd(buf, size) != NULL;
+#if defined(__linux__)
+    char link[64];
+    ssize_t n;
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", current_session->cwd);
+    if ((n = readlink(link, buf, size - 1)) < 0)
+        return false;
+    buf[n] = '\0';
+    return true;
+#elif defined(F_GETPATH)
+    return size >= MAXPATHLEN && fcntl(current_session->cwd, F_GETPATH, buf) != -1;
+#else
+    return false;
+#endif
+}
+
+/* Keeps a line that was just read until it has run */
+void record_read(const char *cmdline) {
+    int session = current_session ? current_session->id : 0;
+    size_t len;
+
+    if (record_fd < 0 || cmdline == NULL)
+        return;
+    /* the first line of a session measures its gap from the start of
+     * the journal, so the replay starts the sessions where they were */
+    if (rec.generation != record_generation || rec.session != session) {
+        rec.generation = record_generation;
+        rec.session = session;
+        rec.last_read = record_started;
+        rec.cwd[0] = '\0';
+    }
+    len = strlen(cmdline);
+    if (len > 0 && cmdline[len - 1] == '\n')
+        len--;
+    free(rec.line);
+    rec.pending = false;
+    if (!(rec.line = strndup(cmdline, len)))
+        return;
+    if (!record_cwd(rec.line_cwd, sizeof(rec.line_cwd)))
+        rec.line_cwd[0] = '\0';
+    rec.read_at = stats_clock();
+    rec.pending = true;
+}
+
+/* Appends the line kept by record_read() to the journal, now that it has
+ * run with the given exit status */
+void record_done(int status) {
+    char *buf;
+    journal_record_t r;             /* copied to the front of buf */
+    size_t len = sizeof(journal_record_t);
+
+    if (record_fd < 0 || !rec.pending || rec.generation != record_generation)
+        return;
+    rec.pending = false;
+    if (!(buf = malloc(len + strlen(rec.line_cwd) + strlen(rec.line))))
+        return;
+    memset(&r, 0, sizeof(r));
+    r.session = rec.session;
+    r.gap = rec.read_at - rec.last_read;
+    r.duration = stats_clock() - rec.read_at;
+    r.status = status;
+    rec.last_read = rec.read_at;
+
+    /* the directory only when it changed, most lines run where the
+     * previous one did */
+    if (rec.line_cwd[0] && strcmp(rec.line_cwd, rec.cwd) != 0) {
+        r.cwd_len = strlen(rec.line_cwd);
+        memcpy(buf + len, rec.line_cwd, r.cwd_len);
+        len += r.cwd_len;
+        strcpy(rec.cwd, rec.line_cwd);
+    }
+    r.line_len = strlen(rec.line);
+    memcpy(buf + len, rec.line, r.line_len);
+    len += r.line_len;
+    r.size = len;
+    memcpy(buf, &r, sizeof(journal_record_t));
+    write(record_fd, buf, len);
+    free(buf);
+    free(rec.line);
+    rec.line = NULL;
+}
+
+void record_stop() {
+    if (record_fd < 0)
+        return;
+    close(record_fd);
+    record_fd = -1;
+}
+
+/* Starts writing the journal to path, replacing what it held */
+bool record_start(const char *path) {
+    int fd = fd_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0)
+        return false;
+    record_stop();
+    write(fd, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+    record_started = stats_clock();
+    record_generation++;
+    record_fd = fd;
+    return true;
+}
@@ -0,0 +1,327 @@
+#include "dsh.h"
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* dsh-replay: issues the command lines of a journal written by dsh's record
+ * mode (record.c) against dsh again, keeping the gaps between the lines of
+ * each recorded session.
+ *
+ *     dsh-replay [-x speed] [-n copies] [-s socket | -d dsh] journal
+ *
+ * Every session of the journal is replayed as a session of its own: a dsh
+ * in batch mode fed through a pipe, or a connection to a dsh serving the
+ * socket. -n replays that many copies of each session at once, -x divides
+ * the gaps by speed (0 sends every line as soon as dsh takes it). A line
+ * that ran in another directory than the previous one is preceded by a cd.
+ * What dsh writes back is read and thrown away.
+ */
+
+#define REPLAY_BUF 65536
+
+typedef struct replay_line {
+    journal_record_t *record;
+    const char *cwd, *line;
+} replay_line_t;
+
+typedef struct replay_session {
+    uint32_t id;
+    replay_line_t *lines;
+    int count;
+} replay_session_t;
+
+typedef struct replayer {
+    pthread_t thread;
+    replay_session_t *session;
+    int in, out;                /* dsh's input and output */
+    pid_t pid;                  /* the dsh fed by a pipe, or 0 */
+    uint64_t lag, output;       /* worst lateness of a line, bytes read */
+    bool failed;
+} replayer_t;
+
+static double speed = 1;
+static const char *dsh_path = "./dsh";
+static const char *socket_path;
+static uint64_t replay_start;
+
+static replay_session_t *sessions;
+static int session_count;
+
+static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static replay_session_t *find_session(uint32_t id) {
+    int i;
+    for (i = 0; i < session_count; i++)
+        if (sessions[i].id == id)
+            return &sessions[i];
+    sessions = realloc(sessions, (session_count + 1) * sizeof(replay_session_t));
+    if (sessions == NULL) {
+        perror("dsh-replay");
+        exit(EXIT_FAILURE);
+    }
+    sessions[session_count] = (replay_session_t) { id, NULL, 0 };
+    return &sessions[session_count++];
+}
+
+/* Reads the whole journal and splits its records by session. Returns the
+ * number of lines. */
+static int load_journal(const char *path) {
+    struct stat st;
+    char *data;
+    size_t pos = JOURNAL_MAGIC_LEN;
+    int fd, lines = 0;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "dsh-replay: %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    /* a copy that stays aligned for the 64 bit fields of the records */
+    if (!(data = malloc(st.st_size + 1)) || read(fd, data, st.st_size) != st.st_size ||
+        st.st_size < JOURNAL_MAGIC_LEN || memcmp(data, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0) {
+        fprintf(stderr, "dsh-replay: %s is not a dsh journal\n", path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    while (pos + sizeof(journal_record_t) <= (size_t) st.st_size) {
+        journal_record_t *r = malloc(sizeof(journal_record_t));
+        replay_session_t *s;
+        char *cwd, *line;
+
+        memcpy(r, data + pos, sizeof(journal_record_t));
+        if (r->size != sizeof(journal_record_t) + r->cwd_len + r->line_len ||
+            pos + r->size > (size_t) st.st_size) {
+            fprintf(stderr, "dsh-replay: %s: bad record at offset %zu\n", path, pos);
+            free(r);
+            break;
+        }
+        cwd = strndup(data + pos + sizeof(journal_record_t), r->cwd_len);
+        line = strndup(data + pos + sizeof(journal_record_t) + r->cwd_len, r->line_len);
+        s = find_session(r->session);
+        s->lines = realloc(s->lines, (s->count + 1) * sizeof(replay_line_t));
+        if (!cwd || !line || !s->lines) {
+            perror("dsh-replay");
+            exit(EXIT_FAILURE);
+        }
+        s->lines[s->count++] = (replay_line_t) { r, cwd, line };
+        pos += r->size;
+        lines++;
+    }
+    free(data);
+    return lines;
+}
+
+/* Starts dsh in batch mode with pipes to its stdin and stdout. The pipes
+ * are close-on-exec: a dsh started later must not keep this one's stdin
+ * open, or it never sees the end of its input. */
+static bool start_dsh(replayer_t *rp) {
+    int in[2], out[2];
+    if (pipe(in) < 0)
+        return false;
+    if (pipe(out) < 0) {
+        close(in[0]);
+        close(in[1]);
+        return false;
+    }
+    fcntl(in[1], F_SETFD, FD_CLOEXEC);
+    fcntl(out[0], F_SETFD, FD_CLOEXEC);
+    switch (rp->pid = fork()) {
+        case -1:
+            close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+            return false;
+        case 0:
+            dup2(in[0], STDIN_FILENO);
+            dup2(out[1], STDOUT_FILENO);
+            close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+            signal(SIGPIPE, SIG_DFL);
+            execl(dsh_path, dsh_path, (char *) NULL);
+            fprintf(stderr, "dsh-replay: %s: %s\n", dsh_path, strerror(errno));
+            _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    rp->in = in[1];
+    rp->out = out[0];
+    return true;
+}
+
+/* Opens a session on the dsh serving socket_path */
+static bool connect_dsh(replayer_t *rp) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+        return false;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return false;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    rp->in = fd;
+    rp->out = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    return rp->out >= 0;
+}
+
+/* Reads what dsh wrote; false once it closed its end */
+static bool drain(replayer_t *rp) {
+    char buf[REPLAY_BUF];
+    ssize_t n = read(rp->out, buf, sizeof(buf));
+    if (n > 0)
+        rp->output += n;
+    return n > 0 || (n < 0 && (errno == EINTR || errno == EAGAIN));
+}
+
+/* Sends the lines of the session, each when its time comes, while reading
+ * dsh's output so that neither side blocks on a full pipe */
+static void *replay_session(void *arg) {
+    replayer_t *rp = arg;
+    replay_session_t *s = rp->session;
+    char *pending = NULL;           /* the line being sent, and a cd before it */
+    size_t len = 0, sent = 0;
+    uint64_t due = replay_start;
+    const char *cwd = "";
+    bool more = true;
+    int i = 0;
+
+    fcntl(rp->in, F_SETFL, fcntl(rp->in, F_GETFL) | O_NONBLOCK);
+    while (i < s->count || sent < len) {
+        if (sent == len) {
+            replay_line_t *l = &s->lines[i++];
+            if (speed > 0)
+                due += l->record->gap / speed;
+            int n;
+            len = sent = 0;
+            free(pending);
+            if (*l->cwd && strcmp(l->cwd, cwd) != 0) {
+                n = asprintf(&pending, "cd %s\n%s\n", l->cwd, l->line);
+                cwd = l->cwd;
+            }
+            else
+                n = asprintf(&pending, "%s\n", l->line);
+            if (n < 0) {
+                pending = NULL;
+                rp->failed = true;
+                break;
+            }
+            len = n;
+        }
+        uint64_t t = now();
+        int timeout = t >= due ? 0 : (int) ((due - t) / 1000000) + 1;
+        struct pollfd fds[2] = { { rp->out, POLLIN, 0 }, { rp->in, t >= due ? POLLOUT : 0, 0 } };
+
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR)
+            break;
+        if ((fds[0].revents & (POLLIN | POLLHUP)) && !drain(rp))
+            break;
+        if (fds[1].revents & (POLLERR | POLLHUP))
+            break;
+        if (fds[1].revents & POLLOUT) {
+            if (sent == 0 && now() - due > rp->lag)
+                rp->lag = now() - due;
+            ssize_t n = write(rp->in, pending + sent, len - sent);
+            if (n < 0 && errno != EAGAIN && errno != EINTR)
+                break;
+            if (n > 0)
+                sent += n;
+        }
+    }
+    if (i < s->count || sent < len)
+        rp->failed = true;
+    free(pending);
+
+    /* end of input: dsh finishes the session and closes its output */
+    if (rp->pid > 0)
+        close(rp->in);
+    else
+        shutdown(rp->in, SHUT_WR);
+    fcntl(rp->out, F_SETFL, fcntl(rp->out, F_GETFL) & ~O_NONBLOCK);
+    while (more)
+        more = drain(rp);
+    close(rp->out);
+    if (rp->pid == 0)
+        close(rp->in);
+    return NULL;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: dsh-replay [-x speed] [-n copies] [-s socket | -d dsh] journal\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    replayer_t *replayers;
+    int opt, i, copies = 1, count, lines, status, failed = 0;
+    uint64_t lag = 0, output = 0, span = 0;
+
+    while ((opt = getopt(argc, argv, "x:n:s:d:")) != -1) {
+        switch (opt) {
+            case 'x': speed = atof(optarg); break;
+            case 'n': copies = atoi(optarg); break;
+            case 's': socket_path = optarg; break;
+            case 'd': dsh_path = optarg; break;
+            default: usage();
+        }
+    }
+    if (optind != argc - 1 || copies <= 0 || speed < 0)
+        usage();
+    if ((lines = load_journal(argv[optind])) == 0) {
+        printf("%s holds no lines\n", argv[optind]);
+        return EXIT_SUCCESS;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    count = session_count * copies;
+    if (!(replayers = calloc(count, sizeof(replayer_t)))) {
+        perror("dsh-replay");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < session_count; i++) {
+        replay_session_t *s = &sessions[i];
+        uint64_t end = 0;
+        int k;
+        for (k = 0; k < s->count; k++)
+            end += s->lines[k].record->gap;
+        if (s->count > 0)
+            end += s->lines[s->count - 1].record->duration;
+        if (end > span)
+            span = end;
+    }
+
+    replay_start = now();
+    for (i = 0; i < count; i++) {
+        replayer_t *rp = &replayers[i];
+        rp->session = &sessions[i % session_count];
+        if (!(socket_path ? connect_dsh(rp) : start_dsh(rp)) ||
+            pthread_create(&rp->thread, NULL, replay_session, rp) != 0) {
+            fprintf(stderr, "dsh-replay: cannot start session %d: %s\n", i + 1, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        replayer_t *rp = &replayers[i];
+        pthread_join(rp->thread, NULL);
+        if (rp->pid > 0 && (waitpid(rp->pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0))
+            rp->failed = true;
+        if (rp->failed)
+            failed++;
+        if (rp->lag > lag)
+            lag = rp->lag;
+        output += rp->output;
+    }
+
+    double elapsed = (now() - replay_start) / 1e9;
+    printf("replayed %d lines x %d in %d sessions in %.3fs (%.0f lines/s), recorded in %.3fs\n",
+           lines, copies, count, elapsed, lines * copies / elapsed, span / 1e9);
+    printf("worst lag %.3fms, %llu bytes of output, %d sessions failed\n",
+           lag / 1e6, (unsigned long long) output, failed);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,76 @@
+#include "dshring.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* dsh-ringcat: cat through the shared-memory rings of dsh (dshring.h),
+ * to measure them and to show how a filter uses them.
+ *
+ *     dsh-ringcat          copies its input to its output
+ *     dsh-ringcat BYTES    writes BYTES zero bytes (k, m or g) instead
+ *
+ * On a ring, the input is read in place and written out from there: one
+ * copy per stage.
+ */
+
+#define RINGCAT_BUF (256 << 10)
+
+static unsigned long long ringcat_size(const char *value) {
+    char *end;
+    unsigned long long bytes = strtoull(value, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': return bytes << 10;
+        case 'm': case 'M': return bytes << 20;
+        case 'g': case 'G': return bytes << 30;
+    }
+    return bytes;
+}
+
+int main(int argc, char **argv) {
+    static char buf[RINGCAT_BUF];
+    dshring_t *in, *out = dshring_open_out();
+    const void *data;
+    ssize_t n;
+
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [BYTES]\n", argv[0]);
+        return 2;
+    }
+    if (argc == 2) {
+        unsigned long long left = ringcat_size(argv[1]);
+        while (left > 0) {
+            size_t len = left < sizeof(buf) ? left : sizeof(buf);
+            if (dshring_write(out, buf, len) < 0)
+                goto failed;
+            left -= len;
+        }
+        dshring_close(out);
+        return 0;
+    }
+    in = dshring_open_in();
+    while (1) {
+        if ((n = dshring_peek(in, &data, sizeof(buf))) >= 0) {
+            if (n == 0)
+                break;
+            if (dshring_write(out, data, n) < 0)
+                goto failed;
+            dshring_consume(in, n);
+        }
+        else if ((n = dshring_read(in, buf, sizeof(buf))) > 0) {
+            if (dshring_write(out, buf, n) < 0)
+                goto failed;
+        }
+        else if (n == 0)
+            break;
+        else
+            goto failed;
+    }
+    dshring_close(in);
+    dshring_close(out);
+    return 0;
+failed:
+    if (errno != EPIPE)
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+    return 1;
+}
@@ -0,0 +1,250 @@
+#include "dsh.h"
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+/* Admission control of background jobs. A job started with & runs at once
+ * only while fewer than sched_max background jobs run (in all sessions)
+ * and the load average is below sched_load; otherwise it waits on the job
+ * list, marked queued, until sched_admit() starts it. Queued jobs start by
+ * priority, in the order they were queued for equal priorities.
+ *
+ * Every job has a class, fg for the jobs run in the foreground and bg or
+ * batch for the others, which gives the nice value and the I/O priority
+ * its processes get, and the priority it is queued with. "sched class"
+ * picks the class of the background jobs started from then on. By default
+ * bg jobs run at nice 5 and best-effort I/O level 5, below the foreground
+ * job, and batch jobs lower still.
+ */
+
+#define SCHED_TICK 100      /* ms between admission checks at an idle prompt */
+
+#define IOPRIO_CLASS_SHIFT 13
+enum { IO_NONE, IO_RT, IO_BE, IO_IDLE };   /* the kernel's IOPRIO_CLASS_* */
+
+typedef struct sched_class {
+    const char *name;
+    int nice;
+    int io, io_level;       /* I/O scheduling class and level (0 highest, 7 lowest) */
+    int priority;           /* in the queue; higher starts first */
+} sched_class_t;
+
+static sched_class_t classes[SCHED_CLASSES] = {
+    { "fg",    0,  IO_NONE, 4, 20 },
+    { "bg",    5,  IO_BE,   5, 10 },
+    { "batch", 10, IO_BE,   7, 0 },
+};
+static const char *io_names[] = { "none", "rt", "be", "idle" };
+
+int sched_max = 0;              /* 0: no limit */
+double sched_load = 0;          /* 0: the load is not checked */
+int sched_bg_class = SCHED_BG;  /* class of the jobs started with & */
+static int sched_running;       /* background jobs running, in all sessions */
+
+/* Sets the class of a job that is about to be spawned */
+void sched_classify(job_t *j, bool fg) {
+    j->sched_class = fg ? SCHED_FG : sched_bg_class;
+    j->priority = classes[j->sched_class].priority;
+}
+
+/* Gives the calling child the nice value and I/O priority of its class */
+void sched_apply(job_t *j) {
+    sched_class_t *c = &classes[j->sched_class];
+    if (c->nice != 0)
+        setpriority(PRIO_PROCESS, 0, c->nice);
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    if (c->io != IO_NONE)
+        syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0,
+                c->io << IOPRIO_CLASS_SHIFT | c->io_level);
+#endif
+}
+
+/* true when a background job may start now */
+static bool sched_room() {
+    double load;
+    if (sched_max > 0 && __atomic_load_n(&sched_running, __ATOMIC_RELAXED) >= sched_max)
+        return false;
+    if (sched_load > 0 && getloadavg(&load, 1) == 1 && load >= sched_load)
+        return false;
+    return true;
+}
+
+/* Counts a background job that was just launched */
+void sched_started(job_t *j) {
+    if (j->bg && j->pgid > 0 && !j->counted) {
+        j->counted = true;
+        __atomic_fetch_add(&sched_running, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Called for every process dsh reaps: frees the slot of a background job
+ * once all of its processes are done */
+void sched_reaped(job_t *j, process_t *p) {
+    if (j->counted && job_is_completed(j)) {
+        j->counted = false;
+        __atomic_fetch_sub(&sched_running, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Holds a background job that may not start yet; it is on the job list
+ * already. Returns true if it was queued. */
+bool sched_hold(job_t *j) {
+    if (sched_room() && !sched_queued())
+        return false;
+    j->queued = true;
+    logger(STDOUT_FILENO, "Job %s queued", j->commandinfo);
+    return true;
+}
+
+/* true when the session has queued jobs */
+bool sched_queued() {
+    job_t *j;
+    for (j = job_head; j; j = j->next)
+        if (j->queued)
+            return true;
+    return false;
+}
+
+/* Starts the queued jobs of the session there is room for, the highest
+ * priority first. With only the load average to go by, one at a time: it
+ * takes a while to show the load of a job that just started. */
+void sched_admit() {
+    while (sched_room()) {
+        job_t *j, *best = NULL;
+        for (j = job_head; j; j = j->next)
+            if (j->queued && (best == NULL || j->priority > best->priority))
+                best = j;
+        if (best == NULL)
+            return;
+        best->queued = false;
+        start_job(best, false);
+        if (sched_load > 0)
+            return;
+    }
+}
+
+/* Waits until there is a line to read from the terminal fd, starting
+ * queued jobs as others finish. A terminal gives a line per read(), so
+ * stdio holds no line ahead once the last one was read; input that is not
+ * a terminal is queued by readahead.c, which starts them itself. */
+void sched_wait_input(int tty) {
+    struct pollfd fd = { tty, POLLIN, 0 };
+    while (sched_queued()) {
+        int ready = poll(&fd, 1, SCHED_TICK);
+        if (ready > 0 || (ready < 0 && errno != EINTR))
+            return;
+        reap_children();
+        sched_admit();
+    }
+}
+
+/* Starts every queued job of the session, waiting for room */
+void sched_drain() {
+    while (sched_queued()) {
+        reap_children();
+        sched_admit();
+        if (sched_queued())
+            poll(NULL, 0, SCHED_TICK);
+    }
+}
+
+/* Frees the queued jobs of a session that ends */
+void sched_drop() {
+    job_t *j = job_head, **link = &job_head;
+    while ((j = *link) != NULL) {
+        if (j->queued) {
+            *link = j->next;
+            free_job(j);
+        } else
+            link = &j->next;
+    }
+}
+
+static int sched_find_class(const char *name) {
+    int i;
+    for (i = 0; i < SCHED_CLASSES; i++)
+        if (!strcmp(name, classes[i].name))
+            return i;
+    return -1;
+}
+
+/* Renices the running jobs of the session that are in class c */
+static void sched_renice(int c) {
+    job_t *j;
+    for (j = job_head; j; j = j->next)
+        if (j->sched_class == c && j->pgid > 0 && !job_is_completed(j))
+            setpriority(PRIO_PGRP, j->pgid, classes[c].nice);
+}
+
+static void sched_show(FILE *out) {
+    job_t *j;
+    int i, pos = 1;
+    fprintf(out, "background jobs: %d running, at most %d%s", sched_running, sched_max,
+            sched_max == 0 ? " (no limit)" : "");
+    if (sched_load > 0)
+        fprintf(out, ", none started above load %.2f", sched_load);
+    fprintf(out, "; new ones are %s\n", classes[sched_bg_class].name);
+    for (i = 0; i < SCHED_CLASSES; i++)
+        fprintf(out, "class %-6s nice %3d  io %-4s %d  priority %d\n", classes[i].name,
+                classes[i].nice, io_names[classes[i].io], classes[i].io_level, classes[i].priority);
+    for (j = job_head; j; j = j->next, pos++)
+        if (j->queued)
+            fprintf(out, "[%d] queued, priority %d: %s\n", pos, j->priority, j->commandinfo);
+}
+
+/* The sched builtin:
+ *     sched                        shows the limits, the classes and the queue
+ *     sched max N                  at most N background jobs at once, 0 for no limit
+ *     sched load L                 none started while the load average is above L, 0 for off
+ *     sched class C                class of the background jobs started from now on
+ *     sched nice C N               nice value of class C
+ *     sched io C none|be|idle [L]  I/O scheduling class and level of class C
+ *     sched prio C P               queue priority of the jobs of class C
+ *     sched job N P                queue priority of job N */
+void sched_cmd(int argc, char **argv) {
+    FILE *out = current_session ? current_session->out : stdout;
+    int c = argc > 2 ? sched_find_class(argv[2]) : -1;
+    job_t *j;
+
+    if (argc == 1) {
+        sched_show(out);
+        fflush(out);
+    }
+    else if (argc == 3 && !strcmp(argv[1], "max") && atoi(argv[2]) >= 0) {
+        sched_max = atoi(argv[2]);
+        sched_admit();
+    }
+    else if (argc == 3 && !strcmp(argv[1], "load") && atof(argv[2]) >= 0) {
+        sched_load = atof(argv[2]);
+        sched_admit();
+    }
+    else if (argc == 3 && !strcmp(argv[1], "class") && c > SCHED_FG)
+        sched_bg_class = c;
+    else if (argc == 4 && !strcmp(argv[1], "nice") && c >= 0) {
+        classes[c].nice = atoi(argv[3]);
+        sched_renice(c);
+    }
+    else if ((argc == 4 || argc == 5) && !strcmp(argv[1], "io") && c >= 0) {
+        int io;
+        for (io = IO_NONE; io <= IO_IDLE; io++)
+            if (!strcmp(argv[3], io_names[io]) && io != IO_RT)
+                break;
+        if (io > IO_IDLE) {
+            logger(STDERR_FILENO, "Error: the I/O class is none, be or idle");
+            return;
+        }
+        classes[c].io = io;
+        if (argc == 5 && atoi(argv[4]) >= 0 && atoi(argv[4]) <= 7)
+            classes[c].io_level = atoi(argv[4]);
+    }
+    else if (argc == 4 && !strcmp(argv[1], "prio") && c >= 0)
+        classes[c].priority = atoi(argv[3]);
+    else if (argc == 4 && !strcmp(argv[1], "job")) {
+        if (!(j = search_job_pos(atoi(argv[2]))) || !j->queued)
+            logger(STDERR_FILENO, "Error: job %s is not queued", argv[2]);
+        else
+            j->priority = atoi(argv[3]);
+    }
+    else
+        logger(STDERR_FILENO, "Error: usage: sched [max N | load L | class C | nice C N | io C none|be|idle [L] | prio C P | job N P]");
+}
@@ -0,0 +1,179 @@
+#include "dsh.h"
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Server mode: one resident dsh serves many clients over a Unix socket.
+ *
+ * The main thread accepts connections and queues them; a fixed pool of
+ * threads takes them off the queue and serves each as a session until the
+ * client closes its end or sends quit. A session reads command lines from
+ * the connection and runs them with run_jobs(), the same code as the batch
+ * mode, with its own job list (job_head is thread local), its own directory
+ * and the connection as the stdout of its jobs. The shell's own messages,
+ * like (Completed) and the log lines, go to the server's stdout. The lines
+ * are read and parsed ahead (readahead.c), as the batch mode does, so that
+ * queued jobs start while the client is idle. */
+
+#define SERVER_THREADS 8      /* default size of the pool */
+#define SERVER_QUEUE   256    /* accepted connections waiting for a thread */
+
+static struct {
+    int fds[SERVER_QUEUE];
+    int head, count;
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty, nonfull;
+} pending = { .lock = PTHREAD_MUTEX_INITIALIZER,
+              .nonempty = PTHREAD_COND_INITIALIZER,
+              .nonfull = PTHREAD_COND_INITIALIZER };
+
+static int session_count;   /* ids of the sessions; under pending.lock */
+
+/* Hangs up the jobs still running when the session ends, as a login shell
+ * does, and waits for them */
+static void end_session_jobs() {
+    job_t *j;
+    process_t *p;
+    int status;
+
+    sched_drop();
+    for (j = job_head; j; j = j->next) {
+        if (job_is_completed(j) || j->pgid <= 0)
+            continue;
+        kill(-j->pgid, SIGHUP);
+        kill(-j->pgid, SIGCONT);
+        for (p = j->first_process; p; p = p->next)
+            if (p->pid > 0 && !p->completed && wait_job(j, p->pid, &status, 0) == p->pid) {
+                p->status = status;
+                p->completed = true;
+                process_reaped(j, p);
+            }
+    }
+    remove_zombies();
+}
+
+static void serve_session(int fd, int id) {
+    readahead_t *ahead = NULL;
+    session_t session = { id, fd, NULL, -1, false };
+    FILE *in = fdopen(fd, "r");
+    int out = fd_dup(fd);
+
+    session.cwd = fd_open(".", O_RDONLY | O_DIRECTORY, 0);
+    if (in == NULL || out < 0 || session.cwd < 0 || !(session.out = fdopen(out, "w")) ||
+        !(ahead = readahead_start(in, false, true))) {
+        logger(STDERR_FILENO, "Could not set up session %d", id);
+        if (in) fclose(in); else close(fd);
+        if (session.out) fclose(session.out); else if (out >= 0) close(out);
+        if (session.cwd >= 0) close(session.cwd);
+        return;
+    }
+    current_session = &session;
+    job_head = NULL;
+    logger(STDOUT_FILENO, "Session started");
+
+    while (!session.quit) {
+        readahead_line_t line;
+        /* queued jobs start as others finish, also while the client is idle */
+        if (!readahead_next(ahead, &line, NULL))
+            break;
+        reap_children();
+        sched_admit();
+        record_read(line.text);
+        free(line.text);
+        if (line.jobs)
+            record_done(run_jobs(line.jobs));
+        fflush(session.out);
+    }
+    /* after quit, the reader may be blocked on the rest of the input */
+    shutdown(fd, SHUT_RD);
+    readahead_stop(ahead);
+
+    end_session_jobs();
+    logger(STDOUT_FILENO, "Session ended");
+    current_session = NULL;
+    fclose(session.out);
+    fclose(in);
+    close(session.cwd);
+}
+
+static void *session_thread(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&pending.lock);
+        while (pending.count == 0)
+            pthread_cond_wait(&pending.nonempty, &pending.lock);
+        int fd = pending.fds[pending.head];
+        pending.head = (pending.head + 1) % SERVER_QUEUE;
+        pending.count--;
+        int id = ++session_count;
+        pthread_cond_signal(&pending.nonfull);
+        pthread_mutex_unlock(&pending.lock);
+
+        serve_session(fd, id);
+    }
+    return NULL;
+}
+
+int serve(const char *path, int nthreads) {
+    struct sockaddr_un addr;
+    int i, listener, null;
+
+    if (nthreads <= 0)
+        nthreads = SERVER_THREADS;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "dsh: socket path too long: %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    /* jobs never read the server's stdin, and nothing is a terminal */
+    if ((null = open("/dev/null", O_RDONLY)) >= 0) {
+        dup2(null, STDIN_FILENO);
+        close(null);
+    }
+    dsh_is_interactive = 0;
+    /* a client that went away must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if ((listener = fd_socket(AF_UNIX, SOCK_STREAM)) < 0 ||
+        bind(listener, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(listener, SOMAXCONN) < 0) {
+        fprintf(stderr, "dsh: %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, session_thread, NULL) != 0) {
+            fprintf(stderr, "dsh: cannot start session threads\n");
+            return EXIT_FAILURE;
+        }
+        pthread_detach(thread);
+    }
+    printf("#Devil Shell is serving %s with %d threads\n", path, nthreads);
+    fflush(stdout);
+
+    while (1) {
+        int fd = fd_accept(listener);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                usleep(10000);  /* wait for sessions to end and free some */
+                continue;
+            }
+            fprintf(stderr, "dsh: accept: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        pthread_mutex_lock(&pending.lock);
+        while (pending.count == SERVER_QUEUE)
+            pthread_cond_wait(&pending.nonfull, &pending.lock);
+        pending.fds[(pending.head + pending.count) % SERVER_QUEUE] = fd;
+        pending.count++;
+        pthread_cond_signal(&pending.nonempty);
+        pthread_mutex_unlock(&pending.lock);
+    }
+}
@@ -0,0 +1,109 @@
+#include "dsh.h"
+#include "dshring.h"
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+/* Shared-memory rings between the stages of a pipeline, on with
+ * "shmpipe on [SIZE]" or DSH_SHMPIPE=SIZE: every pipe between two stages
+ * gets a ring of SIZE bytes (k, m or g; a power of 2) in a memfd, which the
+ * writer finds in DSH_RING_OUT and the reader in DSH_RING_IN. Stages built
+ * with dshring.c (dshring.h) then pass their data through it; the pipe
+ * stays for those that are not, so a pipeline mixes both freely. The memfd
+ * is sealed at its size, so that no stage can shrink it under the other.
+ */
+
+#define SHMPIPE_SIZE (4 << 20)
+
+static size_t shmpipe_size;         /* 0 when off */
+
+/* Parses a power of 2 with an optional k, m or g */
+static bool shmpipe_parse(const char *value, size_t *size) {
+    char *end;
+    unsigned long long amount = strtoull(value, &end, 10);
+    if (strlen(end) > 1 || (*end && !strchr("kKmMgG", *end)))
+        return false;
+    switch (*end) {
+        case 'k': case 'K': amount <<= 10; break;
+        case 'm': case 'M': amount <<= 20; break;
+        case 'g': case 'G': amount <<= 30; break;
+    }
+    if (amount < 4096 || (amount & (amount - 1)))
+        return false;
+    *size = amount;
+    return true;
+}
+
+bool shmpipe_on(const char *size) {
+#ifdef __linux__
+    size_t bytes = SHMPIPE_SIZE;
+    if (size && *size && !shmpipe_parse(size, &bytes))
+        return false;
+    shmpipe_size = bytes;
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* A ring for the pipe dsh is about to create between two stages, or -1 */
+int shmpipe_ring() {
+#ifdef __linux__
+    dshring_header_t header = { .magic = DSHRING_MAGIC };
+    int fd;
+
+    if (shmpipe_size == 0)
+        return -1;
+    if ((fd = memfd_create("dshring", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+        return -1;
+    header.size = shmpipe_size;
+    if (ftruncate(fd, DSHRING_HEADER + shmpipe_size) < 0 ||
+        pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+/* Called by a child with the rings of its stdin and its stdout, or -1 */
+void shmpipe_child(int in, int out) {
+    char fd[16];
+    if (in >= 0) {
+        snprintf(fd, sizeof(fd), "%d", in);
+        setenv("DSH_RING_IN", fd, 1);
+        fcntl(in, F_SETFD, 0);
+    }
+    if (out >= 0) {
+        snprintf(fd, sizeof(fd), "%d", out);
+        setenv("DSH_RING_OUT", fd, 1);
+        fcntl(out, F_SETFD, 0);
+    }
+}
+
+/* The shmpipe builtin:
+ *     shmpipe                  shows whether pipelines get rings
+ *     shmpipe on [SIZE]        rings of SIZE bytes for the pipelines started from now on
+ *     shmpipe off              pipes only */
+void shmpipe_cmd(int argc, char **argv) {
+    FILE *out = current_session ? current_session->out : stdout;
+
+    if (argc == 1) {
+        if (shmpipe_size)
+            fprintf(out, "shared-memory rings of %zu bytes between stages\n", shmpipe_size);
+        else
+            fprintf(out, "pipes only between stages\n");
+        fflush(out);
+    }
+    else if (argc <= 3 && !strcmp(argv[1], "on")) {
+        if (!shmpipe_on(argc == 3 ? argv[2] : NULL))
+            logger(STDERR_FILENO, "Error: shmpipe needs memfd_create() and a size that is a power of 2, 4k or more");
+    }
+    else if (argc == 2 && !strcmp(argv[1], "off"))
+        shmpipe_size = 0;
+    else
+        logger(STDERR_FILENO, "Error: usage: shmpipe [on [SIZE] | off]");
+}
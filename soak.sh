@@ -0,0 +1,195 @@
+#!/bin/sh
+# Soak and scale test of the job control of dsh: one dsh in batch mode is
+# fed through a fifo, and the times are taken by /bin/date markers it runs,
+# so they are dsh's own.
+#
+# Scale: JOBS/8, JOBS/4, JOBS/2 and JOBS concurrent "sleep &" jobs are
+# started, listed with jobs, killed all at once and reaped with wait; the
+# time per job of each step is printed, in us. Linear work keeps the time
+# per job flat as the count grows 8 times, so at JOBS it must stay within
+# SLACK times the time per job at JOBS/8, plus NOISE us for the whole step:
+# a cost per job that grows with the count, however slowly, fails.
+#
+# Soak: for SECONDS, rounds of JOBS/4 "true &" jobs started under a storm of
+# SIGCHLD and SIGCONT to dsh and reaped with wait, then STOPS "sleep &" jobs
+# stopped and continued over and over from outside, continued with bg and
+# fg and waited for, then jobs. Each round prints the launch time per job
+# (us), the reaping time (ms), the stop and continue time (ms), the time of
+# jobs (us), and the fds and RSS (kB) of dsh. Every round does the same
+# work, so the means of the last quarter of the rounds must stay within
+# SLACK times those of the first quarter, plus NOISE us for the times, and
+# the fds within 4 of them.
+#
+#     sh soak.sh [SECONDS [JOBS]]     (make soak; SECONDS=14400 for hours)
+#
+# Exits with 1 if a measure grew too much, and says which.
+#
+#     SLACK=1.2 NOISE=500 sh soak.sh 600 4000     stricter, and longer
+
+DURATION=${1:-60}
+JOBS=${2:-1000}
+STOPS=${STOPS:-16}
+SLACK=${SLACK:-1.5}
+NOISE=${NOISE:-2000}
+DSH=${DSH:-$(pwd)/dsh}
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/soak.XXXXXX")
+OUT=$DIR/out
+failed=0
+
+mkfifo "$DIR/in"
+: > "$OUT"
+# in its own directory, for its dsh.log
+(cd "$DIR" && exec "$DSH" < in >> out 2>&1) &
+pid=$!
+exec 3> "$DIR/in"
+
+cleanup() {
+    exec 3>&-
+    pkill -KILL -P "$pid" 2>/dev/null
+    kill "$pid" 2>/dev/null
+    rm -rf "$DIR"
+}
+trap 'cleanup; exit 2' INT TERM
+
+# Has dsh print the time when it gets to this line and prints it; the
+# output is emptied first, dsh appends to it
+mark=0
+mark() {
+    mark=$((mark + 1))
+    echo "/bin/date +@$mark:%s%N" >&3
+    until t=$(grep -aom1 "@$mark:[0-9][0-9]*" "$OUT"); do
+        kill -0 "$pid" 2>/dev/null || { echo "dsh died" >&2; cleanup; exit 1; }
+        sleep 0.01
+    done
+    : > "$OUT"
+    echo "${t#*:}"
+}
+
+jobs_of() {     # the pids of the children of dsh that run $1
+    pgrep -P "$pid" -x "$1"
+}
+
+fds() {
+    ls "/proc/$pid/fd" | wc -l
+}
+
+rss() {
+    awk '/^VmRSS/ { print $2 }' "/proc/$pid/status"
+}
+
+# Fails if $2 is more than SLACK times $1 plus $3, all in the same unit
+check() {
+    if awk -v a="$1" -v b="$2" -v s="$SLACK" -v n="$3" 'BEGIN { exit !(b > a * s + n) }'; then
+        echo "FAIL: $4 grew from $1 to $2"
+        failed=1
+    fi
+}
+
+echo "scale: per job, us"
+printf '%6s %10s %10s %10s\n' jobs launch jobs reap
+first=
+for n in $((JOBS / 8)) $((JOBS / 4)) $((JOBS / 2)) $JOBS; do
+    a=$(mark)
+    i=0
+    while [ $i -lt "$n" ]; do
+        echo "sleep 600 &" >&3
+        i=$((i + 1))
+    done
+    b=$(mark)
+    echo "jobs" >&3
+    c=$(mark)
+    kill $(jobs_of sleep) 2>/dev/null
+    echo "wait" >&3
+    d=$(mark)
+    echo "jobs" >&3
+    mark > /dev/null
+    # per job, in ns to keep the small ones
+    launch=$(((b - a) / n))
+    list=$(((c - b) / n))
+    reap=$(((d - c) / n))
+    printf '%6d %10d %10d %10d\n' "$n" $((launch / 1000)) $((list / 1000)) $((reap / 1000))
+    if [ -z "$first" ]; then
+        first="$launch $list $reap"
+    fi
+done
+# NOISE us over the n jobs of the largest step, per job in ns
+noise=$((NOISE * 1000 / n))
+set -- $first
+check "$1" "$launch" "$noise" "launch time per job (ns) at scale"
+check "$2" "$list" "$noise" "jobs time per job (ns) at scale"
+check "$3" "$reap" "$noise" "reaping time per job (ns) at scale"
+
+echo "soak: $((JOBS / 4)) jobs a round for $DURATION s"
+printf '%6s %6s %10s %10s %10s %10s %6s %8s\n' round s launch_us reap_ms stop_ms jobs_us fds rss_kb
+: > "$DIR/rounds"
+start=$(date +%s)
+round=0
+while [ $(($(date +%s) - start)) -lt "$DURATION" ]; do
+    round=$((round + 1))
+    n=$((JOBS / 4))
+    (i=0; while [ $i -lt 2000 ]; do kill -CHLD "$pid"; kill -CONT "$pid"; i=$((i + 1)); done) 2>/dev/null &
+    storm=$!
+    a=$(mark)
+    i=0
+    while [ $i -lt "$n" ]; do
+        echo "/bin/true &" >&3
+        i=$((i + 1))
+    done
+    b=$(mark)
+    echo "wait" >&3
+    c=$(mark)
+    wait $storm
+
+    # stopped and continued from outside, then by bg and fg; jobs empties
+    # the job list first, so that they are jobs 1 to STOPS
+    echo "jobs" >&3
+    i=0
+    while [ $i -lt "$STOPS" ]; do
+        echo "sleep 1 &" >&3
+        i=$((i + 1))
+    done
+    s=$(mark)
+    for p in $(jobs_of sleep); do
+        i=0
+        while [ $i -lt 10 ]; do
+            kill -STOP "$p"
+            kill -CONT "$p"
+            i=$((i + 1))
+        done
+        kill -STOP "$p"
+    done 2>/dev/null
+    i=1
+    while [ $i -lt "$STOPS" ]; do
+        echo "bg $i" >&3
+        i=$((i + 1))
+    done
+    echo "fg $STOPS" >&3
+    echo "wait" >&3
+    e=$(mark)
+    echo "jobs" >&3
+    f=$(mark)
+    elapsed=$(($(date +%s) - start))
+    line="$round $elapsed $(((b - a) / n / 1000)) $(((c - b) / 1000000)) $(((e - s) / 1000000)) $(((f - e) / 1000)) $(fds) $(rss)"
+    echo "$line" >> "$DIR/rounds"
+    printf '%6d %6d %10d %10d %10d %10d %6d %8d\n' $line
+done
+
+# the first and the last quarter of the rounds, as means
+set -- $(awk -v rounds="$round" '
+    { q = rounds >= 4 ? int(rounds / 4) : 1 }
+    NR <= q { for (i = 3; i <= 8; i++) early[i] += $i; ne++ }
+    NR > rounds - q { for (i = 3; i <= 8; i++) late[i] += $i; nl++ }
+    END { for (i = 3; i <= 8; i++) printf "%d %d ", early[i] / ne, late[i] / nl }' "$DIR/rounds")
+check "$1" "$2" $((NOISE / n)) "launch time per job (us)"
+check "$3" "$4" $((NOISE / 1000)) "reaping time (ms)"
+check "$5" "$6" $((NOISE / 1000)) "stop and continue time (ms)"
+check "$7" "$8" "$NOISE" "jobs time (us)"
+if [ "${10}" -gt $(($9 + 4)) ]; then
+    echo "FAIL: fds grew from $9 to ${10}"
+    failed=1
+fi
+check "${11}" "${12}" 0 "RSS (kB)"
+
+cleanup
+[ $failed = 0 ] && echo "ok: $round rounds"
+exit $failed
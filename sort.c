@@ -0,0 +1,868 @@
+#include "dsh.h"
+#include <ctype.h>
+#include <locale.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Builtin sort. Like wc it runs in the forked child of its pipeline stage.
+ * Input is read into a chunk buffer bounded by the memory cap (-S, or
+ * DSH_SORT_MEMORY, 256M by default). A full chunk is sorted by several
+ * threads, each sorting a slice that is then merged pairwise, and spilled to
+ * an unlinked temporary file. At the end the runs are k-way merged into
+ * stdout; when everything fit in memory nothing touches the disk.
+ *
+ * Supported: -n -r -u -b -t SEP -k POS1[,POS2] -o FILE -S SIZE -T DIR
+ * --parallel=N. Keys accept the b, n and r modifiers. Anything else falls
+ * back to the real sort.
+ */
+
+#define SORT_DEFAULT_MEMORY (256UL << 20)
+#define SORT_MIN_MEMORY     (64UL << 10)
+#define SORT_MAX_THREADS    8
+#define SORT_MAX_KEYS       10
+#define SORT_MAX_MERGE      32  /* runs merged at once */
+
+typedef struct line {
+    char *text;         /* always followed by a newline, not counted in len */
+    size_t len;
+    uint64_t prefix;    /* first 8 bytes, big endian, zero padded */
+} line_t;
+
+typedef struct sort_key {
+    size_t sword, schar;    /* start field and character, 0 based */
+    size_t eword, echar;    /* end field and character; eword SIZE_MAX: end of line */
+    bool skipsblanks, skipeblanks;
+    bool numeric, reverse;
+} sort_key_t;
+
+/* options shared by every comparison; set once before any thread starts */
+static struct {
+    sort_key_t keys[SORT_MAX_KEYS];
+    int nkeys;
+    int tab;            /* field separator, or -1 for blank transitions */
+    bool reverse;       /* global -r, also applies to the last resort compare */
+    bool unique;
+    bool collate;       /* the locale does not sort by bytes: use strcoll */
+    bool whole_line;    /* the only key is the whole line, compared as text */
+} sort_opts;
+
+typedef struct chunk {
+    char *buf;
+    size_t used, size;
+    line_t *lines;
+    size_t nlines, maxlines;
+} chunk_t;
+
+typedef struct runs {
+    FILE **files;
+    int count, size;
+    const char *tmpdir;
+} runs_t;
+
+/* Compares two byte strings according to the locale */
+static int sort_textcompare(const char *a, size_t alen, const char *b, size_t blen)
+{
+    if (sort_opts.collate) {
+        char abuf[256], bbuf[256];
+        char *acopy = alen < sizeof(abuf) ? abuf : malloc(alen + 1);
+        char *bcopy = blen < sizeof(bbuf) ? bbuf : malloc(blen + 1);
+        int diff = 0;
+        if (acopy && bcopy) {
+            memcpy(acopy, a, alen);
+            acopy[alen] = '\0';
+            memcpy(bcopy, b, blen);
+            bcopy[blen] = '\0';
+            diff = strcoll(acopy, bcopy);
+        }
+        if (acopy != abuf) free(acopy);
+        if (bcopy != bbuf) free(bcopy);
+        if (diff)
+            return diff;
+    }
+    int diff = memcmp(a, b, alen < blen ? alen : blen);
+    if (diff)
+        return diff;
+    return alen < blen ? -1 : alen > blen;
+}
+
+/* Parses the leading number of [p, end): blanks, optional minus, digits and
+ * an optional fraction. Text without a number is zero */
+static void sort_parsenum(const char *p, const char *end, bool *neg, const char **ip, size_t *ilen,
+                          const char **fp, size_t *flen)
+{
+    while (p < end && isblank((unsigned char) *p)) p++;
+    *neg = p < end && *p == '-';
+    if (*neg) p++;
+    while (p < end && *p == '0') p++;
+    *ip = p;
+    while (p < end && isdigit((unsigned char) *p)) p++;
+    *ilen = p - *ip;
+    *fp = p;
+    *flen = 0;
+    if (p < end && *p == '.') {
+        *fp = ++p;
+        while (p < end && isdigit((unsigned char) *p)) p++;
+        *flen = p - *fp;
+        while (*flen > 0 && (*fp)[*flen - 1] == '0') (*flen)--;
+    }
+    if (*ilen == 0 && *flen == 0)
+        *neg = false;   /* -0 is 0 */
+}
+
+static int sort_numcompare(const char *a, const char *aend, const char *b, const char *bend)
+{
+    bool aneg, bneg;
+    const char *ai, *af, *bi, *bf;
+    size_t ailen, aflen, bilen, bflen, i;
+    int diff = 0;
+
+    sort_parsenum(a, aend, &aneg, &ai, &ailen, &af, &aflen);
+    sort_parsenum(b, bend, &bneg, &bi, &bilen, &bf, &bflen);
+    if (aneg != bneg)
+        return aneg ? -1 : 1;
+    if (ailen != bilen)
+        diff = ailen < bilen ? -1 : 1;
+    else if ((diff = memcmp(ai, bi, ailen)) == 0) {
+        for (i = 0; i < aflen && i < bflen && !diff; i++)
+            diff = af[i] - bf[i];
+        if (!diff && aflen != bflen)
+            diff = aflen < bflen ? -1 : 1;
+    }
+    return aneg ? -diff : diff;
+}
+
+/* Start of the key in the line, as in POSIX sort */
+static const char *sort_begfield(const line_t *l, const sort_key_t *key)
+{
+    const char *ptr = l->text, *lim = l->text + l->len;
+    size_t sword = key->sword;
+
+    if (sort_opts.tab >= 0)
+        while (ptr < lim && sword--) {
+            while (ptr < lim && *ptr != sort_opts.tab) ++ptr;
+            if (ptr < lim) ++ptr;
+        }
+    else
+        while (ptr < lim && sword--) {
+            while (ptr < lim && isblank((unsigned char) *ptr)) ++ptr;
+            while (ptr < lim && !isblank((unsigned char) *ptr)) ++ptr;
+        }
+    if (key->skipsblanks)
+        while (ptr < lim && isblank((unsigned char) *ptr)) ++ptr;
+    return ptr + key->schar < lim ? ptr + key->schar : lim;
+}
+
+/* End of the key in the line */
+static const char *sort_limfield(const line_t *l, const sort_key_t *key)
+{
+    const char *ptr = l->text, *lim = l->text + l->len;
+    size_t eword = key->eword, echar = key->echar;
+
+    if (eword == SIZE_MAX)
+        return lim;
+    if (echar == 0)
+        eword++;    /* the whole end field */
+    if (sort_opts.tab >= 0)
+        while (ptr < lim && eword--) {
+            while (ptr < lim && *ptr != sort_opts.tab) ++ptr;
+            if (ptr < lim && (eword || echar)) ++ptr;
+        }
+    else
+        while (ptr < lim && eword--) {
+            while (ptr < lim && isblank((unsigned char) *ptr)) ++ptr;
+            while (ptr < lim && !isblank((unsigned char) *ptr)) ++ptr;
+        }
+    if (echar != 0) {
+        if (key->skipeblanks)
+            while (ptr < lim && isblank((unsigned char) *ptr)) ++ptr;
+        ptr = ptr + echar < lim ? ptr + echar : lim;
+    }
+    return ptr;
+}
+
+static void sort_set_line(line_t *l, char *text, size_t len)
+{
+    size_t i;
+    l->text = text;
+    l->len = len;
+    l->prefix = 0;
+    for (i = 0; i < 8; i++)
+        l->prefix = (l->prefix << 8) | (i < len ? (unsigned char) text[i] : 0);
+}
+
+/* Compares the keys only; equal keys are duplicates for -u */
+static int sort_keycompare(const line_t *a, const line_t *b)
+{
+    int i, diff = 0;
+    for (i = 0; i < sort_opts.nkeys && !diff; i++) {
+        const sort_key_t *key = &sort_opts.keys[i];
+        const char *abeg = sort_begfield(a, key), *aend = sort_limfield(a, key);
+        const char *bbeg = sort_begfield(b, key), *bend = sort_limfield(b, key);
+        if (aend < abeg) aend = abeg;
+        if (bend < bbeg) bend = bbeg;
+        if (key->numeric)
+            diff = sort_numcompare(abeg, aend, bbeg, bend);
+        else
+            diff = sort_textcompare(abeg, aend - abeg, bbeg, bend - bbeg);
+        if (key->reverse)
+            diff = -diff;
+    }
+    return diff;
+}
+
+/* Full comparison: the keys, then the whole line as a last resort */
+static int sort_compare(const line_t *a, const line_t *b)
+{
+    int diff;
+    if (sort_opts.whole_line) {
+        /* the prefixes order lines like memcmp unless they are equal */
+        if (!sort_opts.collate && a->prefix != b->prefix)
+            diff = a->prefix < b->prefix ? -1 : 1;
+        else
+            diff = sort_textcompare(a->text, a->len, b->text, b->len);
+        return sort_opts.reverse ? -diff : diff;
+    }
+    diff = sort_keycompare(a, b);
+    if (diff || sort_opts.unique)
+        return diff;
+    diff = sort_textcompare(a->text, a->len, b->text, b->len);
+    return sort_opts.reverse ? -diff : diff;
+}
+
+static int sort_qsort_compare(const void *a, const void *b)
+{
+    return sort_compare(a, b);
+}
+
+/* Stable merge sort of a[0..n) using tmp[0..n) as scratch space */
+static void sort_mergesort(line_t *a, line_t *tmp, size_t n)
+{
+    size_t i, j, k, half = n / 2;
+
+    if (n <= 16) {
+        for (i = 1; i < n; i++) {
+            line_t l = a[i];
+            for (j = i; j > 0 && sort_compare(&l, &a[j - 1]) < 0; j--)
+                a[j] = a[j - 1];
+            a[j] = l;
+        }
+        return;
+    }
+    sort_mergesort(a, tmp, half);
+    sort_mergesort(a + half, tmp + half, n - half);
+    if (sort_compare(&a[half], &a[half - 1]) >= 0)
+        return;     /* already in order */
+    memcpy(tmp, a, half * sizeof(line_t));
+    for (i = 0, j = half, k = 0; i < half && j < n; )
+        a[k++] = sort_compare(&a[j], &tmp[i]) < 0 ? a[j++] : tmp[i++];
+    while (i < half)
+        a[k++] = tmp[i++];
+}
+
+typedef struct sort_task {
+    line_t *src, *dst;
+    size_t begin, middle, end;
+} sort_task_t;
+
+static void *sort_slice(void *arg)
+{
+    sort_task_t *t = arg;
+    sort_mergesort(t->src + t->begin, t->dst + t->begin, t->end - t->begin);
+    return NULL;
+}
+
+/* Merges the sorted ranges [begin, middle) and [middle, end) of src into dst */
+static void *sort_merge(void *arg)
+{
+    sort_task_t *t = arg;
+    size_t i = t->begin, j = t->middle, k = t->begin;
+    while (i < t->middle && j < t->end)
+        t->dst[k++] = sort_compare(&t->src[j], &t->src[i]) < 0 ? t->src[j++] : t->src[i++];
+    while (i < t->middle) t->dst[k++] = t->src[i++];
+    while (j < t->end) t->dst[k++] = t->src[j++];
+    return NULL;
+}
+
+/* Sorts the lines with up to nthreads threads: every thread sorts a slice and
+ * the slices are merged pairwise, each round in parallel. Returns the array
+ * holding the result (lines or a scratch array owned by the caller) */
+static line_t *sort_parallel(line_t *lines, line_t *scratch, size_t n, int nthreads)
+{
+    pthread_t threads[SORT_MAX_THREADS];
+    sort_task_t tasks[SORT_MAX_THREADS];
+    size_t bounds[SORT_MAX_THREADS + 1];
+    int i, slices = nthreads;
+
+    if (scratch == NULL) {
+        /* no memory for the merge passes: fall back to the C library */
+        qsort(lines, n, sizeof(line_t), sort_qsort_compare);
+        return lines;
+    }
+    if (n < 4096)
+        slices = 1;
+    for (i = 0; i <= slices; i++)
+        bounds[i] = n * i / slices;
+    for (i = 0; i < slices; i++) {
+        tasks[i].src = lines;
+        tasks[i].dst = scratch;
+        tasks[i].begin = bounds[i];
+        tasks[i].end = bounds[i + 1];
+        if (i == slices - 1 || pthread_create(&threads[i], NULL, sort_slice, &tasks[i]) != 0) {
+            sort_slice(&tasks[i]);
+            threads[i] = 0;
+        }
+    }
+    for (i = 0; i < slices; i++)
+        if (threads[i])
+            pthread_join(threads[i], NULL);
+
+    line_t *src = lines, *dst = scratch;
+    while (slices > 1) {
+        int pairs = 0;
+        for (i = 0; i < slices; i += 2) {
+            sort_task_t *t = &tasks[pairs];
+            t->src = src;
+            t->dst = dst;
+            t->begin = bounds[i];
+            t->middle = bounds[i + 1];
+            t->end = i + 1 < slices ? bounds[i + 2] : bounds[i + 1];
+            if (pthread_create(&threads[pairs], NULL, sort_merge, t) != 0) {
+                sort_merge(t);
+                threads[pairs] = 0;
+            }
+            bounds[pairs++] = t->begin;
+        }
+        bounds[pairs] = n;
+        for (i = 0; i < pairs; i++)
+            if (threads[i])
+                pthread_join(threads[i], NULL);
+        slices = pairs;
+        line_t *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    return src;
+}
+
+/* Parses a size as -S does: a number with an optional b, K, M, G, T or %
+ * suffix, KiB by default. Returns 0 when it is not valid */
+static size_t sort_parsesize(const char *s)
+{
+    char *end;
+    unsigned long long value = strtoull(s, &end, 10);
+    if (end == s)
+        return 0;
+    switch (*end) {
+        case 'b': break;
+        case '\0':
+        case 'k': case 'K': value <<= 10; break;
+        case 'm': case 'M': value <<= 20; break;
+        case 'g': case 'G': value <<= 30; break;
+        case 't': case 'T': value <<= 40; break;
+        case '%': value = (unsigned long long) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 100 * value; break;
+        default: return 0;
+    }
+    if (*end != '\0' && end[1] != '\0')
+        return 0;
+    return value;
+}
+
+static bool sort_write_line(FILE *out, const char *text, size_t len)
+{
+    return fwrite(text, 1, len + 1, out) == len + 1;
+}
+
+/* Writes the sorted lines, dropping duplicates for -u */
+static bool sort_write_lines(FILE *out, line_t *lines, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (sort_opts.unique && i > 0 && sort_keycompare(&lines[i - 1], &lines[i]) == 0)
+            continue;
+        if (!sort_write_line(out, lines[i].text, lines[i].len))
+            return false;
+    }
+    return true;
+}
+
+/* Creates an unlinked temporary file for a run */
+static FILE *sort_tmpfile(runs_t *runs)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/dshsortXXXXXX", runs->tmpdir);
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return NULL;
+    unlink(path);
+    FILE *file = fdopen(fd, "w+");
+    if (file == NULL)
+        close(fd);
+    return file;
+}
+
+static bool sort_add_run(runs_t *runs, FILE *file)
+{
+    if (runs->count == runs->size) {
+        int size = runs->size ? runs->size * 2 : 16;
+        FILE **files = realloc(runs->files, size * sizeof(FILE *));
+        if (files == NULL)
+            return false;
+        runs->files = files;
+        runs->size = size;
+    }
+    runs->files[runs->count++] = file;
+    return true;
+}
+
+/* Sorts the lines of the chunk and spills them to a new run */
+static bool sort_spill(chunk_t *c, runs_t *runs, int nthreads)
+{
+    line_t *scratch = malloc(c->nlines * sizeof(line_t));
+    line_t *sorted = sort_parallel(c->lines, scratch, c->nlines, nthreads);
+    FILE *file = sort_tmpfile(runs);
+    bool ok = file != NULL && sort_write_lines(file, sorted, c->nlines) && fflush(file) == 0
+              && sort_add_run(runs, file);
+    free(scratch);
+    if (!ok) {
+        fprintf(stderr, "sort: cannot write temporary file in %s: %s\n", runs->tmpdir, strerror(errno));
+        if (file)
+            fclose(file);
+    }
+    return ok;
+}
+
+typedef struct run_reader {
+    FILE *file;
+    line_t line;
+    char *buf;
+    size_t size;
+    int index;
+} run_reader_t;
+
+static bool sort_next(run_reader_t *r)
+{
+    ssize_t len = getline(&r->buf, &r->size, r->file);
+    if (len <= 0)
+        return false;
+    if (r->buf[len - 1] == '\n')
+        len--;
+    else
+        r->buf[len] = '\n';    /* getline left room for its NUL */
+    sort_set_line(&r->line, r->buf, len);
+    return true;
+}
+
+/* Orders the readers of the merge heap; earlier runs win ties */
+static bool sort_heap_less(run_reader_t *a, run_reader_t *b)
+{
+    int diff = sort_compare(&a->line, &b->line);
+    return diff < 0 || (diff == 0 && a->index < b->index);
+}
+
+static void sort_sift_down(run_reader_t **heap, int n, int i)
+{
+    while (1) {
+        int smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < n && sort_heap_less(heap[l], heap[smallest])) smallest = l;
+        if (r < n && sort_heap_less(heap[r], heap[smallest])) smallest = r;
+        if (smallest == i)
+            return;
+        run_reader_t *swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+/* k-way merges runs [first, first + n) into out */
+static bool sort_merge_runs(FILE **files, int n, FILE *out)
+{
+    run_reader_t *readers = calloc(n, sizeof(run_reader_t));
+    run_reader_t **heap = calloc(n, sizeof(run_reader_t *));
+    char *last = NULL;
+    size_t last_size = 0;
+    line_t last_line = { NULL, 0 };
+    bool ok = readers && heap, have_last = false;
+    int i, count = 0;
+
+    for (i = 0; ok && i < n; i++) {
+        readers[i].file = files[i];
+        readers[i].index = i;
+        rewind(files[i]);
+        if (sort_next(&readers[i]))
+            heap[count++] = &readers[i];
+    }
+    for (i = count / 2 - 1; i >= 0; i--)
+        sort_sift_down(heap, count, i);
+
+    while (ok && count > 0) {
+        run_reader_t *top = heap[0];
+        if (!sort_opts.unique || !have_last || sort_keycompare(&last_line, &top->line) != 0) {
+            ok = sort_write_line(out, top->line.text, top->line.len);
+            if (sort_opts.unique) {
+                if (last_size < top->line.len + 1) {
+                    last_size = top->line.len + 1;
+                    free(last);
+                    if (!(last = malloc(last_size))) {
+                        ok = false;
+                        break;
+                    }
+                }
+                memcpy(last, top->line.text, top->line.len + 1);
+                sort_set_line(&last_line, last, top->line.len);
+                have_last = true;
+            }
+        }
+        if (!sort_next(top))
+            heap[0] = heap[--count];
+        sort_sift_down(heap, count, 0);
+    }
+    if (readers)
+        for (i = 0; i < n; i++)
+            free(readers[i].buf);
+    free(readers);
+    free(heap);
+    free(last);
+    return ok;
+}
+
+/* Sorts and spills the indexed lines of the chunk, then moves the partial
+ * line that follows them to the front of the buffer */
+static bool sort_flush_chunk(chunk_t *c, runs_t *runs, int nthreads, size_t *start, size_t *scanned)
+{
+    if (!sort_spill(c, runs, nthreads))
+        return false;
+    memmove(c->buf, c->buf + *start, c->used - *start);
+    c->used -= *start;
+    *scanned -= *start;
+    *start = 0;
+    c->nlines = 0;
+    return true;
+}
+
+/* Reads fd into the chunk, spilling it whenever the text or the line table
+ * outgrows its share of the memory cap */
+static bool sort_read(int fd, chunk_t *c, runs_t *runs, size_t table_memory, int nthreads)
+{
+    line_t *last = c->nlines ? &c->lines[c->nlines - 1] : NULL;
+    size_t start = last ? (size_t) (last->text - c->buf) + last->len + 1 : 0;
+    size_t scanned = c->used;
+    ssize_t n;
+    char *nl;
+
+    while (1) {
+        /* index the complete lines that were not scanned yet */
+        while ((nl = memchr(c->buf + scanned, '\n', c->used - scanned)) != NULL) {
+            if (c->nlines == c->maxlines) {
+                if (c->maxlines * 2 * sizeof(line_t) > table_memory) {
+                    if (!sort_flush_chunk(c, runs, nthreads, &start, &scanned))
+                        return false;
+                    continue;
+                }
+                line_t *lines = realloc(c->lines, c->maxlines * 2 * sizeof(line_t));
+                if (lines == NULL)
+                    return false;
+                c->lines = lines;
+                c->maxlines *= 2;
+            }
+            sort_set_line(&c->lines[c->nlines++], c->buf + start, nl - (c->buf + start));
+            start = scanned = nl + 1 - c->buf;
+        }
+        scanned = c->used;
+
+        if (c->used == c->size) {
+            if (c->nlines > 0) {
+                if (!sort_flush_chunk(c, runs, nthreads, &start, &scanned))
+                    return false;
+            } else {
+                /* a single line longer than the buffer: make room for it */
+                char *bigger = realloc(c->buf, c->size * 2);
+                if (bigger == NULL)
+                    return false;
+                c->buf = bigger;
+                c->size *= 2;
+            }
+        }
+        n = read(fd, c->buf + c->used, c->size - c->used);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        if (n == 0)
+            return true;
+        c->used += n;
+    }
+}
+
+/* Terminates the last line of an input that does not end with a newline */
+static bool sort_finish_input(chunk_t *c)
+{
+    char *line = c->nlines ? c->lines[c->nlines - 1].text + c->lines[c->nlines - 1].len + 1 : c->buf;
+    if (line >= c->buf + c->used)
+        return true;
+    if (c->used == c->size) {
+        /* no room for the terminator: the lines move to a bigger buffer,
+         * rebased while the old one is still there */
+        size_t i;
+        char *bigger = malloc(c->size + 1);
+        if (bigger == NULL)
+            return false;
+        memcpy(bigger, c->buf, c->used);
+        for (i = 0; i < c->nlines; i++)
+            c->lines[i].text = bigger + (c->lines[i].text - c->buf);
+        line = bigger + (line - c->buf);
+        free(c->buf);
+        c->buf = bigger;
+        c->size++;
+    }
+    if (c->nlines == c->maxlines) {
+        line_t *lines = realloc(c->lines, (c->maxlines + 1) * sizeof(line_t));
+        if (lines == NULL)
+            return false;
+        c->lines = lines;
+        c->maxlines++;
+    }
+    c->buf[c->used] = '\n';
+    sort_set_line(&c->lines[c->nlines++], line, c->buf + c->used - line);
+    c->used++;
+    return true;
+}
+
+/* Parses a -k argument. Returns false when it uses features this sort does
+ * not have */
+static bool sort_parsekey(const char *s, sort_key_t *key, bool *has_options)
+{
+    char *end;
+    memset(key, 0, sizeof(*key));
+    key->eword = SIZE_MAX;
+    *has_options = false;
+
+    key->sword = strtoul(s, &end, 10);
+    if (end == s || key->sword == 0)
+        return false;
+    key->sword--;
+    if (*end == '.') {
+        s = end + 1;
+        key->schar = strtoul(s, &end, 10);
+        if (end == s || key->schar == 0)
+            return false;
+        key->schar--;
+    }
+    for (; *end && *end != ','; end++) {
+        if (*end == 'b') key->skipsblanks = true;
+        else if (*end == 'n') key->numeric = true;
+        else if (*end == 'r') key->reverse = true;
+        else return false;
+        *has_options = true;
+    }
+    if (*end == ',') {
+        s = end + 1;
+        key->eword = strtoul(s, &end, 10);
+        if (end == s || key->eword == 0)
+            return false;
+        key->eword--;
+        if (*end == '.') {
+            s = end + 1;
+            key->echar = strtoul(s, &end, 10);
+            if (end == s)
+                return false;
+        }
+        for (; *end; end++) {
+            if (*end == 'b') key->skipeblanks = true;
+            else if (*end == 'n') key->numeric = true;
+            else if (*end == 'r') key->reverse = true;
+            else return false;
+            *has_options = true;
+        }
+    }
+    return true;
+}
+
+/* Entry point of the sort stage builtin. Returns the exit status, or -1 to
+ * exec the real sort */
+int builtin_sort(int argc, char **argv)
+{
+    bool numeric = false, blanks = false, options_done = false;
+    bool key_options[SORT_MAX_KEYS];
+    char **files = calloc(argc + 1, sizeof(char *));
+    const char *output = NULL, *env;
+    size_t memory = SORT_DEFAULT_MEMORY;
+    int nfiles = 0, i, nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    runs_t runs = { NULL, 0, 0, NULL };
+
+    if (files == NULL)
+        return -1;
+    memset(&sort_opts, 0, sizeof(sort_opts));
+    sort_opts.tab = -1;
+    if ((env = getenv("DSH_SORT_MEMORY")) != NULL && sort_parsesize(env) > 0)
+        memory = sort_parsesize(env);
+    runs.tmpdir = (env = getenv("TMPDIR")) != NULL && *env ? env : "/tmp";
+
+    for (i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        if (options_done || arg[0] != '-' || arg[1] == '\0') {
+            files[nfiles++] = arg;
+            continue;
+        }
+        if (!strcmp(arg, "--")) {
+            options_done = true;
+            continue;
+        }
+        if (!strncmp(arg, "--parallel=", 11)) {
+            nthreads = atoi(arg + 11);
+            continue;
+        }
+        if (arg[1] == '-')
+            goto fallback;
+        char *opt;
+        for (opt = arg + 1; *opt; opt++) {
+            char *value;
+            switch (*opt) {
+                case 'n': numeric = true; break;
+                case 'r': sort_opts.reverse = true; break;
+                case 'u': sort_opts.unique = true; break;
+                case 'b': blanks = true; break;
+                case 'k': case 't': case 'o': case 'S': case 'T':
+                    /* the value is the rest of the argument or the next one */
+                    value = opt[1] ? opt + 1 : (i + 1 < argc ? argv[++i] : NULL);
+                    if (value == NULL)
+                        goto fallback;
+                    if (*opt == 'k') {
+                        if (sort_opts.nkeys == SORT_MAX_KEYS ||
+                            !sort_parsekey(value, &sort_opts.keys[sort_opts.nkeys], &key_options[sort_opts.nkeys]))
+                            goto fallback;
+                        sort_opts.nkeys++;
+                    }
+                    else if (*opt == 't') {
+                        if (value[0] == '\0' || value[1] != '\0')
+                            goto fallback;
+                        sort_opts.tab = (unsigned char) value[0];
+                    }
+                    else if (*opt == 'o')
+                        output = value;
+                    else if (*opt == 'S') {
+                        if ((memory = sort_parsesize(value)) == 0)
+                            goto fallback;
+                    }
+                    else
+                        runs.tmpdir = value;
+                    opt += strlen(opt) - 1;  /* the rest of the argument is used */
+                    break;
+                default:
+                    goto fallback;
+            }
+        }
+    }
+
+    /* keys without modifiers of their own inherit the global ones; no key
+     * at all means the whole line */
+    if (sort_opts.nkeys == 0) {
+        sort_opts.keys[0].eword = SIZE_MAX;
+        key_options[0] = false;
+        sort_opts.nkeys = 1;
+    }
+    for (i = 0; i < sort_opts.nkeys; i++)
+        if (!key_options[i]) {
+            sort_opts.keys[i].numeric = numeric;
+            sort_opts.keys[i].reverse = sort_opts.reverse;
+            sort_opts.keys[i].skipsblanks = sort_opts.keys[i].skipeblanks = blanks;
+        }
+    sort_opts.whole_line = sort_opts.nkeys == 1 && !key_options[0] && !numeric && !blanks
+                           && sort_opts.keys[0].sword == 0 && sort_opts.keys[0].schar == 0
+                           && sort_opts.keys[0].eword == SIZE_MAX;
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > SORT_MAX_THREADS)
+        nthreads = SORT_MAX_THREADS;
+    if (memory < SORT_MIN_MEMORY)
+        memory = SORT_MIN_MEMORY;
+
+    setlocale(LC_COLLATE, "");
+    const char *collation = setlocale(LC_COLLATE, NULL);
+    /* C.UTF-8 collates by code point, which for UTF-8 is the order of the bytes */
+    sort_opts.collate = collation && strcmp(collation, "C") && strcmp(collation, "POSIX") &&
+                        strcasecmp(collation, "C.UTF-8") && strcasecmp(collation, "C.utf8");
+
+    if (nfiles == 0)
+        files[nfiles++] = "-";
+
+    /* three quarters of the cap hold text, the rest the line table */
+    chunk_t chunk;
+    chunk.size = memory / 4 * 3;
+    chunk.used = 0;
+    chunk.maxlines = 1024;
+    chunk.nlines = 0;
+    chunk.buf = malloc(chunk.size);
+    chunk.lines = malloc(chunk.maxlines * sizeof(line_t));
+    if (chunk.buf == NULL || chunk.lines == NULL) {
+        fprintf(stderr, "sort: memory exhausted\n");
+        return 2;
+    }
+
+    int status = EXIT_SUCCESS;
+    for (i = 0; i < nfiles && status == EXIT_SUCCESS; i++) {
+        bool is_stdin = !strcmp(files[i], "-");
+        int fd = is_stdin ? STDIN_FILENO : open(files[i], O_RDONLY);
+        if (fd < 0 || !sort_read(fd, &chunk, &runs, memory / 4, nthreads) || !sort_finish_input(&chunk)) {
+            fprintf(stderr, "sort: %s: %s\n", is_stdin ? "-" : files[i], strerror(errno));
+            status = 2;
+        }
+        if (fd >= 0 && !is_stdin)
+            close(fd);
+    }
+
+    FILE *out = stdout;
+    if (status == EXIT_SUCCESS && output != NULL && (out = fopen(output, "w")) == NULL) {
+        fprintf(stderr, "sort: open failed: %s: %s\n", output, strerror(errno));
+        status = 2;
+    }
+    if (status == EXIT_SUCCESS) {
+        static char outbuf[1 << 16];
+        bool ok;
+        setvbuf(out, outbuf, _IOFBF, sizeof(outbuf));
+        if (runs.count == 0) {
+            line_t *scratch = malloc(chunk.nlines * sizeof(line_t));
+            line_t *sorted = sort_parallel(chunk.lines, scratch, chunk.nlines, nthreads);
+            ok = sort_write_lines(out, sorted, chunk.nlines);
+            free(scratch);
+        } else {
+            ok = chunk.nlines == 0 || sort_spill(&chunk, &runs, nthreads);
+            free(chunk.buf);
+            chunk.buf = NULL;
+            /* keep the number of runs merged at once bounded: merge them
+             * in groups, in input order so that -u keeps the first line */
+            while (ok && runs.count > SORT_MAX_MERGE) {
+                int group, merged = 0;
+                for (group = 0; ok && group < runs.count; group += SORT_MAX_MERGE) {
+                    int n = runs.count - group < SORT_MAX_MERGE ? runs.count - group : SORT_MAX_MERGE;
+                    FILE *file = sort_tmpfile(&runs);
+                    ok = file != NULL && sort_merge_runs(runs.files + group, n, file) && fflush(file) == 0;
+                    for (i = group; i < group + n; i++)
+                        fclose(runs.files[i]);
+                    if (file != NULL)
+                        runs.files[merged++] = file;
+                }
+                runs.count = merged;
+            }
+            ok = ok && sort_merge_runs(runs.files, runs.count, out);
+        }
+        if (!ok || fflush(out) != 0) {
+            fprintf(stderr, "sort: write failed: %s\n", strerror(errno));
+            status = 2;
+        }
+        if (out != stdout)
+            fclose(out);
+    }
+    for (i = 0; i < runs.count; i++)
+        fclose(runs.files[i]);
+    free(runs.files);
+    free(chunk.buf);
+    free(chunk.lines);
+    free(files);
+    return status;
+
+fallback:
+    free(files);
+    return -1;
+}
@@ -0,0 +1,455 @@
+#include "dsh.h"
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/mman.h>   /* memfd_create() */
+#endif
+
+/* Output spooling of background jobs. With spooling on, a job started with &
+ * writes its stdout and stderr to a pipe instead of the terminal. A single
+ * spooler thread reads the pipes of all the spooled jobs and keeps what
+ * they wrote: the latest spool_cap bytes in a ring in memory (a memfd), the
+ * older bytes in a file on disk, so nothing is lost and a chatty job costs a
+ * bounded amount of memory. The spool builtin shows, tails or attaches to
+ * the output of a job, and fg replays what was not shown yet, then copies
+ * the job's output to the terminal as it comes until the job stops again.
+ *
+ * Offsets are counted from the first byte the job wrote: the disk file
+ * holds [0, spilled), the ring [spilled, total) with byte x at x % cap.
+ */
+
+#define SPOOL_CAP        (1 << 20)  /* default size of the ring */
+#define SPOOL_MIN_CAP    4096
+#define SPOOL_CHUNK      65536      /* most bytes taken from a pipe at once */
+#define SPOOL_TAIL       10         /* lines shown by spool tail */
+#define SPOOL_POLL       200        /* ms between checks for Enter in attach */
+
+struct spool {
+    pthread_mutex_t lock;
+    pthread_cond_t done;        /* signaled when the pipe reaches EOF */
+    int pipe;                   /* read end; the job has the write end */
+    int ring;                   /* the latest cap bytes */
+    int spill;                  /* older bytes, -1 until the ring overflows */
+    size_t cap;
+    uint64_t total, spilled;
+    uint64_t shown;             /* bytes already shown by fg or attach */
+    int attached;               /* fd that gets a copy of new output, or -1 */
+    bool eof;
+    bool released;              /* its job was freed; the spooler frees it */
+    struct spool *next;
+};
+
+bool spool_enabled = false;
+size_t spool_cap = SPOOL_CAP;
+
+/* spools the spooler thread reads, and a pipe that wakes it when one is
+ * added or released */
+static struct {
+    pthread_mutex_t lock;
+    spool_t *head;
+    int wake[2];
+    bool running;
+} spooler = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = { -1, -1 } };
+
+/* An anonymous file in memory when the system has memfds, on disk
+ * otherwise */
+static int spool_file(bool memory) {
+    int fd = -1;
+#ifdef __linux__
+    if (memory)
+        fd = memfd_create("dsh-spool", MFD_CLOEXEC);
+#endif
+    if (fd < 0) {
+        const char *dir = getenv("TMPDIR");
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/dsh-spool-XXXXXX", dir ? dir : "/tmp");
+#ifdef __linux__
+        if ((fd = mkostemp(path, O_CLOEXEC)) >= 0)
+            unlink(path);
+#else
+        if ((fd = mkstemp(path)) >= 0) {
+            unlink(path);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+#endif
+    }
+    return fd;
+}
+
+/* Copies bytes [from, to) of the output to fd; called with the lock held */
+static void spool_copy(spool_t *s, uint64_t from, uint64_t to, int fd) {
+    char buf[SPOOL_CHUNK];
+    while (from < to) {
+        size_t len = to - from < sizeof(buf) ? to - from : sizeof(buf);
+        ssize_t n;
+        if (from < s->spilled) {
+            if (len > s->spilled - from)
+                len = s->spilled - from;
+            n = pread(s->spill, buf, len, from);
+        } else {
+            size_t at = from % s->cap;
+            if (len > s->cap - at)
+                len = s->cap - at;
+            n = pread(s->ring, buf, len, at);
+        }
+        if (n <= 0 || write(fd, buf, n) < 0)
+            return;
+        from += n;
+    }
+}
+
+/* Adds what the spooler read to the ring, moving the oldest bytes to disk
+ * when it is full; called with the lock held */
+static void spool_store(spool_t *s, const char *buf, size_t len) {
+    uint64_t over = s->total + len - s->spilled;
+    if (over > s->cap) {
+        over -= s->cap;
+        if (s->spill < 0)
+            s->spill = spool_file(false);
+        if (s->spill >= 0)
+            spool_copy(s, s->spilled, s->spilled + over, s->spill);
+        s->spilled += over;
+    }
+    while (len > 0) {
+        size_t at = s->total % s->cap, n = len < s->cap - at ? len : s->cap - at;
+        pwrite(s->ring, buf, n, at);
+        buf += n;
+        len -= n;
+        s->total += n;
+    }
+}
+
+/* Reads the pipe of a spool that poll() found ready */
+static void spool_read(spool_t *s) {
+    char buf[SPOOL_CHUNK];
+    ssize_t n = read(s->pipe, buf, s->cap < sizeof(buf) ? s->cap : sizeof(buf));
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+    pthread_mutex_lock(&s->lock);
+    if (n > 0) {
+        spool_store(s, buf, n);
+        if (s->attached >= 0) {
+            write(s->attached, buf, n);
+            s->shown = s->total;
+        }
+    } else {
+        close(s->pipe);
+        s->pipe = -1;
+        s->eof = true;
+        pthread_cond_broadcast(&s->done);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void spool_free(spool_t *s) {
+    close(s->ring);
+    if (s->spill >= 0)
+        close(s->spill);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->done);
+    free(s);
+}
+
+static void *spooler_thread(void *arg) {
+    struct pollfd *fds = NULL;
+    spool_t **polled = NULL;
+    int size = 0;
+
+    while (1) {
+        spool_t *s, **link;
+        int i, count = 1;
+
+        /* drop the spools that are done with, and poll the others */
+        pthread_mutex_lock(&spooler.lock);
+        for (link = &spooler.head; (s = *link) != NULL; ) {
+            if (s->eof && s->released) {
+                *link = s->next;
+                spool_free(s);
+                continue;
+            }
+            if (!s->eof)
+                count++;
+            link = &s->next;
+        }
+        if (count > size) {
+            size = count * 2;
+            fds = realloc(fds, size * sizeof(struct pollfd));
+            polled = realloc(polled, size * sizeof(spool_t *));
+            if (!fds || !polled) {
+                logger(STDERR_FILENO, "Spooler out of memory");
+                exit(EXIT_FAILURE);
+            }
+        }
+        fds[0] = (struct pollfd) { spooler.wake[PIPE_READ], POLLIN, 0 };
+        for (count = 1, s = spooler.head; s; s = s->next)
+            if (!s->eof) {
+                fds[count] = (struct pollfd) { s->pipe, POLLIN, 0 };
+                polled[count++] = s;
+            }
+        pthread_mutex_unlock(&spooler.lock);
+
+        if (poll(fds, count, -1) < 0)
+            continue;
+        if (fds[0].revents & POLLIN) {
+            char drain[64];
+            read(spooler.wake[PIPE_READ], drain, sizeof(drain));
+        }
+        /* only this thread frees spools, so the polled ones are still there */
+        for (i = 1; i < count; i++)
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                spool_read(polled[i]);
+    }
+    return arg;
+}
+
+static void spooler_wake() {
+    write(spooler.wake[PIPE_WRITE], "", 1);
+}
+
+/* Starts the spooler thread the first time a job is spooled */
+static bool spooler_start() {
+    pthread_t thread;
+    if (spooler.running)
+        return true;
+    if (cloexec_pipe(spooler.wake) < 0)
+        return false;
+    fcntl(spooler.wake[PIPE_READ], F_SETFL, O_NONBLOCK);
+    fcntl(spooler.wake[PIPE_WRITE], F_SETFL, O_NONBLOCK);
+    if (pthread_create(&thread, NULL, spooler_thread, NULL) != 0) {
+        close(spooler.wake[PIPE_READ]);
+        close(spooler.wake[PIPE_WRITE]);
+        return false;
+    }
+    pthread_detach(thread);
+    spooler.running = true;
+    return true;
+}
+
+/* Points the stdout and stderr of a job that is about to be launched to a
+ * new spool. Returns false, and leaves the job alone, if it could not. */
+bool spool_job(job_t *j) {
+    pipe_t fds;
+    spool_t *s = calloc(1, sizeof(spool_t));
+
+    pthread_mutex_lock(&spooler.lock);
+    bool started = spooler_start();
+    pthread_mutex_unlock(&spooler.lock);
+    if (s == NULL || !started)
+        goto fail;
+    if ((s->ring = spool_file(true)) < 0)
+        goto fail;
+    if (ftruncate(s->ring, spool_cap) < 0 || cloexec_pipe(fds) < 0) {
+        close(s->ring);
+        goto fail;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->done, NULL);
+    s->pipe = fds[PIPE_READ];
+    s->spill = -1;
+    s->attached = -1;
+    s->cap = spool_cap;
+    j->spool = s;
+    j->mystdout = j->mystderr = fds[PIPE_WRITE];
+
+    pthread_mutex_lock(&spooler.lock);
+    s->next = spooler.head;
+    spooler.head = s;
+    pthread_mutex_unlock(&spooler.lock);
+    spooler_wake();
+    return true;
+
+fail:
+    logger(STDERR_FILENO, "Could not spool the output of %s", j->commandinfo);
+    free(s);
+    return false;
+}
+
+/* Closes dsh's copy of the write end once the job is launched, so that the
+ * spool sees EOF when the job's processes are done */
+void spool_launched(job_t *j) {
+    if (j->spool == NULL)
+        return;
+    close(j->mystdout);
+    j->mystdout = STDOUT_FILENO;
+    j->mystderr = STDERR_FILENO;
+}
+
+/* Called by free_job(); the spooler frees the spool once the pipe is
+ * drained */
+void spool_release(spool_t *s) {
+    if (s == NULL)
+        return;
+    pthread_mutex_lock(&s->lock);
+    s->released = true;
+    s->attached = -1;
+    pthread_mutex_unlock(&s->lock);
+    spooler_wake();
+}
+
+/* Writes the output the job kept so far to fd; from the start when all is
+ * true, else what fg or attach did not show yet. Then, if live, copies the
+ * output to fd as it comes until spool_detach(). */
+void spool_attach(spool_t *s, int fd, bool all, bool live) {
+    pthread_mutex_lock(&s->lock);
+    /* the disk file can hold less than spilled if the disk was full */
+    spool_copy(s, all ? 0 : s->shown, s->total, fd);
+    if (live) {
+        s->attached = fd;
+        s->shown = s->total;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Waits up to ms milliseconds for the spooler to read everything the job
+ * wrote, which it has when the last process holding the pipe exited.
+ * Returns true if it has. */
+bool spool_wait(spool_t *s, int ms) {
+    struct timespec until;
+    bool eof;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&s->lock);
+    while (!s->eof && pthread_cond_timedwait(&s->done, &s->lock, &until) == 0)
+        ;
+    eof = s->eof;
+    pthread_mutex_unlock(&s->lock);
+    return eof;
+}
+
+/* Stops copying the output as it comes */
+void spool_detach(spool_t *s) {
+    pthread_mutex_lock(&s->lock);
+    s->attached = -1;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Writes the last lines of the output to fd */
+void spool_tail(spool_t *s, int lines, int fd) {
+    char buf[SPOOL_CHUNK];
+    uint64_t from;
+
+    pthread_mutex_lock(&s->lock);
+    from = s->total;
+    /* a last line without a newline counts as a line too */
+    if (from > 0) {
+        char last;
+        if (pread(s->ring, &last, 1, (from - 1) % s->cap) == 1 && last == '\n')
+            lines++;
+    }
+    /* walk back through the ring; the disk file is not searched */
+    while (from > s->spilled && lines > 0) {
+        uint64_t start = from - s->spilled > sizeof(buf) ? from - sizeof(buf) : s->spilled;
+        size_t i;
+        if (start / s->cap != (from - 1) / s->cap)     /* stop at the end of the ring */
+            start = (from - 1) / s->cap * s->cap;
+        if (pread(s->ring, buf, from - start, start % s->cap) != (ssize_t) (from - start))
+            break;
+        for (i = from - start; i > 0; i--)
+            if (buf[i - 1] == '\n' && --lines == 0)
+                break;
+        from = start + i;
+    }
+    spool_copy(s, from, s->total, fd);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Bytes the job wrote, and how many of them are on disk */
+void spool_size(spool_t *s, uint64_t *total, uint64_t *spilled) {
+    pthread_mutex_lock(&s->lock);
+    *total = s->total;
+    *spilled = s->spilled;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Turns spooling on for the jobs started from now on, with a ring of cap
+ * bytes (the default if cap is NULL or empty) */
+bool spool_on(const char *cap) {
+    if (cap != NULL && *cap) {
+        char *end;
+        long long bytes = strtoll(cap, &end, 10);
+        if (*end || bytes < SPOOL_MIN_CAP)
+            return false;
+        spool_cap = bytes;
+    }
+    spool_enabled = true;
+    return true;
+}
+
+/* Follows the output of a job until it is done, or until the user presses
+ * Enter */
+static void spool_follow(spool_t *s, int fd) {
+    spool_attach(s, fd, true, true);
+    while (!spool_wait(s, SPOOL_POLL)) {
+        struct pollfd in = { STDIN_FILENO, POLLIN, 0 };
+        char line[MAX_LEN_CMDLINE];
+        if (current_session == NULL && dsh_is_interactive && poll(&in, 1, 0) > 0) {
+            fgets(line, sizeof(line), stdin);
+            break;
+        }
+    }
+    spool_detach(s);
+}
+
+static void spool_list(FILE *out) {
+    job_t *j;
+    int pos = 1;
+    fprintf(out, "spooling %s, %zu bytes in memory per job\n", spool_enabled ? "on" : "off", spool_cap);
+    for (j = job_head; j; j = j->next, pos++) {
+        uint64_t total, spilled;
+        if (j->spool == NULL)
+            continue;
+        spool_size(j->spool, &total, &spilled);
+        fprintf(out, "[%d] %llu bytes (%llu on disk): %s\n", pos, (unsigned long long) total,
+                (unsigned long long) spilled, j->commandinfo);
+    }
+}
+
+/* The spool builtin:
+ *     spool                       lists the spooled jobs
+ *     spool on [bytes] | off      spools the jobs started with & from now on
+ *     spool show|attach N         prints the output of job N; attach goes on
+ *                                 until the job is done or Enter is pressed
+ *     spool tail N [lines]        prints the last lines of it */
+void spool_cmd(int argc, char **argv) {
+    FILE *out = current_session ? current_session->out : stdout;
+    int fd = current_session ? current_session->fd : STDOUT_FILENO;
+    job_t *j;
+
+    if (argc == 1) {
+        spool_list(out);
+        fflush(out);
+        return;
+    }
+    if (!strcmp(argv[1], "on") && argc <= 3) {
+        if (!spool_on(argc == 3 ? argv[2] : NULL))
+            logger(STDERR_FILENO, "Error: the spool needs at least %d bytes", SPOOL_MIN_CAP);
+        return;
+    }
+    if (!strcmp(argv[1], "off") && argc == 2) {
+        spool_enabled = false;
+        return;
+    }
+    if (argc < 3 || (argc > 3 && strcmp(argv[1], "tail")) || argc > 4 ||
+        (strcmp(argv[1], "show") && strcmp(argv[1], "tail") && strcmp(argv[1], "attach"))) {
+        logger(STDERR_FILENO, "Error: usage: spool [on [bytes] | off | show N | tail N [lines] | attach N]");
+        return;
+    }
+    if (!(j = search_job_pos(atoi(argv[2]))) || j->spool == NULL) {
+        logger(STDERR_FILENO, "Error: job %s has no spooled output", argv[2]);
+        return;
+    }
+    fflush(out);
+    if (!strcmp(argv[1], "show"))
+        spool_attach(j->spool, fd, true, false);
+    else if (!strcmp(argv[1], "tail"))
+        spool_tail(j->spool, argc == 4 ? atoi(argv[3]) : SPOOL_TAIL, fd);
+    else
+        spool_follow(j->spool, fd);
+}
@@ -0,0 +1,241 @@
+#include "dsh.h"
+#include <time.h>
+
+/* Latency histograms and counters of the shell's hot paths, always on.
+ *
+ * A histogram keeps its values in log-linear buckets as HdrHistogram does:
+ * 16 buckets for every power of two, so a percentile read from it is within
+ * about 6% of the true value whatever the scale, from a nanosecond to hours,
+ * in a fixed 4KB. Updates are atomic adds, so the server threads share them
+ * without a lock.
+ */
+
+#define STATS_SUB_BITS 4
+#define STATS_SUB      (1 << STATS_SUB_BITS)                  /* buckets per power of two */
+#define STATS_BUCKETS  ((64 - STATS_SUB_BITS + 1) * STATS_SUB)
+
+typedef struct histogram {
+    uint64_t count, sum, min, max;
+    uint32_t buckets[STATS_BUCKETS];
+} histogram_t;
+
+static const char *histogram_names[STATS_HISTOGRAMS] = {
+    "parse", "fork_exec", "exec_exit", "job_wall", "prompt_return", "job_cpu",
+};
+static const char *counter_names[STATS_COUNTERS] = {
+    "jobs_spawned", "stages", "children_reaped", "exec_failures",
+};
+
+static histogram_t histograms[STATS_HISTOGRAMS];
+static uint64_t counters[STATS_COUNTERS];
+
+static pid_t stats_pid;         /* process that dumps them at exit */
+static const char *stats_path;
+
+/* Nanoseconds on the monotonic clock, the same in dsh and its children */
+uint64_t stats_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int stats_bucket(uint64_t value) {
+    if (value < STATS_SUB)
+        return (int) value;
+    int magnitude = 63 - __builtin_clzll(value);
+    return (magnitude - STATS_SUB_BITS + 1) * STATS_SUB +
+           (int) ((value >> (magnitude - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+/* Highest value that falls in a bucket */
+static uint64_t stats_bucket_value(int bucket) {
+    if (bucket < STATS_SUB)
+        return bucket;
+    int magnitude = bucket / STATS_SUB + STATS_SUB_BITS - 1;
+    uint64_t sub = bucket % STATS_SUB + STATS_SUB;
+    return ((sub + 1) << (magnitude - STATS_SUB_BITS)) - 1;
+}
+
+void stats_record(int which, uint64_t ns) {
+    histogram_t *h = &histograms[which];
+    uint64_t old;
+
+    __atomic_fetch_add(&h->buckets[stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+    /* count last: a reader that sees it also sees the value in a bucket */
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELEASE);
+    old = __atomic_load_n(&h->min, __ATOMIC_RELAXED);     /* 0 until the first value */
+    while ((old == 0 || ns < old) && !__atomic_compare_exchange_n(&h->min, &old, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    old = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (ns > old && !__atomic_compare_exchange_n(&h->max, &old, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void stats_count(int which) {
+    __atomic_fetch_add(&counters[which], 1, __ATOMIC_RELAXED);
+}
+
+/* Value below which the given fraction of the recorded values fall */
+static uint64_t stats_percentile(histogram_t *h, double fraction) {
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+    uint64_t rank = (uint64_t) (fraction * count + 0.5), seen = 0;
+    int i;
+
+    if (rank == 0)
+        rank = 1;
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = stats_bucket_value(i);
+            return value > h->max ? h->max : value;
+        }
+    }
+    return h->max;
+}
+
+/* The time a child reached exec, or 0 when its exec failed */
+typedef struct stats_exec_time {
+    pid_t pid;
+    uint64_t at;
+} stats_exec_time_t;
+
+/* One pipe per thread, that is per server session, that the children write
+ * a stats_exec_time_t to, atomically as it is smaller than PIPE_BUF. dsh
+ * reads it when it reaps, so it holds two fds whatever the number of
+ * children; both ends are non-blocking, and a child that finds it full
+ * (some 4000 children not reaped yet) leaves its times out. */
+static __thread pipe_t stats_pipe = { -1, -1 };
+
+/* The write end for the children of the calling thread, or -1 */
+int stats_channel() {
+    if (stats_pipe[PIPE_WRITE] < 0 && cloexec_pipe(stats_pipe) == 0) {
+        fcntl(stats_pipe[PIPE_READ], F_SETFL, O_NONBLOCK);
+        fcntl(stats_pipe[PIPE_WRITE], F_SETFL, O_NONBLOCK);
+    }
+    return stats_pipe[PIPE_WRITE];
+}
+
+/* Called by the child when it is about to exec, and again if the exec
+ * failed */
+void stats_exec(process_t *p, bool failed) {
+    stats_exec_time_t t = { p->pid, failed ? 0 : stats_clock() };
+    if (stats_pipe[PIPE_WRITE] >= 0)
+        write(stats_pipe[PIPE_WRITE], &t, sizeof(t));
+}
+
+/* Gives the times the children wrote so far to their processes; the last
+ * process with a pid in the job list is the one that runs under it */
+static void stats_drain() {
+    stats_exec_time_t times[64];
+    ssize_t n;
+    int i;
+
+    while ((n = read(stats_pipe[PIPE_READ], times, sizeof(times))) > 0 || (n < 0 && errno == EINTR))
+        for (i = 0; i < n / (ssize_t) sizeof(times[0]); i++) {
+            process_t *p, *found = NULL;
+            job_t *j;
+            for (j = job_head; j; j = j->next)
+                for (p = j->first_process; p; p = p->next)
+                    if (p->pid == times[i].pid)
+                        found = p;
+            if (found && times[i].at)
+                found->execed = times[i].at;
+            else if (found)
+                found->exec_failed = true;
+        }
+}
+
+/* Records the times of a process dsh has just reaped, with the time it
+ * reached exec it wrote to the channel before it exited */
+void stats_reaped(job_t *j, process_t *p) {
+    uint64_t now = stats_clock();
+
+    stats_count(STATS_REAPED);
+    if (stats_pipe[PIPE_READ] >= 0)
+        stats_drain();
+    if (p->exec_failed)
+        stats_count(STATS_EXEC_FAILED);
+    else if (p->execed && p->execed >= p->forked) {
+        stats_record(STATS_FORK_EXEC, p->execed - p->forked);
+        stats_record(STATS_EXEC_EXIT, now - p->execed);
+    }
+    if (j->started && job_is_completed(j)) {
+        stats_record(STATS_JOB_WALL, now - j->started);
+        j->started = 0;
+    }
+}
+
+static void stats_print_human(FILE *out) {
+    int i;
+    fprintf(out, "%-14s %8s %10s %10s %10s %10s %10s %10s\n",
+            "latency (us)", "count", "min", "mean", "p50", "p90", "p99", "max");
+    for (i = 0; i < STATS_HISTOGRAMS; i++) {
+        histogram_t *h = &histograms[i];
+        uint64_t count = h->count;
+        fprintf(out, "%-14s %8llu", histogram_names[i], (unsigned long long) count);
+        if (count == 0) {
+            fprintf(out, "\n");
+            continue;
+        }
+        fprintf(out, " %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                h->min / 1e3, (double) h->sum / count / 1e3,
+                stats_percentile(h, 0.5) / 1e3, stats_percentile(h, 0.9) / 1e3,
+                stats_percentile(h, 0.99) / 1e3, h->max / 1e3);
+    }
+    for (i = 0; i < STATS_COUNTERS; i++)
+        fprintf(out, "%-18s %llu\n", counter_names[i], (unsigned long long) counters[i]);
+}
+
+static void stats_print_json(FILE *out) {
+    int i;
+    fprintf(out, "{\"unit\":\"ns\"");
+    for (i = 0; i < STATS_HISTOGRAMS; i++) {
+        histogram_t *h = &histograms[i];
+        fprintf(out, ",\"%s\":{\"count\":%llu", histogram_names[i], (unsigned long long) h->count);
+        if (h->count > 0)
+            fprintf(out, ",\"min\":%llu,\"mean\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu",
+                    (unsigned long long) h->min, (unsigned long long) (h->sum / h->count),
+                    (unsigned long long) stats_percentile(h, 0.5),
+                    (unsigned long long) stats_percentile(h, 0.9),
+                    (unsigned long long) stats_percentile(h, 0.99),
+                    (unsigned long long) stats_percentile(h, 0.999),
+                    (unsigned long long) h->max);
+        fprintf(out, "}");
+    }
+    for (i = 0; i < STATS_COUNTERS; i++)
+        fprintf(out, ",\"%s\":%llu", counter_names[i], (unsigned long long) counters[i]);
+    fprintf(out, "}\n");
+}
+
+void stats_print(FILE *out, bool json) {
+    if (json)
+        stats_print_json(out);
+    else
+        stats_print_human(out);
+    fflush(out);
+}
+
+void stats_reset() {
+    memset(histograms, 0, sizeof(histograms));
+    memset(counters, 0, sizeof(counters));
+}
+
+static void stats_dump() {
+    FILE *out;
+    if (getpid() != stats_pid)  /* a child that inherited the handler */
+        return;
+    if (!strcmp(stats_path, "-"))
+        stats_print(stderr, true);
+    else if ((out = fopen(stats_path, "w")) != NULL) {
+        stats_print(out, true);
+        fclose(out);
+    }
+}
+
+/* Writes the stats as JSON to path ("-" for stderr) when dsh exits */
+void stats_dump_at_exit(const char *path) {
+    stats_path = path;
+    stats_pid = getpid();
+    atexit(stats_dump);
+}
@@ -0,0 +1,140 @@
+#include "dsh.h"
+#include <time.h>
+
+/* Tracing of the job lifecycle in the Chrome trace event format, which
+ * chrome://tracing and ui.perfetto.dev open.
+ *
+ * The shell's own work (reading and parsing lines, builtins, spawning,
+ * waiting, reaping) is on the track of the dsh process, one thread per
+ * server session. Every job gets a track of its own, named after its
+ * command line, with one thread per process of the pipeline: the child's
+ * setup and compile spans, then a "run" span from exec to the moment dsh
+ * reaps the process.
+ *
+ * Each event is written with a single write() to a file opened with
+ * O_APPEND, so the children forked by dsh add theirs to the same file
+ * without any locking. The file is a JSON array; the closing ] is written by
+ * trace_stop() but the viewers accept a trace that lacks it.
+ */
+
+#define TRACE_EVENT_MAX 1024
+
+/* -1 when tracing is off; every trace function returns right away then */
+int trace_fd = -1;
+
+static pid_t trace_pid;     /* the dsh process, the pid of the shell track */
+static bool trace_exit_hook;
+
+/* Microseconds on the monotonic clock, the same in dsh and its children */
+double trace_clock() {
+    struct timespec ts;
+    if (trace_fd < 0)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Appends s to the event as the contents of a JSON string, cut so that
+ * the event stays below limit */
+static size_t trace_escape(char *event, size_t len, const char *s, size_t limit) {
+    for (; s && *s && len < limit; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            len += sprintf(event + len, "\\%c", c);
+        else if (c < 0x20)
+            len += sprintf(event + len, "\\u%04x", c);
+        else
+            event[len++] = c;
+    }
+    return len;
+}
+
+static void trace_write(char ph, const char *name, const char *detail,
+                        int pid, int tid, double ts, double dur) {
+    char event[TRACE_EVENT_MAX];
+    size_t len;
+
+    len = sprintf(event, "{\"name\":\"");
+    len = trace_escape(event, len, name, TRACE_EVENT_MAX / 4);
+    if (ph == 'M') {
+        len += sprintf(event + len, "\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"", pid, tid);
+    } else {
+        len += sprintf(event + len, "\",\"cat\":\"dsh\",\"ph\":\"%c\",\"ts\":%.3f,", ph, ts);
+        if (ph == 'X')
+            len += sprintf(event + len, "\"dur\":%.3f,", dur);
+        len += sprintf(event + len, "\"pid\":%d,\"tid\":%d,\"args\":{\"detail\":\"", pid, tid);
+    }
+    len = trace_escape(event, len, detail, TRACE_EVENT_MAX - 16);
+    len += sprintf(event + len, "\"}},\n");
+    write(trace_fd, event, len);
+}
+
+/* A span of the shell that began at start and ends now */
+void trace_shell_span(const char *name, const char *detail, double start) {
+    if (trace_fd < 0)
+        return;
+    trace_write('X', name, detail, trace_pid, current_session ? current_session->id : 0,
+                start, trace_clock() - start);
+}
+
+/* A span of process pid in the job of process group pgid */
+void trace_span(const char *name, const char *detail, int pgid, int pid, double start) {
+    if (trace_fd < 0)
+        return;
+    trace_write('X', name, detail, pgid, pid, start, trace_clock() - start);
+}
+
+/* Begins ('B') or ends ('E') a span of a process at the current time */
+void trace_mark(char ph, const char *name, const char *detail, int pgid, int pid) {
+    if (trace_fd < 0)
+        return;
+    trace_write(ph, name, detail, pgid, pid, trace_clock(), 0);
+}
+
+/* Names the track of a job and its processes in the viewer */
+void trace_job(job_t *j) {
+    process_t *p;
+    if (trace_fd < 0 || j->pgid <= 0)
+        return;
+    trace_write('M', "process_name", j->commandinfo, j->pgid, 0, 0, 0);
+    for (p = j->first_process; p; p = p->next)
+        if (p->pid > 0)
+            trace_write('M', "thread_name", p->argv[0], j->pgid, p->pid, 0, 0);
+}
+
+/* Marks the end of the run span of a process dsh has just reaped */
+void trace_reaped(job_t *j, process_t *p) {
+    if (trace_fd < 0)
+        return;
+    trace_mark('E', "run", p->argv[0], j->pgid, p->pid);
+}
+
+/* Ends the trace: names the shell track and closes the JSON array. The
+ * children inherit it as an exit handler, and do nothing. */
+void trace_stop() {
+    char end[256];
+    if (trace_fd < 0 || getpid() != trace_pid)
+        return;
+    trace_write('M', "process_name", "dsh", trace_pid, 0, 0, 0);
+    int len = sprintf(end, "{\"name\":\"trace_stop\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.3f,\"pid\":%d,\"tid\":0}\n]\n",
+                      trace_clock(), trace_pid);
+    write(trace_fd, end, len);
+    close(trace_fd);
+    trace_fd = -1;
+}
+
+/* Starts writing the trace to path, replacing what it held */
+bool trace_start(const char *path) {
+    int fd = fd_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0)
+        return false;
+    trace_stop();
+    write(fd, "[\n", 2);
+    trace_pid = getpid();
+    trace_fd = fd;
+    if (!trace_exit_hook) {
+        atexit(trace_stop);
+        trace_exit_hook = true;
+    }
+    return true;
+}
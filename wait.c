@@ -0,0 +1,261 @@
+#include "dsh.h"
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/syscall.h>
+
+/* The wait builtin: joins the background jobs of the session.
+ *
+ *     wait             until every background job is done; status 0
+ *     wait %n ...      until jobs n... are done; the status of the last one
+ *     wait -n [%n ...] until one of them is done; its status, 127 if none runs
+ *
+ * A job is waited for until it completes or stops. wait opens a pidfd for
+ * every process of the set once it runs and keeps it until the process is
+ * reaped, and blocks in poll() on them and on a wakeup pipe with no
+ * timeout: a pidfd polls readable as soon as its process exits, whatever
+ * the number of processes, and only its job is reaped then. A pidfd does
+ * not poll readable when its process stops, so the SIGCHLD handler writes
+ * to the wakeup pipe of every wait in progress, and the jobs of the set are
+ * then looked at for stops with WUNTRACED. The same wakeup starts queued
+ * jobs as others finish.
+ *
+ * The wakeup pipes are taken from a pool of WAIT_WAKERS that are never
+ * closed, so that the handler cannot write to a descriptor that was closed
+ * and reused meanwhile. A wait that finds none free, with server sessions
+ * waiting at once, polls every WAIT_TICK ms instead.
+ */
+
+#define WAIT_WAKERS 64
+#define WAIT_TICK 100
+
+static struct {
+    int fds[2];                     /* made on first use, never closed */
+    bool made;
+    volatile sig_atomic_t used;     /* a wait polls fds[PIPE_READ] */
+} wakers[WAIT_WAKERS];
+static pthread_mutex_t wakers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t wait_handler_once = PTHREAD_ONCE_INIT;
+static struct sigaction wait_previous;  /* SIGCHLD handler of a libdsh host */
+
+static void wait_sigchld(int sig, siginfo_t *info, void *context) {
+    int i, saved = errno;
+    for (i = 0; i < WAIT_WAKERS; i++)
+        if (wakers[i].used)
+            write(wakers[i].fds[PIPE_WRITE], "", 1);
+    errno = saved;
+    if (wait_previous.sa_flags & SA_SIGINFO)
+        wait_previous.sa_sigaction(sig, info, context);
+    else if (wait_previous.sa_handler != SIG_DFL && wait_previous.sa_handler != SIG_IGN)
+        wait_previous.sa_handler(sig);
+}
+
+/* SA_RESTART: the reads of the shell go on through the signal */
+static void wait_install_handler(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = wait_sigchld;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, &wait_previous);
+}
+
+/* A free wakeup pipe with nothing to read, or -1 */
+static int wait_waker(void) {
+    char drain[64];
+    int i;
+    pthread_once(&wait_handler_once, wait_install_handler);
+    pthread_mutex_lock(&wakers_lock);
+    for (i = 0; i < WAIT_WAKERS; i++) {
+        if (wakers[i].used)
+            continue;
+        if (!wakers[i].made && pipe2(wakers[i].fds, O_CLOEXEC | O_NONBLOCK) < 0)
+            break;
+        wakers[i].made = true;
+        while (read(wakers[i].fds[PIPE_READ], drain, sizeof(drain)) > 0)
+            ;
+        wakers[i].used = 1;
+        break;
+    }
+    pthread_mutex_unlock(&wakers_lock);
+    return i < WAIT_WAKERS && wakers[i].used ? i : -1;
+}
+
+static void wait_waker_release(int i) {
+    if (i < 0)
+        return;
+    pthread_mutex_lock(&wakers_lock);
+    wakers[i].used = 0;
+    pthread_mutex_unlock(&wakers_lock);
+}
+
+/* A descriptor that polls readable once pid exits, or -1 */
+static int wait_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int) syscall(SYS_pidfd_open, pid, 0);   /* always close-on-exec */
+#else
+    return -1;
+#endif
+}
+
+/* true while j may still complete: it runs, or it is queued to */
+static bool wait_pending(job_t *j) {
+    return j->queued || (j->pgid > 0 && !job_is_completed(j) && !job_is_stopped(j));
+}
+
+/* The processes of the set, with a pidfd each once it runs; fds[0] is the
+ * wakeup pipe */
+typedef struct wait_watch {
+    int count;
+    struct pollfd *fds;
+    process_t **procs;
+    job_t **jobs;
+} wait_watch_t;
+
+static bool wait_watch_init(wait_watch_t *w, job_t **set, int n, int waker) {
+    process_t *p;
+    int i;
+    w->count = 1;
+    for (i = 0; i < n; i++)
+        for (p = set[i]->first_process; p; p = p->next)
+            w->count++;
+    w->fds = malloc(w->count * sizeof(struct pollfd));
+    w->procs = malloc(w->count * sizeof(process_t *));
+    w->jobs = malloc(w->count * sizeof(job_t *));
+    if (!w->fds || !w->procs || !w->jobs) {
+        free(w->fds);
+        free(w->procs);
+        free(w->jobs);
+        return false;
+    }
+    w->fds[0] = (struct pollfd) { waker >= 0 ? wakers[waker].fds[PIPE_READ] : -1, POLLIN, 0 };
+    w->count = 1;
+    for (i = 0; i < n; i++)
+        for (p = set[i]->first_process; p; p = p->next) {
+            w->fds[w->count] = (struct pollfd) { -1, POLLIN, 0 };
+            w->procs[w->count] = p;
+            w->jobs[w->count++] = set[i];
+        }
+    return true;
+}
+
+/* Opens the pidfds of the processes started since the last call, and
+ * closes those of the processes reaped */
+static void wait_watch_update(wait_watch_t *w) {
+    int i;
+    for (i = 1; i < w->count; i++) {
+        process_t *p = w->procs[i];
+        if (w->fds[i].fd >= 0 && p->completed) {
+            close(w->fds[i].fd);
+            w->fds[i].fd = -1;
+        }
+        else if (w->fds[i].fd < 0 && p->pid > 0 && !p->completed)
+            w->fds[i].fd = wait_pidfd(p->pid);
+    }
+}
+
+static void wait_watch_free(wait_watch_t *w) {
+    int i;
+    for (i = 1; i < w->count; i++)
+        if (w->fds[i].fd >= 0)
+            close(w->fds[i].fd);
+    free(w->fds);
+    free(w->procs);
+    free(w->jobs);
+}
+
+/* Blocks until a process of the set exits or a child changes state, and
+ * reaps what did */
+static void wait_round(wait_watch_t *w, job_t **set, int n) {
+    char drain[64];
+    int i;
+
+    wait_watch_update(w);
+    if (poll(w->fds, w->count, w->fds[0].fd >= 0 ? -1 : WAIT_TICK) < 0)
+        return;
+    for (i = 1; i < w->count; i++)
+        if (w->fds[i].revents)
+            reap_job(w->jobs[i]);
+    if (w->fds[0].fd < 0 || (w->fds[0].revents & POLLIN)) {
+        while (w->fds[0].fd >= 0 && read(w->fds[0].fd, drain, sizeof(drain)) > 0)
+            ;
+        /* a stop, or a job outside the set that frees room for the queue */
+        for (i = 0; i < n; i++)
+            if (wait_pending(set[i]))
+                reap_job(set[i]);
+        if (sched_queued())
+            reap_children();
+    }
+}
+
+int wait_cmd(int argc, char **argv) {
+    job_t **set, *j, *k;
+    bool *pending, first = argc > 1 && !strcmp(argv[1], "-n");
+    int i, n = 0, arg = first ? 2 : 1, count = 0, status = 0, waker;
+    wait_watch_t watch;
+
+    for (j = job_head; j; j = j->next)
+        count++;
+    set = malloc((count + argc) * sizeof(job_t *));
+    pending = malloc((count + argc) * sizeof(bool));
+    if (set == NULL || pending == NULL) {
+        free(set);
+        free(pending);
+        return 1;
+    }
+    if (arg == argc) {
+        for (j = job_head; j; j = j->next)
+            if (j->bg)
+                set[n++] = j;
+    }
+    else for (; arg < argc; arg++) {
+        char *spec = argv[arg] + (argv[arg][0] == '%');
+        /* search_job_pos() gives the last job for a position past it */
+        for (i = 1, j = NULL, k = job_head; k && !j; k = k->next, i++)
+            if (i == atoi(spec))
+                j = k;
+        if (j == NULL) {
+            logger(STDERR_FILENO, "Error: wait: no job %s", argv[arg]);
+            free(set);
+            free(pending);
+            return 127;
+        }
+        set[n++] = j;
+    }
+
+    waker = wait_waker();
+    if (!wait_watch_init(&watch, set, n, waker)) {
+        wait_waker_release(waker);
+        free(set);
+        free(pending);
+        return 1;
+    }
+    reap_children();
+    for (i = 0; i < n; i++)
+        pending[i] = wait_pending(set[i]);
+    while (1) {
+        int left = 0, done = -1;
+        sched_admit();
+        for (i = 0; i < n; i++) {
+            if (wait_pending(set[i]))
+                left++;
+            else if (pending[i] && done < 0)
+                done = i;
+        }
+        if (first && done >= 0) {
+            status = job_exit_status(set[done]);
+            break;
+        }
+        if (left == 0) {
+            /* -n with nothing running; a list gives the status of its last */
+            status = first ? 127 : arg > 1 && n > 0 ? job_exit_status(set[n - 1]) : 0;
+            break;
+        }
+        wait_round(&watch, set, n);
+    }
+    wait_watch_free(&watch);
+    wait_waker_release(waker);
+    free(set);
+    free(pending);
+    return status;
+}
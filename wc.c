@@ -0,0 +1,375 @@
+#include "dsh.h"
+#include <stdint.h>
+#include <ctype.h>
+#include <locale.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Builtin wc. It runs in the forked child of a pipeline stage instead of
+ * exec'ing /usr/bin/wc and prints exactly what coreutils wc prints for the
+ * -l, -w and -c options. Input files are mmap'ed; pipes are read in large
+ * blocks. Pure ASCII input is classified 64 bytes at a time with SSE2, any
+ * other byte goes through the same per character rules as coreutils.
+ */
+
+#define WC_BUFSIZE (128 * 1024)
+
+typedef struct wc_counts {
+    uintmax_t lines;
+    uintmax_t words;
+    uintmax_t bytes;
+} wc_counts_t;
+
+typedef struct wc_state {
+    bool in_word;       /* last classified character was part of a word */
+    bool multibyte;     /* the locale has multibyte characters */
+    bool posix;         /* POSIXLY_CORRECT: no-break spaces are not separators */
+    mbstate_t mbstate;
+} wc_state_t;
+
+/* No-break spaces separate words unless POSIXLY_CORRECT is set */
+static bool wc_nbspace(wint_t c, wc_state_t *s)
+{
+    return !s->posix && (c == 0x00A0 || c == 0x2007 || c == 0x202F || c == 0x2060);
+}
+
+/* Classifies the character at p. Returns the number of bytes it used, or 0
+ * when the buffer ends in the middle of a multibyte character */
+static size_t wc_scalar(wc_state_t *s, wc_counts_t *c, const unsigned char *p, size_t len, bool eof)
+{
+    wint_t ch = *p;
+    size_t n = 1;
+    bool printable, space;
+
+    if (s->multibyte && *p >= 0x80) {
+        wchar_t wide;
+        mbstate_t saved = s->mbstate;
+        n = mbrtowc(&wide, (const char *) p, len, &s->mbstate);
+        if (n == (size_t) -2) {
+            s->mbstate = saved;
+            return eof ? len : 0;   /* truncated character at the end is ignored */
+        }
+        if (n == (size_t) -1) {
+            /* an invalid byte counts as a byte but not as a character */
+            memset(&s->mbstate, 0, sizeof(s->mbstate));
+            return 1;
+        }
+        if (n == 0)
+            n = 1;
+        ch = wide;
+        printable = iswprint(ch);
+        space = iswspace(ch) || wc_nbspace(ch, s);
+    } else {
+        printable = isprint(ch);
+        space = isspace(ch) || (ch >= 0x80 && wc_nbspace(btowc(ch), s));
+    }
+
+    switch (ch) {
+        case '\n':
+            c->lines++;
+        case '\r':
+        case '\f':
+        case '\t':
+        case ' ':
+        case '\v':
+            s->in_word = false;
+            break;
+        default:
+            /* non printable characters neither start nor end a word */
+            if (printable) {
+                if (space)
+                    s->in_word = false;
+                else if (!s->in_word) {
+                    s->in_word = true;
+                    c->words++;
+                }
+            }
+    }
+    return n;
+}
+
+#ifdef __SSE2__
+/* Builds bit masks of the newlines, the separators (\t..\r and space) and the
+ * printable non-space bytes among the 64 bytes at p. Returns true when every
+ * byte is either a separator or printable, i.e. the block has no control or
+ * non-ASCII bytes and can be counted from the masks alone. */
+static bool wc_classify64(const unsigned char *p, uint64_t *newline, uint64_t *separator, uint64_t *graph)
+{
+    uint64_t nl = 0, sep = 0, gr = 0;
+    int k;
+    for (k = 0; k < 4; k++) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + 16 * k));
+        __m128i ctl = _mm_sub_epi8(v, _mm_set1_epi8(9));
+        __m128i is_ctl = _mm_cmpeq_epi8(_mm_min_epu8(ctl, _mm_set1_epi8(4)), ctl);
+        __m128i is_sep = _mm_or_si128(is_ctl, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+        __m128i g = _mm_sub_epi8(v, _mm_set1_epi8(0x21));
+        __m128i is_graph = _mm_cmpeq_epi8(_mm_min_epu8(g, _mm_set1_epi8(0x5d)), g);
+
+        nl |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))) << (16 * k);
+        sep |= (uint64_t) (uint16_t) _mm_movemask_epi8(is_sep) << (16 * k);
+        gr |= (uint64_t) (uint16_t) _mm_movemask_epi8(is_graph) << (16 * k);
+    }
+    *newline = nl;
+    *separator = sep;
+    *graph = gr;
+    return (sep | gr) == ~(uint64_t) 0;
+}
+#endif
+
+/* Counts lines only */
+static void wc_count_lines(wc_counts_t *c, const unsigned char *buf, size_t len)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 64 <= len; i += 64) {
+        uint64_t mask = 0;
+        int k;
+        for (k = 0; k < 4; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (buf + i + 16 * k));
+            mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) << (16 * k);
+        }
+        c->lines += __builtin_popcountll(mask);
+    }
+#endif
+    const unsigned char *p = buf + i, *end = buf + len;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        c->lines++;
+        p++;
+    }
+}
+
+/* Counts lines and words. Returns how many bytes at the end of the buffer
+ * form an incomplete character and have to be passed again with more input */
+static size_t wc_count_words(wc_state_t *s, wc_counts_t *c, const unsigned char *buf, size_t len, bool eof)
+{
+    size_t i = 0, n;
+    while (i < len) {
+#ifdef __SSE2__
+        if (len - i >= 64 && mbsinit(&s->mbstate)) {
+            uint64_t nl, sep, graph;
+            if (wc_classify64(buf + i, &nl, &sep, &graph)) {
+                uint64_t starts = graph & ~((graph << 1) | (uint64_t) s->in_word);
+                c->lines += __builtin_popcountll(nl);
+                c->words += __builtin_popcountll(starts);
+                s->in_word = graph >> 63;
+                i += 64;
+                continue;
+            }
+            /* the block needs the character rules; go through it one by one */
+            size_t block_end = i + 64;
+            while (i < block_end) {
+                if ((n = wc_scalar(s, c, buf + i, len - i, eof)) == 0)
+                    return len - i;
+                i += n;
+            }
+            continue;
+        }
+#endif
+        if ((n = wc_scalar(s, c, buf + i, len - i, eof)) == 0)
+            return len - i;
+        i += n;
+    }
+    return 0;
+}
+
+/* Counts everything readable from fd. Returns false on a read error */
+static bool wc_fd(int fd, struct stat *st, wc_state_t *s, wc_counts_t *c, bool words, bool lines)
+{
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset < 0)
+        offset = 0;
+
+    if (S_ISREG(st->st_mode) && st->st_size > offset) {
+        size_t size = st->st_size - offset;
+        if (!words && !lines) {
+            c->bytes += size;
+            return true;
+        }
+        unsigned char *map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st->st_size, MADV_SEQUENTIAL);
+            if (words)
+                wc_count_words(s, c, map + offset, size, true);
+            else
+                wc_count_lines(c, map + offset, size);
+            c->bytes += size;
+            munmap(map, st->st_size);
+            return true;
+        }
+    }
+
+    /* pipes, terminals and anything that cannot be mapped */
+    unsigned char *buf = malloc(WC_BUFSIZE);
+    size_t keep = 0;
+    ssize_t n;
+    if (buf == NULL)
+        return false;
+    while ((n = read(fd, buf + keep, WC_BUFSIZE - keep)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            free(buf);
+            return false;
+        }
+        c->bytes += n;
+        if (words) {
+            size_t len = keep + n;
+            keep = wc_count_words(s, c, buf, len, false);
+            memmove(buf, buf + len - keep, keep);
+        }
+        else if (lines)
+            wc_count_lines(c, buf, n);
+    }
+    if (keep > 0)
+        wc_count_words(s, c, buf, keep, true);
+    free(buf);
+    return true;
+}
+
+/* Prints one line of counts the way coreutils does */
+static void wc_print(wc_counts_t *c, int width, bool lines, bool words, bool bytes, const char *name)
+{
+    const char *format = "%*ju";
+    if (lines) {
+        printf(format, width, c->lines);
+        format = " %*ju";
+    }
+    if (words) {
+        printf(format, width, c->words);
+        format = " %*ju";
+    }
+    if (bytes)
+        printf(format, width, c->bytes);
+    if (name)
+        printf(" %s", name);
+    printf("\n");
+}
+
+/* Entry point of the wc stage builtin. Returns the exit status, or -1 when
+ * an option is not supported and the real wc has to be exec'ed instead */
+int builtin_wc(int argc, char **argv)
+{
+    bool lines = false, words = false, bytes = false, options_done = false;
+    char **files = calloc(argc + 1, sizeof(char *));
+    int nfiles = 0, i, status = EXIT_SUCCESS;
+
+    if (files == NULL)
+        return -1;
+    for (i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        if (options_done || arg[0] != '-' || arg[1] == '\0')
+            files[nfiles++] = arg;
+        else if (!strcmp(arg, "--"))
+            options_done = true;
+        else if (!strcmp(arg, "--lines"))
+            lines = true;
+        else if (!strcmp(arg, "--words"))
+            words = true;
+        else if (!strcmp(arg, "--bytes"))
+            bytes = true;
+        else if (arg[1] == '-') {
+            free(files);
+            return -1;
+        }
+        else {
+            char *opt;
+            for (opt = arg + 1; *opt; opt++) {
+                if (*opt == 'l') lines = true;
+                else if (*opt == 'w') words = true;
+                else if (*opt == 'c') bytes = true;
+                else {
+                    free(files);
+                    return -1;
+                }
+            }
+        }
+    }
+    if (!lines && !words && !bytes)
+        lines = words = bytes = true;
+    if (nfiles == 0)
+        files[nfiles++] = NULL;  /* stdin, printed without a name */
+
+    /* column width: coreutils sizes it from the regular files up front,
+     * uses at least 7 for anything else and 1 for a single count of a
+     * single input */
+    int width = 1;
+    struct stat *st = calloc(nfiles, sizeof(struct stat));
+    int *failed = calloc(nfiles, sizeof(int));
+    if (st == NULL || failed == NULL) {
+        free(files);
+        free(st);
+        free(failed);
+        return -1;
+    }
+    if (nfiles == 1 && lines + words + bytes == 1)
+        failed[0] = 1;
+    else {
+        uintmax_t regular_total = 0;
+        int minimum_width = 1;
+        for (i = 0; i < nfiles; i++) {
+            if (files[i] == NULL || !strcmp(files[i], "-"))
+                failed[i] = fstat(STDIN_FILENO, &st[i]);
+            else
+                failed[i] = stat(files[i], &st[i]);
+            if (failed[i])
+                continue;
+            if (!S_ISREG(st[i].st_mode))
+                minimum_width = 7;
+            else
+                regular_total += st[i].st_size;
+        }
+        for (; regular_total >= 10; regular_total /= 10)
+            width++;
+        if (width < minimum_width)
+            width = minimum_width;
+    }
+
+    wc_state_t state;
+    memset(&state, 0, sizeof(state));
+    if (words) {
+        setlocale(LC_CTYPE, "");
+        state.multibyte = MB_CUR_MAX > 1;
+        state.posix = getenv("POSIXLY_CORRECT") != NULL;
+    }
+
+    wc_counts_t total = {0, 0, 0};
+    for (i = 0; i < nfiles; i++) {
+        wc_counts_t counts = {0, 0, 0};
+        bool is_stdin = files[i] == NULL || !strcmp(files[i], "-");
+        int fd = is_stdin ? STDIN_FILENO : open(files[i], O_RDONLY);
+        struct stat fst;
+
+        if (fd < 0) {
+            fprintf(stderr, "wc: %s: %s\n", files[i], strerror(errno));
+            status = EXIT_FAILURE;
+            continue;
+        }
+        if (fstat(fd, &fst) < 0)
+            memset(&fst, 0, sizeof(fst));
+        state.in_word = false;
+        memset(&state.mbstate, 0, sizeof(state.mbstate));
+        if (!wc_fd(fd, &fst, &state, &counts, words, lines)) {
+            fprintf(stderr, "wc: %s: %s\n", is_stdin ? "-" : files[i], strerror(errno));
+            status = EXIT_FAILURE;
+        }
+        if (!is_stdin)
+            close(fd);
+        wc_print(&counts, width, lines, words, bytes, files[i]);
+        total.lines += counts.lines;
+        total.words += counts.words;
+        total.bytes += counts.bytes;
+    }
+    if (nfiles > 1)
+        wc_print(&total, width, lines, words, bytes, "total");
+    fflush(stdout);
+
+    free(files);
+    free(st);
+    free(failed);
+    return status;
+}
@@ -0,0 +1,390 @@
+#include "dsh.h"
+#include <pthread.h>
+#include <zlib.h>
+
+/* Compressed redirections:
+ *
+ *     cmd >z file      what cmd writes is stored in file compressed with gzip
+ *     cmd <z file      cmd reads file uncompressed (gzip or zlib)
+ *
+ * The child only sees a pipe; dsh does the compression. For >z a thread of
+ * dsh reads the pipe in blocks of ZIP_BLOCK bytes that a pool of workers,
+ * one per CPU, compresses at once, each block to a gzip member of its own;
+ * the thread writes them to the file in order, and gunzip reads the members
+ * back as one stream. Up to two blocks per worker are in flight, which
+ * bounds the memory of a stream. For <z the members can only be found by
+ * inflating them, so one thread inflates the file into the pipe. Once the
+ * process is reaped and its stream drained, dsh reports the bytes on either
+ * side, the ratio and the rate.
+ */
+
+#define ZIP_BLOCK   (1 << 20)
+#define ZIP_LEVEL   Z_DEFAULT_COMPRESSION
+#define ZIP_WORKERS 64
+
+typedef struct zblock {
+    struct zblock *next;            /* in the queue of the workers */
+    zstream_t *stream;
+    unsigned char *in, *out;
+    size_t in_len, out_len;
+    bool done, failed;
+} zblock_t;
+
+struct zstream {
+    bool compress;
+    char *path;
+    int file;
+    int pipe;                       /* dsh's end of the pipe */
+    int child_fd;                   /* the child's end, until it is forked */
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t lock;
+    pthread_cond_t done;            /* a block of the stream is compressed */
+    uint64_t file_bytes, data_bytes;
+    uint64_t start, elapsed;        /* stats_clock() ns */
+    bool failed;
+};
+
+static pthread_once_t zip_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static zblock_t *queue_head, *queue_tail;
+static int zip_workers;
+
+static bool zip_write(int fd, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Reads up to len bytes, fewer only at the end of the input */
+static ssize_t zip_read(int fd, unsigned char *data, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, data + got, len - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        got += n;
+    }
+    return got;
+}
+
+/* Compresses a block to a gzip member */
+static void zip_block(zblock_t *b) {
+    z_stream z = { 0 };
+    b->failed = true;
+    if (deflateInit2(&z, ZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return;
+    b->out_len = deflateBound(&z, b->in_len);
+    if ((b->out = malloc(b->out_len))) {
+        z.next_in = b->in;
+        z.avail_in = b->in_len;
+        z.next_out = b->out;
+        z.avail_out = b->out_len;
+        if (deflate(&z, Z_FINISH) == Z_STREAM_END) {
+            b->out_len = z.total_out;
+            b->failed = false;
+        }
+    }
+    deflateEnd(&z);
+}
+
+static void *zip_worker(void *arg) {
+    zblock_t *b;
+    while (1) {
+        pthread_mutex_lock(&queue_lock);
+        while ((b = queue_head) == NULL)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        if (!(queue_head = b->next))
+            queue_tail = NULL;
+        pthread_mutex_unlock(&queue_lock);
+
+        zip_block(b);
+        pthread_mutex_lock(&b->stream->lock);
+        b->done = true;
+        pthread_cond_broadcast(&b->stream->done);
+        pthread_mutex_unlock(&b->stream->lock);
+    }
+    return NULL;
+}
+
+static void zip_start_workers() {
+    pthread_t thread;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, count = cpus < 1 ? 1 : cpus > ZIP_WORKERS ? ZIP_WORKERS : cpus;
+    for (i = 0; i < count; i++)
+        if (pthread_create(&thread, NULL, zip_worker, NULL) == 0) {
+            pthread_detach(thread);
+            zip_workers++;
+        }
+}
+
+static void zip_submit(zblock_t *b) {
+    b->next = NULL;
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail)
+        queue_tail->next = b;
+    else
+        queue_head = b;
+    queue_tail = b;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/* Writes the oldest block of the window once compressed, and frees it */
+static void zip_retire(zstream_t *z, zblock_t *b) {
+    pthread_mutex_lock(&z->lock);
+    while (!b->done)
+        pthread_cond_wait(&z->done, &z->lock);
+    pthread_mutex_unlock(&z->lock);
+    if (b->failed || !zip_write(z->file, b->out, b->out_len))
+        z->failed = true;
+    else
+        z->file_bytes += b->out_len;
+    free(b->in);
+    free(b->out);
+    free(b);
+}
+
+/* >z: blocks of the pipe to the workers, the members to the file */
+static void zip_compress(zstream_t *z) {
+    int window = 2 * zip_workers, head = 0, count = 0;
+    zblock_t **ring = calloc(window, sizeof(zblock_t *));
+    bool eof = false;
+
+    if (ring == NULL || zip_workers == 0) {
+        z->failed = true;
+        free(ring);
+        return;
+    }
+    while (!eof || count > 0) {
+        if (!eof && count < window) {
+            zblock_t *b = calloc(1, sizeof(zblock_t));
+            ssize_t n;
+            if (b == NULL || !(b->in = malloc(ZIP_BLOCK)) || (n = zip_read(z->pipe, b->in, ZIP_BLOCK)) < 0) {
+                if (b)
+                    free(b->in);
+                free(b);
+                z->failed = eof = true;
+                continue;
+            }
+            if (n < ZIP_BLOCK)
+                eof = true;
+            /* an empty input still makes a gzip file, of one empty member */
+            if (n == 0 && z->data_bytes > 0) {
+                free(b->in);
+                free(b);
+                continue;
+            }
+            b->in_len = n;
+            b->stream = z;
+            z->data_bytes += n;
+            ring[(head + count++) % window] = b;
+            zip_submit(b);
+            continue;
+        }
+        zip_retire(z, ring[head]);
+        head = (head + 1) % window;
+        count--;
+    }
+    free(ring);
+}
+
+/* <z: the file inflated into the pipe, member after member */
+static void zip_decompress(zstream_t *z) {
+    unsigned char *in = malloc(ZIP_BLOCK), *out = malloc(ZIP_BLOCK);
+    z_stream s = { 0 };
+    bool more = false, ended = false;   /* output left for want of room; at the end of a member */
+
+    if (in == NULL || out == NULL || inflateInit2(&s, 15 + 32) != Z_OK) {
+        z->failed = true;
+        free(in);
+        free(out);
+        return;
+    }
+    while (1) {
+        size_t len;
+        int ret;
+        if (s.avail_in == 0 && !more) {
+            ssize_t n = zip_read(z->file, in, ZIP_BLOCK);
+            if (n <= 0) {
+                /* a file cut in the middle of a member is an error */
+                z->failed = n < 0 || !ended;
+                break;
+            }
+            s.next_in = in;
+            s.avail_in = n;
+            z->file_bytes += n;
+        }
+        s.next_out = out;
+        s.avail_out = ZIP_BLOCK;
+        ret = inflate(&s, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            z->failed = true;
+            break;
+        }
+        len = ZIP_BLOCK - s.avail_out;
+        z->data_bytes += len;
+        if (!zip_write(z->pipe, out, len))
+            break;                  /* the reader is gone */
+        more = s.avail_out == 0;
+        if ((ended = ret == Z_STREAM_END))
+            inflateReset(&s);       /* the next member, if any */
+    }
+    inflateEnd(&s);
+    free(in);
+    free(out);
+}
+
+static void *zip_thread(void *arg) {
+    zstream_t *z = arg;
+    sigset_t pipe_signal;
+    /* a reader that exits makes write() fail rather than kill dsh */
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, NULL);
+    if (z->compress)
+        zip_compress(z);
+    else
+        zip_decompress(z);
+    close(z->pipe);
+    z->pipe = -1;
+    z->elapsed = stats_clock() - z->start;
+    return NULL;
+}
+
+static zstream_t *zip_open(const char *path, bool compress) {
+    int dir = current_session ? current_session->cwd : AT_FDCWD;
+    zstream_t *z;
+    pipe_t fds;
+
+    if (!(z = calloc(1, sizeof(zstream_t))))
+        return NULL;
+    z->compress = compress;
+    z->path = strdup(path);
+    z->pipe = z->child_fd = -1;
+    z->file = compress ? openat(dir, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+                       : openat(dir, path, O_RDONLY | O_CLOEXEC);
+    if (z->path == NULL || z->file < 0 || cloexec_pipe(fds) < 0) {
+        logger(STDERR_FILENO, "Could not open %s for %s", path, compress ? "output" : "input");
+        if (z->file >= 0)
+            close(z->file);
+        free(z->path);
+        free(z);
+        return NULL;
+    }
+    z->pipe = compress ? fds[PIPE_READ] : fds[PIPE_WRITE];
+    z->child_fd = compress ? fds[PIPE_WRITE] : fds[PIPE_READ];
+    pthread_mutex_init(&z->lock, NULL);
+    pthread_cond_init(&z->done, NULL);
+    z->start = stats_clock();
+    if (compress)
+        pthread_once(&zip_once, zip_start_workers);
+    if (pthread_create(&z->thread, NULL, zip_thread, z) != 0) {
+        logger(STDERR_FILENO, "Could not start the %s thread", compress ? "compression" : "decompression");
+        close(fds[0]);
+        close(fds[1]);
+        close(z->file);
+        free(z->path);
+        free(z);
+        return NULL;
+    }
+    z->running = true;
+    return z;
+}
+
+/* Called by dsh for every process of a job before it is forked: starts
+ * the streams of its >z and <z redirections */
+void zstream_open(process_t *p) {
+    if (p->ifile && p->izip && !p->zin)
+        p->zin = zip_open(p->ifile, false);
+    if (p->ofile && p->ozip && !p->zout)
+        p->zout = zip_open(p->ofile, true);
+}
+
+/* The end of the pipe the child of z uses, or -1 */
+int zstream_fd(zstream_t *z) {
+    return z ? z->child_fd : -1;
+}
+
+/* Called by dsh once the child of p is forked, or could not be: it keeps
+ * only its own end of the pipes */
+void zstream_forked(process_t *p) {
+    zstream_t *z[] = { p->zin, p->zout };
+    int i;
+    for (i = 0; i < 2; i++)
+        if (z[i] && z[i]->child_fd >= 0) {
+            close(z[i]->child_fd);
+            z[i]->child_fd = -1;
+        }
+}
+
+static void zip_report(process_t *p, zstream_t *z) {
+    FILE *out = current_session ? current_session->out : stdout;
+    double from = (z->compress ? z->data_bytes : z->file_bytes) / 1048576.0;
+    double to = (z->compress ? z->file_bytes : z->data_bytes) / 1048576.0;
+    if (dsh_embedded) {
+        /* -c, scripts and libdsh print no report, but not a failure */
+        if (z->failed)
+            logger(STDERR_FILENO, "Error: %s %s failed", z->compress ? "compressing to" : "decompressing",
+                   z->path);
+        return;
+    }
+    fprintf(out, "%d (%s): %s %.1f MB to %.1f MB, ratio %.2f, %.1f MB/s%s\n", p->pid,
+            z->compress ? "Compressed" : "Decompressed", z->path, from, to,
+            z->file_bytes ? (double) z->data_bytes / z->file_bytes : 0.0,
+            z->elapsed ? z->data_bytes / 1048576.0 / (z->elapsed / 1e9) : 0.0,
+            z->failed ? " (failed)" : "");
+    fflush(out);
+}
+
+/* Waits for the stream to be drained and frees it; true if it failed */
+static bool zip_close(process_t *p, zstream_t *z, bool report) {
+    bool failed;
+    if (z->child_fd >= 0)
+        close(z->child_fd);
+    if (z->running)
+        pthread_join(z->thread, NULL);
+    if (report)
+        zip_report(p, z);
+    failed = z->failed;
+    close(z->file);
+    pthread_mutex_destroy(&z->lock);
+    pthread_cond_destroy(&z->done);
+    free(z->path);
+    free(z);
+    return failed;
+}
+
+/* Called once p is reaped: the file of its >z is complete once this
+ * returns, and a failed stream fails the job */
+void zstream_reaped(job_t *j, process_t *p) {
+    if (p->zin) {
+        j->stream_failed |= zip_close(p, p->zin, true);
+        p->zin = NULL;
+    }
+    if (p->zout) {
+        j->stream_failed |= zip_close(p, p->zout, true);
+        p->zout = NULL;
+    }
+}
+
+/* Called by free_job() for streams of processes that were never reaped */
+void zstream_release(process_t *p) {
+    if (p->zin)
+        zip_close(p, p->zin, false);
+    if (p->zout)
+        zip_close(p, p->zout, false);
+    p->zin = p->zout = NULL;
+}